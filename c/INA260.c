@@ -1,38 +1,473 @@
 #include "INA260.h"
-#include "smbus.h"
-#include <fcntl.h>
+#include "bus.h"
 #include <unistd.h>
-#include <linux/i2c-dev.h>
-#include <linux/i2c.h>
-#include <sys/ioctl.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #define VERBOSE 0
 
-__u8 rd_err = 0;
-__u8 wr_err = 0;
+// Per thread, so sensors on different buses can be sampled concurrently
+__thread __u8 rd_err = 0;
+__thread __u8 wr_err = 0;
 
+// Fast read mode: the INA260 keeps its register pointer between transactions, so a register
+// that is read again can be fetched with a plain 2 byte read instead of a full SMBus word read
+__u8 fast_read_enable = 0;
 
-int i2c_init(__u8 dev_addr)
+#define INA260_MAX_FDS 1024
+static struct ina260_dev fd_devs[INA260_MAX_FDS];	// Device state behind each handle of the handle API
+
+static struct ina260_dev *handle_dev(int fd, struct ina260_dev *tmp)
 {
-	// Returns a file id
-	int fd = 0;
-	char *fileName = "/dev/i2c-1";
-	
-	// Open port for reading and writing
-	if ((fd = open(fileName, O_RDWR)) < 0)
+	// Returns the state of a handle, or tmp describing it if the handle is out of the table
+	if (fd >= 0 && fd < INA260_MAX_FDS)
+		return &fd_devs[fd];
+	tmp->fd = fd;
+	tmp->addr = 0;
+	tmp->fast_read = 0;
+	tmp->pointer = -1;
+	return tmp;
+}
+
+// Latency histograms of the calling thread, NULL when the transactions are not timed
+static __thread struct ina260_latency *latency = NULL;
+
+static void latency_record(__u8 dev_addr, __u8 reg, long long start_ns, int status)
+{
+	int s = dev_addr & (INA260_LAT_SENSORS - 1);
+	int slot = ina260_latency_slot(reg);
+	lat_hist_record(&latency->regs[s][slot], lat_now_ns() - start_ns);
+	if (status != INA260_OK)
+		latency->errors[s][slot]++;
+}
+
+static int dev_read(struct ina260_dev *dev, __u8 reg, __u16 *value, int sticky)
+{
+	// Reads a register, with a plain 2 byte read if sticky is set and the pointer already selects it
+	long long start_ns = latency ? lat_now_ns() : 0;
+	int status = INA260_OK;
+	if (sticky && dev->pointer == reg)
 	{
-		if (VERBOSE) printf("Error! Cannot opend the port\n");
+		__u8 buf[2];
+		int res = bus->read_raw(dev->fd, buf, 2);
+		if (res != 2)
+			status = INA260_ERR_IO;
+		else
+			*value = (buf[0] << 8) | buf[1];
 	}
-	
-	// Set the port options and set the address of the device
-	if (ioctl(fd, I2C_SLAVE, dev_addr) < 0) 
-	{					
-		close(fd);
-		if (VERBOSE) printf("Device with device address  %02x is not reachable\n",dev_addr);
+	else
+	{
+		// The SMBus word read also moves the pointer. The device sends the MSB first
+		__s32 res = bus->read_word(dev->fd, reg);
+		if (res < 0)
+			status = INA260_ERR_IO;
+		else
+			*value = ((res<<8) & 0xFF00) | ((res>>8) & 0xFF);
+	}
+	if (status != INA260_OK && VERBOSE) printf("Error in reading register %02X of device %02X\n", reg, dev->addr);
+	dev->pointer = status == INA260_OK ? reg : -1;
+	if (latency)
+		latency_record(dev->addr, reg, start_ns, status);
+	return status;
+}
+
+static int dev_write(struct ina260_dev *dev, __u8 reg, __u16 value)
+{
+	long long start_ns = latency ? lat_now_ns() : 0;
+	int status = INA260_OK;
+	if (bus->write_word(dev->fd, reg, ((value<<8) & 0xFF00) | ((value>>8) & 0xFF)) < 0)
+	{
+		if (VERBOSE) printf("Error in writing register %02X of device %02X\n", reg, dev->addr);
+		status = INA260_ERR_IO;
+	}
+	dev->pointer = status == INA260_OK ? reg : -1;
+	if (latency)
+		latency_record(dev->addr, reg, start_ns, status);
+	return status;
+}
+
+static const int conversion_times_us[8] = {140, 204, 332, 588, 1100, 2116, 4156, 8244};
+static const int average_counts[8] = {1, 4, 16, 64, 128, 256, 512, 1024};
+
+static int field_code(const int *values, int value)
+{
+	// Returns the 3 bit code of a conversion time or averaging count, -1 if the value has none
+	for (int code = 0; code < 8; code++)
+	{
+		if (values[code] == value)
+			return code;
+	}
+	return -1;
+}
+
+void ina260_profile_default(struct ina260_profile *p, __u8 current_enable, __u8 voltage_enable, int conversion_time)
+{
+	// Continuous conversions without averaging, with the same conversion time for current and voltage
+	memset(p, 0, sizeof(*p));
+	p->current_enable = current_enable;
+	p->voltage_enable = voltage_enable;
+	p->current_ct_us = conversion_time;
+	p->voltage_ct_us = conversion_time;
+	p->averages = 1;
+}
+
+int ina260_profile_config(const struct ina260_profile *p, __u16 *config)
+{
+	/*
+	Computes the Configuration register value of a profile
+
+	Returns INA260_OK or INA260_ERR_ARG for a conversion time or averaging count the device does not support
+	*/
+	int ict = field_code(conversion_times_us, p->current_ct_us);
+	int vct = field_code(conversion_times_us, p->voltage_ct_us);
+	int avg = field_code(average_counts, p->averages);
+	if (ict < 0 || vct < 0 || avg < 0)
+		return INA260_ERR_ARG;
+
+	// Check Datasheet of INA260 for each of the bits. The read-only bits read back as 110
+	__u16 wr_data = bitset(bitset(0x0000, CONF_RO2), CONF_RO1);
+	wr_data |= avg << AVG0;
+	wr_data |= vct << VBUSCT0;
+	wr_data |= ict << ISHCT0;
+	if (p->current_enable)
+		wr_data = bitset(wr_data, MODE0);
+	if (p->voltage_enable)
+		wr_data = bitset(wr_data, MODE1);
+	if (!p->triggered)
+		wr_data = bitset(wr_data, MODE2);
+	*config = wr_data;
+	return INA260_OK;
+}
+
+long ina260_profile_cycle_us(const struct ina260_profile *p)
+{
+	// Returns the time between two results of a profile: every enabled conversion of every averaged sample in turn
+	long us = 0;
+	if (p->current_enable)
+		us += p->current_ct_us;
+	if (p->voltage_enable)
+		us += p->voltage_ct_us;
+	return us * p->averages;
+}
+
+int ina260_profile_parse(const char *spec, struct ina260_profile *p)
+{
+	/*
+	Updates a profile from comma separated key=value settings:
+		ct=<us>			conversion time of current and voltage
+		ict=<us>		conversion time of current (shunt)
+		vct=<us>		conversion time of voltage (bus)
+		avg=<n>			number of samples averaged per result
+		mode=continuous|triggered
+
+	Returns 0 on success, -1 on an unknown key or a value the device does not support
+	*/
+	char buf[256];
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		char *eq = strchr(tok, '=');
+		char *end;
+		if (eq == NULL)
+			return -1;
+		*eq = '\0';
+		char *v = eq + 1;
+		long value = strtol(v, &end, 0);
+		int number = end != v && *end == '\0';
+
+		if (strcmp(tok, "ct") == 0 && number && field_code(conversion_times_us, value) >= 0)
+			p->current_ct_us = p->voltage_ct_us = value;
+		else if (strcmp(tok, "ict") == 0 && number && field_code(conversion_times_us, value) >= 0)
+			p->current_ct_us = value;
+		else if (strcmp(tok, "vct") == 0 && number && field_code(conversion_times_us, value) >= 0)
+			p->voltage_ct_us = value;
+		else if (strcmp(tok, "avg") == 0 && number && field_code(average_counts, value) >= 0)
+			p->averages = value;
+		else if (strcmp(tok, "mode") == 0 && (strcmp(v, "continuous") == 0 || strcmp(v, "triggered") == 0))
+			p->triggered = v[0] == 't';
+		else
+			return -1;
+	}
+	return 0;
+}
+
+int ina260_dev_open(struct ina260_dev *dev, int adapter, __u8 addr)
+{
+	/*
+	Opens a device on an adapter through the active bus backend. Nothing is sent to the device
+
+	Returns INA260_OK, INA260_ERR_ARG for an adapter out of range or INA260_ERR_OPEN
+	*/
+	dev->fd = -1;
+	dev->adapter = adapter;
+	dev->addr = addr;
+	dev->fast_read = 0;
+	dev->pointer = -1;
+	dev->config = 0;
+	dev->mask_enable = 0;
+	if (adapter < 0 || adapter >= INA260_MAX_ADAPTERS)
+		return INA260_ERR_ARG;
+	dev->fd = bus->open(adapter, addr);
+	if (dev->fd < 0)
+	{
+		if (VERBOSE) printf("Device with device address  %02x is not reachable\n",addr);
+		return INA260_ERR_OPEN;
+	}
+	return INA260_OK;
+}
+
+void ina260_dev_close(struct ina260_dev *dev)
+{
+	if (dev->fd >= 0)
+		bus->close(dev->fd);
+	dev->fd = -1;
+	dev->pointer = -1;
+}
+
+int ina260_dev_read(struct ina260_dev *dev, __u8 reg, __u16 *value)
+{
+	/*
+	Reads a register. *value is only written on success
+
+	Returns INA260_OK or INA260_ERR_IO
+	*/
+	return dev_read(dev, reg, value, dev->fast_read);
+}
+
+int ina260_dev_write(struct ina260_dev *dev, __u8 reg, __u16 value)
+{
+	/*
+	Writes a register
+
+	Returns INA260_OK or INA260_ERR_IO
+	*/
+	return dev_write(dev, reg, value);
+}
+
+int ina260_dev_configure(struct ina260_dev *dev, __u8 current_enable, __u8 voltage_enable, int conversion_time)
+{
+	/*
+	Resets the device, checks its identity and sets continuous conversions of
+	the enabled measurements with the given conversion time (in microseconds)
+
+	Returns INA260_OK, INA260_ERR_ARG, INA260_ERR_IO, INA260_ERR_ID or INA260_ERR_VERIFY
+	*/
+	struct ina260_profile p;
+	ina260_profile_default(&p, current_enable, voltage_enable, conversion_time);
+	return ina260_dev_configure_profile(dev, &p);
+}
+
+int ina260_dev_configure_profile(struct ina260_dev *dev, const struct ina260_profile *p)
+{
+	/*
+	Resets the device, checks its identity, writes the Configuration register
+	of the profile and reads it back. In triggered mode the write also starts
+	the first conversion. Sleeps INA260_SETTLE_US after the reset and after the
+	write, see the steps below to configure a device without blocking
+
+	Returns INA260_OK, INA260_ERR_ARG, INA260_ERR_IO, INA260_ERR_ID or INA260_ERR_VERIFY
+	*/
+	__u16 config;
+	int status = ina260_profile_config(p, &config);
+	if (status != INA260_OK)
+		return status;
+	if ((status = ina260_dev_reset(dev)) != INA260_OK)
+		return status;
+	usleep(INA260_SETTLE_US);
+	if ((status = ina260_dev_check_id(dev)) != INA260_OK ||
+	    (status = ina260_dev_write_config(dev, p)) != INA260_OK)
+		return status;
+	usleep(INA260_SETTLE_US);
+	return ina260_dev_verify_config(dev, p);
+}
+
+int ina260_dev_reset(struct ina260_dev *dev)
+{
+	/*
+	First step of a configuration: resets the device. It is given INA260_SETTLE_US
+	before the next step
+
+	Returns INA260_OK or INA260_ERR_IO
+	*/
+	int status = dev_write(dev, REG_CONFIG, bitset(0x0000, RST));
+	if (status != INA260_OK)
+		return status;
+	dev->config = 0;
+	dev->mask_enable = 0;
+	return INA260_OK;
+}
+
+int ina260_dev_check_id(struct ina260_dev *dev)
+{
+	/*
+	Second step of a configuration: checks the manufacturer and die IDs
+
+	Returns INA260_OK, INA260_ERR_IO or INA260_ERR_ID
+	*/
+	__u16 man_id = 0, die = 0;
+	int status;
+	if ((status = dev_read(dev, REG_MANUFACTURER_ID, &man_id, 0)) != INA260_OK ||
+	    (status = dev_read(dev, REG_DIE_ID, &die, 0)) != INA260_OK)
+		return status;
+	return man_id == MAN_ID && die == DIE_ID ? INA260_OK : INA260_ERR_ID;
+}
+
+int ina260_dev_write_config(struct ina260_dev *dev, const struct ina260_profile *p)
+{
+	/*
+	Third step of a configuration: writes the Configuration register of the
+	profile. It is given INA260_SETTLE_US before it is verified
+
+	Returns INA260_OK, INA260_ERR_ARG or INA260_ERR_IO
+	*/
+	__u16 config;
+	int status = ina260_profile_config(p, &config);
+	if (status != INA260_OK)
+		return status;
+	return dev_write(dev, REG_CONFIG, config);
+}
+
+int ina260_dev_verify_config(struct ina260_dev *dev, const struct ina260_profile *p)
+{
+	/*
+	Last step of a configuration: reads the Configuration register back and
+	records it in the context
+
+	Returns INA260_OK, INA260_ERR_ARG, INA260_ERR_IO or INA260_ERR_VERIFY
+	*/
+	__u16 config, read_back = 0;
+	int status = ina260_profile_config(p, &config);
+	if (status != INA260_OK)
+		return status;
+	if ((status = dev_read(dev, REG_CONFIG, &read_back, 0)) != INA260_OK)
+		return status;
+	if (read_back != config)
+		return INA260_ERR_VERIFY;
+	dev->config = config;
+	return INA260_OK;
+}
+
+int ina260_dev_trigger(struct ina260_dev *dev)
+{
+	/*
+	Starts a conversion of a device configured in triggered mode by writing its
+	Configuration register again
+
+	Returns INA260_OK, INA260_ERR_ARG if the device is not configured or INA260_ERR_IO
+	*/
+	if (dev->config == 0)
+		return INA260_ERR_ARG;
+	return dev_write(dev, REG_CONFIG, dev->config);
+}
+
+int ina260_dev_alert_conversion_ready(struct ina260_dev *dev)
+{
+	/*
+	Enables the Conversion Ready alert: ALERT is pulled low (latched until the
+	Mask/Enable register is read) every time a conversion completes
+
+	Returns INA260_OK or INA260_ERR_IO
+	*/
+	__u16 mask_enable = bitset(bitset(0x0000, CNVR), LEN);
+	int status = dev_write(dev, REG_MASK_ENABLE, mask_enable);
+	if (status == INA260_OK)
+		dev->mask_enable = mask_enable;
+	return status;
+}
+
+int ina260_dev_conversion_ready(struct ina260_dev *dev)
+{
+	/*
+	Reads the Mask/Enable register, which also clears the latched alert
+
+	Returns 1 if a conversion completed since the last read, 0 if not or INA260_ERR_IO
+	*/
+	__u16 mask_enable;
+	int status = dev_read(dev, REG_MASK_ENABLE, &mask_enable, 0);
+	if (status != INA260_OK)
+		return status;
+	return (mask_enable >> CVRF) & 1;
+}
+
+const char *ina260_strerror(int status)
+{
+	switch (status)
+	{
+		case INA260_OK: return "success";
+		case INA260_ERR_IO: return "bus transaction failed";
+		case INA260_ERR_OPEN: return "cannot open the device";
+		case INA260_ERR_ID: return "not an INA260";
+		case INA260_ERR_VERIFY: return "register did not read back";
+		case INA260_ERR_ARG: return "invalid argument";
+		default: return "unknown error";
 	}
+}
+
+
+int i2c_init(__u8 dev_addr)
+{
+	// Returns a handle to a device on the default adapter
+	return i2c_init_bus(BUS_DEFAULT_ADAPTER, dev_addr);
+}
 
-	return fd;
+int i2c_init_bus(int adapter, __u8 dev_addr)
+{
+	// Returns a handle from the active bus backend (a file id for i2c-dev)
+	struct ina260_dev dev;
+	if (ina260_dev_open(&dev, adapter, dev_addr) != INA260_OK)
+		return -1;
+	if (dev.fd < INA260_MAX_FDS)
+		fd_devs[dev.fd] = dev;
+	return dev.fd;
+}
+
+void i2c_close(int fd)
+{
+	// Releases a handle returned by i2c_init_bus()
+	if (fd >= 0 && fd < INA260_MAX_FDS)
+		fd_devs[fd].fd = -1;
+	bus->close(fd);
+}
+
+void ina260_set_fast_read(__u8 enable)
+{
+	/*
+	Enables the fast read mode of current_read(), voltage_read() and power_read().
+	Devices of the device API have their own fast_read flag
+	*/
+	fast_read_enable = enable;
+}
+
+void ina260_set_latency(struct ina260_latency *lat)
+{
+	/*
+	Times every register access and batched read of the calling thread into lat
+	(NULL stops the timing)
+	*/
+	latency = lat;
+}
+
+int ina260_latency_slot(__u8 reg)
+{
+	// Returns the index of a register in the histograms of struct ina260_latency
+	switch (reg)
+	{
+		case REG_CONFIG: return 0;
+		case REG_CURRENT: return 1;
+		case REG_BUS_VOLTAGE: return 2;
+		case REG_POWER: return 3;
+		case REG_MASK_ENABLE: return 4;
+		default: return 5;
+	}
+}
+
+const char *ina260_reg_name(int slot)
+{
+	static const char *names[INA260_LAT_REGS] = {"config", "current", "voltage", "power", "mask_enable", "other"};
+	return names[slot];
 }
 
 __u16 bitset(__u16 number, __u8 i)
@@ -100,71 +535,14 @@ __s8 ina260_config(int fd, __u8 current_enable, __u8 voltage_enable, int convers
 
 	// Set Confugation Register
 	wr_addr = REG_CONFIG;
-	wr_data = 0x0000;
-	
-	// Check Datasheet of INA260 for each of the bits
-	
-	// Setting the read-only bits! (CONF_ROX)
-	wr_data = bitset(wr_data, CONF_RO2);
-	wr_data = bitset(wr_data, CONF_RO1);
-	
-	// 
-	// Enabling current and voltage based on user input
-	if (current_enable==1)
-		wr_data = bitset(wr_data, MODE0);
-
-	if (voltage_enable==1)
-		wr_data = bitset(wr_data, MODE1);
-	
-	// Enabling continuous conversion mode
-	wr_data = bitset(wr_data, MODE2);
-
-	// Setting conversion time
-	switch (converstion_time)
+	struct ina260_profile profile;
+	ina260_profile_default(&profile, current_enable, voltage_enable, converstion_time);
+	if (ina260_profile_config(&profile, &wr_data) != INA260_OK)
 	{
-		case 140:
-			break;
-		case 204:
-			bitset(wr_data, ISHCT0);
-			bitset(wr_data, VBUSCT0);
-			break;
-		case 332:
-			bitset(wr_data, ISHCT1);
-			bitset(wr_data, VBUSCT1);
-			break;
-		case 588:
-			bitset(wr_data, ISHCT0);
-			bitset(wr_data, VBUSCT0);
-			bitset(wr_data, ISHCT1);
-			bitset(wr_data, VBUSCT1);
-			break;
-		case 1100:
-			bitset(wr_data, ISHCT2);
-			bitset(wr_data, VBUSCT2);
-			break;
-		case 2116:
-			bitset(wr_data, ISHCT0);
-			bitset(wr_data, VBUSCT0);
-			bitset(wr_data, ISHCT2);
-			bitset(wr_data, VBUSCT2);
-			break;
-		case 4156:
-			bitset(wr_data, ISHCT1);
-			bitset(wr_data, VBUSCT1);
-			bitset(wr_data, ISHCT2);
-			bitset(wr_data, VBUSCT2);
-			break;
-		case 8244:
-			bitset(wr_data, ISHCT0);
-			bitset(wr_data, VBUSCT0);
-			bitset(wr_data, ISHCT1);
-			bitset(wr_data, VBUSCT1);
-			bitset(wr_data, ISHCT2);
-			bitset(wr_data, VBUSCT2);
-			break;
-		default:
-			break;
-	}	
+		// Unsupported conversion times fall back to 140 us
+		profile.current_ct_us = profile.voltage_ct_us = 140;
+		ina260_profile_config(&profile, &wr_data);
+	}
 
 	// Performing register write operation
 	write_reg(fd, wr_addr, wr_data, &wr_err);
@@ -186,52 +564,61 @@ __s8 ina260_config(int fd, __u8 current_enable, __u8 voltage_enable, int convers
 __u16 read_reg(int fd, __u8 address, __u8* err)
 {
 	/*
-		Reads a word from the device
+		Reads a word from the device. The handle is closed if the read fails
 	
 	Parameters:
 		address: register address
 
 	Returns the register value (16 bits)
 	*/
-	__s32 res = i2c_smbus_read_word_data(fd, address);
-	*err = 0;
-	if (res < 0) 
-	{
-		if (VERBOSE) printf("Error in reading! Error code %08X \n",res);
-		*err = 1;
-		close(fd);
-	}
+	struct ina260_dev tmp;
+	__u16 value = 0;
+	*err = dev_read(handle_dev(fd, &tmp), address, &value, 0) != INA260_OK;
+	if (*err)
+		bus->close(fd);
+	return value;
+}
 
-	// Convert result to 16 bits and swap bytes
-	res = ((res<<8) & 0xFF00) | ((res>>8) & 0xFF);
+__u16 read_reg_sticky(int fd, __u8 address, __u8* err)
+{
+	/*
+		Reads a word from the device, skipping the register select byte when
+		the device pointer already points to the register. The handle is closed
+		if the read fails
 
-	return res;
+	Parameters:
+		address: register address
+
+	Returns the register value (16 bits)
+	*/
+	struct ina260_dev tmp;
+	__u16 value = 0;
+	*err = dev_read(handle_dev(fd, &tmp), address, &value, 1) != INA260_OK;
+	if (*err)
+		bus->close(fd);
+	return value;
 }
 
 void write_reg(int fd, __u8 address, __u16 data, __u8* err)
 {
 	/*
-        Writes a word to the device
+        Writes a word to the device. The handle is closed if the write fails
         
         Parameters:
             address: register address
             data: resgister data (16 bits)
 	*/	
-	*err = 0;
-	__s32 res = i2c_smbus_write_word_data(fd, address, ((data<<8) & 0xFF00) | ((data>>8) & 0xFF));
-	if (res < 0) 
-	{
-		if (VERBOSE) printf("Error in writing! Error code %08X \n",res);
-		*err = 1;
-		close(fd);
-	}
+	struct ina260_dev tmp;
+	*err = dev_write(handle_dev(fd, &tmp), address, data) != INA260_OK;
+	if (*err)
+		bus->close(fd);
 	if (VERBOSE) printf("Written address: %02X \t   Written data: %04X\n",address,data);
 }
 
 __u16 voltage_read(int fd)
 {
 	// Returns the voltage register of INA260 (Register 0x02)
-	__u16 output = read_reg(fd, REG_BUS_VOLTAGE, &rd_err);
+	__u16 output = fast_read_enable ? read_reg_sticky(fd, REG_BUS_VOLTAGE, &rd_err) : read_reg(fd, REG_BUS_VOLTAGE, &rd_err);
 	return rd_err?0x7FFF:output;
 }
 
@@ -250,7 +637,7 @@ __s16 reg_to_volt(__u16 reg_voltage_raw)
 __u16 current_read(int fd)
 {
 	// Returns the current register of INA260 (Register 0x01)
-	__u16 output = read_reg(fd, REG_CURRENT, &rd_err);
+	__u16 output = fast_read_enable ? read_reg_sticky(fd, REG_CURRENT, &rd_err) : read_reg(fd, REG_CURRENT, &rd_err);
 	return rd_err?0x7FFF:output;
 }
 
@@ -277,20 +664,48 @@ __s16 reg_to_amp(__u16 reg_current_raw)
 __u16 power_read(int fd)
 {
 	// Returns the power register of INA260 (Register 0x03)
-	__u16 output = read_reg(fd, REG_POWER, &rd_err);
+	__u16 output = fast_read_enable ? read_reg_sticky(fd, REG_POWER, &rd_err) : read_reg(fd, REG_POWER, &rd_err);
 	return rd_err?0x7FFF:output;
 }
 
-__u16 reg_to_watt(__u16 reg_power_raw)
+__u32 reg_to_watt(__u16 reg_power_raw)
 {
 	/*
 	Converts the power register raw value to Milliwatts
 	Parameters:
 		reg_power_raw: raw value read from power register of INA260
 
-	Returns the Power in milliwatts
+	Returns the Power in milliwatts (up to 655350, which does not fit in 16 bits)
+	*/
+	return (__u32)reg_power_raw*10;  //   10mW/bit
+}
+
+__s8 ina260_alert_conversion_ready(int fd)
+{
+	/*
+	Enables the Conversion Ready alert: ALERT is pulled low (latched until the
+	Mask/Enable register is read) every time a conversion completes
+
+	Returns 0 on success, 1 if the register write failed
+	*/
+	__u16 wr_data = 0x0000;
+	wr_data = bitset(wr_data, CNVR);
+	wr_data = bitset(wr_data, LEN);
+	write_reg(fd, REG_MASK_ENABLE, wr_data, &wr_err);
+	return wr_err;
+}
+
+__s8 conversion_ready(int fd)
+{
+	/*
+	Reads the Mask/Enable register, which also clears the latched alert
+
+	Returns 1 if a conversion completed since the last read, 0 if not and -1 on error
 	*/
-	return reg_power_raw*10;  //   10mW/bit
+	__u16 mask_enable = read_reg(fd, REG_MASK_ENABLE, &rd_err);
+	if (rd_err)
+		return -1;
+	return (mask_enable >> CVRF) & 1;
 }
 
 
@@ -309,3 +724,113 @@ __u16 die_id(int fd)
 	*/
 	return read_reg(fd, REG_DIE_ID, &rd_err);
 }
+
+int ina260_batch_init(struct ina260_batch *batch, int adapter)
+{
+	/*
+	Opens an adapter handle for batched reads
+
+	Parameters:
+		adapter: bus of every sensor added to the batch
+
+	Returns 0 on success, -1 if the adapter cannot be opened
+	*/
+	batch->num_reads = 0;
+	batch->adapter = adapter;
+	if (adapter < 0 || adapter >= INA260_MAX_ADAPTERS)
+		return -1;
+	batch->fd = bus->open_adapter(adapter);
+	return batch->fd < 0 ? -1 : 0;
+}
+
+int ina260_batch_add(struct ina260_batch *batch, struct ina260_dev *dev, __u8 reg, long dst)
+{
+	/*
+	Adds a register read to the batch
+
+	Parameters:
+		dev: device on the adapter of the batch, whose pointer state the batch keeps up to date
+		reg: register address
+		dst: index of the value in the array passed to ina260_batch_read()
+
+	Returns 0 on success, -1 if the batch is full
+	*/
+	int r = batch->num_reads;
+	if (r >= INA260_BATCH_MAX_READS)
+		return -1;
+
+	__u8 dev_addr = dev->addr;
+	batch->devs[r] = dev;
+	batch->pointer[r] = reg;
+	batch->dst[r] = dst;
+
+	// Pointer register write
+	batch->msgs[2*r].addr = dev_addr;
+	batch->msgs[2*r].flags = 0;
+	batch->msgs[2*r].len = 1;
+	batch->msgs[2*r].buf = &batch->pointer[r];
+
+	// Register read (MSB first) after a repeated start
+	batch->msgs[2*r+1].addr = dev_addr;
+	batch->msgs[2*r+1].flags = I2C_M_RD;
+	batch->msgs[2*r+1].len = 2;
+	batch->msgs[2*r+1].buf = batch->data[r];
+
+	batch->num_reads++;
+	return 0;
+}
+
+int ina260_batch_read(struct ina260_batch *batch, __u16 *out)
+{
+	/*
+	Reads every register of the batch, with a single I2C_RDWR call as long as
+	the batch fits in the kernel limit of messages per call
+
+	Parameters:
+		out: out[dst] receives the register added with index dst
+
+	Returns 0 on success, -1 if any transfer failed (out is then partially updated)
+	*/
+	struct i2c_msg msgs[2 * INA260_BATCH_MAX_READS];
+	int total = 0;
+	for (int r = 0; r < batch->num_reads; r++)
+	{
+		// In fast read mode the pointer write is skipped when the device already points to the register
+		struct ina260_dev *dev = batch->devs[r];
+		if (!dev->fast_read || dev->pointer != batch->pointer[r])
+			msgs[total++] = batch->msgs[2*r];
+		msgs[total++] = batch->msgs[2*r+1];
+		dev->pointer = batch->pointer[r];
+	}
+
+	long long start_ns = latency ? lat_now_ns() : 0;
+	for (int m = 0; m < total; m += INA260_RDWR_MAX_MSGS)
+	{
+		int n = total - m < INA260_RDWR_MAX_MSGS ? total - m : INA260_RDWR_MAX_MSGS;
+		int res = bus->transfer(batch->fd, &msgs[m], n);
+		if (res < 0)
+		{
+			if (VERBOSE) printf("Error in batched reading! Error code %08X \n",res);
+			for (int r = 0; r < batch->num_reads; r++)
+				batch->devs[r]->pointer = -1;
+			if (latency)
+			{
+				lat_hist_record(&latency->batch, lat_now_ns() - start_ns);
+				latency->batch_errors++;
+			}
+			return -1;
+		}
+	}
+	if (latency)
+		lat_hist_record(&latency->batch, lat_now_ns() - start_ns);
+
+	for (int r = 0; r < batch->num_reads; r++)
+		out[batch->dst[r]] = (batch->data[r][0] << 8) | batch->data[r][1];
+	return 0;
+}
+
+void ina260_batch_close(struct ina260_batch *batch)
+{
+	bus->close(batch->fd);
+	batch->fd = -1;
+}
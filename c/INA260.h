@@ -9,6 +9,8 @@ Circuit detail:
 
 
 #include <linux/types.h>
+#include <linux/i2c.h>
+#include "latency.h"
 
 #ifndef _INA260_H_
 #define _INA260_H_
@@ -69,10 +71,103 @@ Circuit detail:
 #define CONVERSION_TIME_4156us 0x6
 #define CONVERSION_TIME_8244us 0x7
 
-
-
+#define INA260_MAX_ADAPTERS 32 // Highest adapter number + 1 a sensor can be attached to
+#define INA260_SETTLE_US 20000 // Time given to a sensor after a reset and after a configuration write
+
+// Status codes of the device API
+#define INA260_OK 0
+#define INA260_ERR_IO -1	// A transaction failed on the bus
+#define INA260_ERR_OPEN -2	// The adapter or the device cannot be opened
+#define INA260_ERR_ID -3	// The device does not identify as an INA260
+#define INA260_ERR_VERIFY -4	// A written register does not read back
+#define INA260_ERR_ARG -5	// Invalid argument
+
+// State of one sensor. Every function of the device API only touches the context it is given and
+// never closes it on an error, so different devices can be used from different threads at once
+struct ina260_dev
+{
+	int fd;				// Handle from the bus backend, -1 when closed
+	int adapter;
+	__u8 addr;
+	__u8 fast_read;			// Skip the register select byte when the pointer already selects the register
+	__s16 pointer;			// Register the device pointer selects, -1 if unknown
+	__u16 config;			// Configuration register as last written and verified, 0 if unknown
+	__u16 mask_enable;		// Mask/Enable register as last written
+};
+
+// Conversion settings of a sensor, written to its Configuration register
+struct ina260_profile
+{
+	__u8 current_enable;		// Shunt current conversions
+	__u8 voltage_enable;		// Bus voltage conversions
+	__u8 triggered;			// One conversion per trigger instead of continuous conversions
+	int current_ct_us;		// Conversion times: 140, 204, 332, 588, 1100, 2116, 4156 or 8244 us
+	int voltage_ct_us;
+	int averages;			// Samples averaged per result: 1, 4, 16, 64, 128, 256, 512 or 1024
+};
+
+#define INA260_BATCH_MAX_READS 48
+#define INA260_RDWR_MAX_MSGS 42 // I2C_RDWR_IOCTL_MAX_MSGS, the kernel limit of messages per I2C_RDWR call
+
+// Register reads of several sensors performed as combined I2C_RDWR transfers:
+// a pointer write followed by a 2 byte read for each register, joined by repeated starts
+struct ina260_batch
+{
+	int fd;
+	int adapter;
+	int num_reads;
+	struct i2c_msg msgs[2 * INA260_BATCH_MAX_READS];
+	struct ina260_dev *devs[INA260_BATCH_MAX_READS];
+	__u8 pointer[INA260_BATCH_MAX_READS];
+	__u8 data[INA260_BATCH_MAX_READS][2];
+	long dst[INA260_BATCH_MAX_READS];
+};
+
+#define INA260_LAT_SENSORS 16	// Sensors are told apart by the low 4 bits of their address (0x40 to 0x4F)
+#define INA260_LAT_REGS 6	// Configuration, current, voltage, power, mask/enable and the other registers
+
+// Transaction latencies of the sensors of one bus, filled by the register accesses of the thread it is attached to
+struct ina260_latency
+{
+	struct lat_hist regs[INA260_LAT_SENSORS][INA260_LAT_REGS];
+	long errors[INA260_LAT_SENSORS][INA260_LAT_REGS];
+	struct lat_hist batch;		// Combined I2C_RDWR transfers
+	long batch_errors;
+};
+
+
+// Device API
+int ina260_dev_open(struct ina260_dev *dev, int adapter, __u8 addr);
+void ina260_dev_close(struct ina260_dev *dev);
+int ina260_dev_read(struct ina260_dev *dev, __u8 reg, __u16 *value);
+int ina260_dev_write(struct ina260_dev *dev, __u8 reg, __u16 value);
+int ina260_dev_configure(struct ina260_dev *dev, __u8 current_enable, __u8 voltage_enable, int conversion_time);
+int ina260_dev_configure_profile(struct ina260_dev *dev, const struct ina260_profile *p);
+int ina260_dev_reset(struct ina260_dev *dev);
+int ina260_dev_check_id(struct ina260_dev *dev);
+int ina260_dev_write_config(struct ina260_dev *dev, const struct ina260_profile *p);
+int ina260_dev_verify_config(struct ina260_dev *dev, const struct ina260_profile *p);
+int ina260_dev_trigger(struct ina260_dev *dev);
+int ina260_dev_alert_conversion_ready(struct ina260_dev *dev);
+int ina260_dev_conversion_ready(struct ina260_dev *dev);
+const char *ina260_strerror(int status);
+
+// Conversion profiles
+void ina260_profile_default(struct ina260_profile *p, __u8 current_enable, __u8 voltage_enable, int conversion_time);
+int ina260_profile_config(const struct ina260_profile *p, __u16 *config);
+long ina260_profile_cycle_us(const struct ina260_profile *p);
+int ina260_profile_parse(const char *spec, struct ina260_profile *p);
+
+// Handle API: a single device per handle, failing transactions close the handle
 int i2c_init(__u8 address);
+int i2c_init_bus(int adapter, __u8 address);
+void i2c_close(int fd);
 __u16 read_reg(int fd, __u8 address, __u8* err);
+__u16 read_reg_sticky(int fd, __u8 address, __u8* err);
+void ina260_set_fast_read(__u8 enable);
+void ina260_set_latency(struct ina260_latency *lat);
+int ina260_latency_slot(__u8 reg);
+const char *ina260_reg_name(int slot);
 void write_reg(int fd, __u8 address, __u16 data, __u8* err);
 __u16 manufacturer_id(int fd);
 __u16 die_id(int fd);
@@ -84,7 +179,13 @@ __s16 reg_to_volt(__u16 reg_voltage_raw);
 __u16 current_read(int fd);
 __s16 reg_to_amp(__u16 reg_current_raw);
 __u16 power_read(int fd);
-__u16 reg_to_watt(__u16 reg_power_raw);
+__u32 reg_to_watt(__u16 reg_power_raw);
+__s8 ina260_alert_conversion_ready(int fd);
+__s8 conversion_ready(int fd);
+int ina260_batch_init(struct ina260_batch *batch, int adapter);
+int ina260_batch_add(struct ina260_batch *batch, struct ina260_dev *dev, __u8 reg, long dst);
+int ina260_batch_read(struct ina260_batch *batch, __u16 *out);
+void ina260_batch_close(struct ina260_batch *batch);
 
 
 
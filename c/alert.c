@@ -0,0 +1,81 @@
+#include "alert.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+#include <sys/ioctl.h>
+
+int alert_open_gpio(struct alert_line *line, const char *chip, unsigned int offset)
+{
+	/*
+	Requests falling edge events of a GPIO line (ALERT is active low)
+
+	Parameters:
+		chip: GPIO character device, e.g. /dev/gpiochip0
+		offset: line number on that chip
+
+	Returns 0 on success, -1 on failure
+	*/
+	struct gpioevent_request req;
+	int chip_fd = open(chip, O_RDONLY);
+	if (chip_fd < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.lineoffset = offset;
+	req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	req.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+	strncpy(req.consumer_label, "ina260-alert", sizeof(req.consumer_label) - 1);
+
+	int res = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req);
+	close(chip_fd);
+	if (res < 0)
+		return -1;
+
+	// Non-blocking so consuming drains whatever is queued and returns
+	fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+	line->fd = req.fd;
+	line->kind = ALERT_GPIO;
+	return 0;
+}
+
+void alert_open_counter(struct alert_line *line, int fd)
+{
+	// Uses an fd with __u64 counter semantics (timerfd, eventfd) as an alert line
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	line->fd = fd;
+	line->kind = ALERT_COUNTER;
+}
+
+int alert_consume(struct alert_line *line)
+{
+	/*
+	Drains the pending events of a line
+
+	Returns the number of events consumed
+	*/
+	int events = 0;
+	if (line->kind == ALERT_GPIO)
+	{
+		struct gpioevent_data ev[16];
+		ssize_t n;
+		while ((n = read(line->fd, ev, sizeof(ev))) > 0)
+			events += n / sizeof(ev[0]);
+	}
+	else
+	{
+		__u64 count;
+		if (read(line->fd, &count, sizeof(count)) == sizeof(count))
+			events = count;
+	}
+	return events;
+}
+
+void alert_close(struct alert_line *line)
+{
+	if (line->fd >= 0)
+		close(line->fd);
+	line->fd = -1;
+}
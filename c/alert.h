@@ -0,0 +1,33 @@
+/*
+Edge events of the INA260 ALERT pins.
+
+With the Conversion Ready alert enabled, an INA260 pulls its ALERT pin low
+when a conversion completes. Each line is one of:
+
+	ALERT_GPIO	a line of a GPIO character device (/dev/gpiochipN),
+			requested for falling edge events
+	ALERT_COUNTER	any fd that becomes readable and returns a __u64
+			event count (timerfd, eventfd), e.g. the stand-in
+			lines of the simulated sensors
+*/
+
+#include <linux/types.h>
+
+#ifndef _ALERT_H_
+#define _ALERT_H_
+
+#define ALERT_GPIO 0
+#define ALERT_COUNTER 1
+
+struct alert_line
+{
+	int fd;
+	int kind;
+};
+
+int alert_open_gpio(struct alert_line *line, const char *chip, unsigned int offset);
+void alert_open_counter(struct alert_line *line, int fd);
+int alert_consume(struct alert_line *line);
+void alert_close(struct alert_line *line);
+
+#endif
@@ -0,0 +1,536 @@
+#include "INA260.h"
+#include "bus.h"
+#include "capture.h"
+#include "csv_out.h"
+#include "latency.h"
+#include "sampler.h"
+#include "store.h"
+#include "units.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Micro and macro benchmarks of the acquisition and output paths, written as JSON to track regressions:
+//   registers   cost of a register read and write through the driver (simulated sensors by default)
+//   sampling    the bus samplers against simulated sensors with a configurable transaction latency
+//   units       scalar and batch unit conversions (checked against each other on every register value)
+//   writers     CSV (and the localtime() + fprintf() writer it replaced), binary and compressed store throughput
+// 1, 4 and 16 sensors are measured wherever the number of sensors matters
+
+#define BENCH_MAX_RESULTS 128
+
+static const int SENSOR_COUNTS[] = {1, 4, 16};
+#define NUM_SENSOR_COUNTS ((int)(sizeof(SENSOR_COUNTS) / sizeof(SENSOR_COUNTS[0])))
+
+struct bench_result
+{
+    char name[48];
+    int sensors;        // 0 when it does not apply
+    char metric[32];
+    double value;
+    char unit[16];
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int num_results = 0;
+static int quick = 0;
+
+static void add_result(const char *name, int sensors, const char *metric, double value, const char *unit)
+{
+    if (num_results == BENCH_MAX_RESULTS)
+        return;
+    struct bench_result *r = &results[num_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    snprintf(r->metric, sizeof(r->metric), "%s", metric);
+    snprintf(r->unit, sizeof(r->unit), "%s", unit);
+    r->sensors = sensors;
+    r->value = value;
+    fprintf(stderr, "%-24s %3d sensors  %-18s %14.3f %s\n", name, sensors, metric, value, unit);
+}
+
+static double seconds_since(struct timespec st)
+{
+    struct timespec et;
+    clock_gettime(CLOCK_MONOTONIC, &et);
+    return (et.tv_sec - st.tv_sec) + (et.tv_nsec - st.tv_nsec) / 1e9;
+}
+
+// A synthetic capture: 140 us rows of slowly varying current, voltage and power registers
+static unsigned char *synthetic_rows(struct capture_header *hdr, int num_sensors, __u32 fields, long rows)
+{
+    __u8 addrs[CAPTURE_MAX_SENSORS], buses[CAPTURE_MAX_SENSORS], reachable[CAPTURE_MAX_SENSORS];
+    for (int s=0; s<num_sensors; s++)
+    {
+        addrs[s] = 0x40 + s;
+        buses[s] = BUS_DEFAULT_ADAPTER;
+        reachable[s] = 1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    capture_header_init(hdr, num_sensors, addrs, buses, reachable, fields, 140);
+    capture_header_start(hdr, now, 0);
+
+    unsigned char *records = malloc(rows * (long)hdr->record_size);
+    if (records == NULL)
+        return NULL;
+    for (long i=0; i<rows; i++)
+    {
+        struct sample_record *rec = (struct sample_record *)(records + i * (long)hdr->record_size);
+        rec->time_offset = i * 140 + (i * 13) % 5;
+        __u16 *regs = rec->regs;
+        for (int s=0; s<num_sensors; s++)
+        {
+            for (__u32 f=0; f<hdr->num_fields; f++)
+                *regs++ = (f == 1 ? 9600 - (i % 50) : 4000 + (i * 7 + s * 131) % 1600);
+        }
+        capture_set_gaps(hdr, rec, 0);
+    }
+    return records;
+}
+
+// The per-row localtime() + fprintf() loop example.c wrote CSV files with before csv_out.c
+static void legacy_csv_write(const char *filename, const struct capture_header *hdr, const unsigned char *records, long rows)
+{
+    FILE *fpt = fopen(filename, "w+");
+    if (fpt == NULL)
+        return;
+    fprintf(fpt,"Date,Time of the day (us)");
+    for (__u32 s=0; s<hdr->num_sensors; s++)
+    {
+        fprintf(fpt,",Sensor %#02X current (mA)",hdr->sensor_addrs[s]);
+        fprintf(fpt,",Sensor %#02X voltage (mV)",hdr->sensor_addrs[s]);
+    }
+    fprintf(fpt,"\n");
+
+    time_t start_sec = hdr->start_realtime_sec;
+    struct tm *st = localtime(&start_sec);
+    long long starting_time_of_day_us = (((long long)(st->tm_hour))*3600 + ((long long)(st->tm_min))*60 + ((long long)(st->tm_sec)))*1000000 + (long long) hdr->start_realtime_nsec/1000;
+    for (long i=0; i<rows; i++)
+    {
+        const struct sample_record *rec = capture_record(hdr, records, i);
+        time_t timestamp = hdr->start_realtime_sec + (rec->time_offset + hdr->start_realtime_nsec/1000)/1000000;
+        struct tm *ct = localtime(&timestamp);
+        fprintf(fpt,"%02d/%02d/%04d,",(ct->tm_mon+1), ct->tm_mday, (ct->tm_year+1900));
+        fprintf(fpt,"%lld",starting_time_of_day_us + (long long)rec->time_offset);
+        for (__u32 s=0; s<hdr->num_sensors; s++)
+        {
+            fprintf(fpt,",%d",reg_to_amp(rec->regs[2*s]));
+            fprintf(fpt,",%d",reg_to_volt(rec->regs[2*s+1]));
+        }
+        fprintf(fpt,"\n");
+    }
+    fclose(fpt);
+}
+
+static int bench_registers(const char *backend)
+{
+    // Cost of one register transaction through the device API
+    if (bus_select(backend) != 0)
+        return -1;
+    struct ina260_dev dev;
+    if (ina260_dev_open(&dev, BUS_DEFAULT_ADAPTER, 0x40) != INA260_OK || ina260_dev_configure(&dev, 1, 1, 140) != INA260_OK)
+    {
+        fprintf(stderr, "No sensor at 0x40 on the %s backend.\n", bus->name);
+        ina260_dev_close(&dev);
+        return -1;
+    }
+    long n = quick ? 20000 : 200000;
+    __u16 value;
+    struct timespec st;
+
+    for (int fast=0; fast<2; fast++)
+    {
+        dev.fast_read = fast;
+        clock_gettime(CLOCK_MONOTONIC, &st);
+        long errors = 0;
+        for (long i=0; i<n; i++)
+            errors += ina260_dev_read(&dev, REG_CURRENT, &value) != INA260_OK;
+        add_result(fast ? "register_read_fast" : "register_read", 1, "time_per_op", seconds_since(st) * 1e9 / n, "ns");
+        if (errors > 0)
+            add_result(fast ? "register_read_fast" : "register_read", 1, "errors", errors, "count");
+    }
+    dev.fast_read = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (long i=0; i<n; i++)
+        ina260_dev_write(&dev, REG_ALERT, i & 0xFFFF);
+    add_result("register_write", 1, "time_per_op", seconds_since(st) * 1e9 / n, "ns");
+    ina260_dev_close(&dev);
+    return 0;
+}
+
+static int bench_sampling(int num_sensors, int latency_us, int period_us, double seconds)
+{
+    // The bus samplers of example.c on one simulated bus: rows taken, deadlines missed and time per row
+    char spec[64];
+    snprintf(spec, sizeof(spec), "sim:latency_us=%d", latency_us);
+    if (bus_select(spec) != 0)
+        return -1;
+
+    struct ina260_dev devs[CAPTURE_MAX_SENSORS];
+    struct ina260_profile profiles[CAPTURE_MAX_SENSORS];
+    __u8 addrs[CAPTURE_MAX_SENSORS], buses[CAPTURE_MAX_SENSORS], reachable[CAPTURE_MAX_SENSORS];
+    struct sampler_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.current_enable = cfg.voltage_enable = cfg.current_convert = cfg.voltage_convert = 1;
+    cfg.num_fields = 2;
+    cfg.num_samples = seconds * 1e6 / period_us;
+    cfg.period_ns = period_us * 1000LL;
+    atomic_init(&cfg.stop, 0);
+
+    // Everything is released at done: the sensors that were added belong to the sampler
+    struct bus_sampler bs;
+    struct sample_record *rec = NULL;
+    int barrier = 0, status = -1;
+    if (sampler_init(&bs, &cfg, BUS_DEFAULT_ADAPTER, -1) != 0)
+        goto done;
+    struct alert_line no_alert = { .fd = -1 };
+    for (int s=0; s<num_sensors; s++)
+    {
+        addrs[s] = 0x40 + s;
+        buses[s] = BUS_DEFAULT_ADAPTER;
+        reachable[s] = 1;
+        ina260_profile_default(&profiles[s], 1, 1, period_us);
+        if (ina260_dev_open(&devs[s], BUS_DEFAULT_ADAPTER, addrs[s]) != INA260_OK ||
+            ina260_dev_configure_profile(&devs[s], &profiles[s]) != INA260_OK)
+        {
+            ina260_dev_close(&devs[s]);
+            goto done;
+        }
+        sampler_add_sensor(&bs, &devs[s], &profiles[s], 1, no_alert, s);
+    }
+    struct capture_header hdr;
+    capture_header_init(&hdr, num_sensors, addrs, buses, reachable, CAPTURE_FIELD_CURRENT | CAPTURE_FIELD_VOLTAGE, period_us);
+    rec = calloc(1, hdr.record_size);
+    if (rec == NULL)
+        goto done;
+
+    pthread_barrier_init(&cfg.start, NULL, 2);
+    barrier = 1;
+    if (sampler_start(&bs) != 0)
+        goto done;
+    cfg.start_us = lat_now_ns() / 1000;
+    struct timespec st;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    pthread_barrier_wait(&cfg.start);
+    long rows = 0, gaps = 0;
+    int merged;
+    while ((merged = sampler_merge_next(&bs, 1, &hdr, rec)) >= 0)
+    {
+        if (merged == 0)
+        {
+            usleep(100);
+            continue;
+        }
+        gaps += __builtin_popcount(capture_gaps(&hdr, rec));
+        rows++;
+    }
+    double elapsed = seconds_since(st);
+    sampler_join(&bs);
+
+    char name[48];
+    snprintf(name, sizeof(name), "sampling_%dus_lat%dus", period_us, latency_us);
+    add_result(name, num_sensors, "rows_per_s", rows / elapsed, "rows/s");
+    add_result(name, num_sensors, "missed_deadlines", bs.sched.overruns, "count");
+    add_result(name, num_sensors, "sensor_gaps", gaps, "count");
+    add_result(name, num_sensors, "row_time_p50", lat_hist_quantile(&bs.row_time, 0.5) / 1e3, "us");
+    add_result(name, num_sensors, "row_time_p99", lat_hist_quantile(&bs.row_time, 0.99) / 1e3, "us");
+    add_result(name, num_sensors, "wakeup_jitter_p99", lat_hist_quantile(&bs.jitter, 0.99) / 1e3, "us");
+    status = 0;
+
+done:
+    sampler_free(&bs);
+    if (barrier)
+        pthread_barrier_destroy(&cfg.start);
+    free(rec);
+    return status;
+}
+
+static long check_units(void)
+{
+    // Returns the number of register values whose batch conversion differs from the scalar one
+    static __u16 raw[65536];
+    static __s16 ma[65536], mv[65536];
+    static __u32 mw[65536];
+    static __s32 row[65536];
+    static __u8 kinds[65536];
+    for (long i=0; i<65536; i++)
+    {
+        raw[i] = i;
+        kinds[i] = i % 3;
+    }
+    units_amps(raw, ma, 65536);
+    units_volts(raw, mv, 65536);
+    units_watts(raw, mw, 65536);
+    units_row(raw, kinds, row, 65536);
+
+    long mismatches = 0;
+    for (long i=0; i<65536; i++)
+    {
+        __s32 expected = kinds[i] == UNIT_CURRENT ? reg_to_amp(i) : kinds[i] == UNIT_VOLTAGE ? reg_to_volt(i) : (__s32)reg_to_watt(i);
+        if (ma[i] != reg_to_amp(i) || mv[i] != reg_to_volt(i) || mw[i] != reg_to_watt(i) || row[i] != expected)
+        {
+            if (mismatches++ < 10)
+                fprintf(stderr, "\033[31mRegister %#06lx: %d mA %d mV %u mW %d, scalar %d mA %d mV %u mW %d\033[0m\n", i, ma[i],
+                        mv[i], mw[i], row[i], reg_to_amp(i), reg_to_volt(i), reg_to_watt(i), expected);
+        }
+    }
+    return mismatches;
+}
+
+static int bench_units(void)
+{
+    long n = quick ? 1 << 20 : 16 << 20;
+    __u16 *raw = malloc(n * sizeof(__u16));
+    __s16 *out = malloc(n * sizeof(__s16));
+    if (raw == NULL || out == NULL)
+        return -1;
+    for (long i=0; i<n; i++)
+        raw[i] = 4000 + (i * 7) % 1600;
+
+    struct timespec st;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (long i=0; i<n; i++)
+        out[i] = reg_to_amp(raw[i]);
+    double scalar_s = seconds_since(st);
+    long long checksum = 0;
+    for (long i=0; i<n; i++)
+        checksum += out[i];
+
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    units_amps(raw, out, n);
+    double batch_s = seconds_since(st);
+    for (long i=0; i<n; i++)
+        checksum -= out[i];
+    free(raw);
+    free(out);
+
+    add_result("units_scalar", 0, "throughput", n / scalar_s / 1e6, "Mvalues/s");
+    add_result("units_batch", 0, "throughput", n / batch_s / 1e6, "Mvalues/s");
+    add_result("units_batch", 0, "speedup", scalar_s / batch_s, "x");
+    return checksum == 0 ? 0 : -1;
+}
+
+static int bench_writers(int num_sensors, const char *dir)
+{
+    // Everything is released at done, the store is zeroed so it can be freed before store_init()
+    long rows = (quick ? 200000 : 2000000) / num_sensors;
+    __u32 fields = CAPTURE_FIELD_CURRENT | CAPTURE_FIELD_VOLTAGE;
+    struct capture_header hdr;
+    struct sample_store store;
+    struct sample_record *rec = NULL;
+    memset(&store, 0, sizeof(store));
+    int status = -1;
+    unsigned char *records = synthetic_rows(&hdr, num_sensors, fields, rows);
+    if (records == NULL)
+        return -1;
+    char filename[512];
+    struct timespec st;
+
+    // CSV formatter, against the writer it replaced
+    snprintf(filename, sizeof(filename), "%s/ina260_bench.csv", dir);
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    legacy_csv_write(filename, &hdr, records, rows);
+    double legacy_s = seconds_since(st);
+    unlink(filename);
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    struct csv_out out;
+    if (csv_open(&out, filename, &hdr) != 0)
+        goto done;
+    for (long i=0; i<rows; i++)
+        csv_write_row(&out, capture_record(&hdr, records, i));
+    unsigned long long csv_bytes = out.bytes;
+    status = csv_close(&out);
+    double csv_s = seconds_since(st);
+    unlink(filename);
+    add_result("csv_writer", num_sensors, "rows_per_s", rows / csv_s, "rows/s");
+    add_result("csv_writer", num_sensors, "throughput", (csv_bytes + 0.0) / csv_s / 1e6, "MB/s");
+    add_result("csv_writer_legacy", num_sensors, "rows_per_s", rows / legacy_s, "rows/s");
+    add_result("csv_writer", num_sensors, "speedup", legacy_s / csv_s, "x");
+
+    // Binary capture, appended row by row like the streaming writer
+    snprintf(filename, sizeof(filename), "%s/ina260_bench.bin", dir);
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    struct capture_file capture;
+    if (capture_create(&capture, filename, &hdr, 0) != 0)
+    {
+        status = -1;
+        goto done;
+    }
+    for (long i=0; i<rows && status == 0; i++)
+        status = capture_append(&capture, capture_record(&hdr, records, i));
+    status |= capture_close(&capture, capture.count);
+    double bin_s = seconds_since(st);
+    unlink(filename);
+    add_result("bin_writer", num_sensors, "rows_per_s", rows / bin_s, "rows/s");
+    add_result("bin_writer", num_sensors, "throughput", rows * (double)hdr.record_size / bin_s / 1e6, "MB/s");
+
+    // Compressed store: encoding while sampling, decoding for the writers
+    rec = calloc(1, hdr.record_size);
+    if (rec == NULL || store_init(&store, &hdr) != 0)
+    {
+        status = -1;
+        goto done;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    for (long i=0; i<rows && status == 0; i++)
+        status = store_append(&store, capture_record(&hdr, records, i));
+    status |= store_flush(&store);
+    double enc_s = seconds_since(st);
+    if (status != 0)
+        goto done;  // The rows were not all encoded, there is nothing to compare the decoding with
+    struct store_reader reader;
+    if (store_reader_init(&reader, &store) != 0)
+    {
+        status = -1;
+        goto done;
+    }
+    long decoded = 0;
+    clock_gettime(CLOCK_MONOTONIC, &st);
+    while (store_read(&reader, rec) == 1)
+        decoded++;
+    double dec_s = seconds_since(st);
+    store_reader_free(&reader);
+    add_result("store_encode", num_sensors, "rows_per_s", rows / enc_s, "rows/s");
+    add_result("store_decode", num_sensors, "rows_per_s", decoded / dec_s, "rows/s");
+    add_result("store_encode", num_sensors, "ratio", rows * (double)hdr.record_size / store.bytes, "x");
+    if (decoded != rows)
+        status = -1;
+
+done:
+    store_free(&store);
+    free(rec);
+    free(records);
+    return status;
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+    // Quotes, backslashes and control characters are escaped
+    fputc('"', f);
+    for (; *s != '\0'; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void write_json(FILE *f, const char *label, int latency_us, int period_us)
+{
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(f, "{\n  \"label\": ");
+    write_json_string(f, label);
+    fprintf(f, ",\n  \"date\": \"%s\",\n  \"cpus\": %ld,\n", date, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(f, "  \"quick\": %s,\n  \"sampling_period_us\": %d,\n  \"bus_latency_us\": %d,\n  \"results\": [\n",
+            quick ? "true" : "false", period_us, latency_us);
+    for (int i=0; i<num_results; i++)
+    {
+        const struct bench_result *r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"sensors\": %d, \"metric\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}%s\n",
+                r->name, r->sensors, r->metric, r->value, r->unit, i + 1 < num_results ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = NULL;
+    const char *label = "";
+    const char *backend = "sim";
+    const char *dir = "/tmp";
+    int latency_us = 50;
+    int period_us = 140;
+    double seconds = 2;
+    int c;
+    while ((c = getopt(argc, argv, "o:L:b:d:l:s:t:q")) != -1)
+    {
+        switch (c)
+        {
+            case 'o':
+                output = optarg;
+                break;
+            case 'L':
+                label = optarg;
+                break;
+            case 'b':
+                backend = optarg;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'l':
+                latency_us = atoi(optarg);
+                break;
+            case 's':
+                period_us = atoi(optarg);
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 'q':
+                quick = 1;
+                break;
+            default:
+                printf("Usage: %s [-o results.json] [-L label] [-b register backend] [-d scratch directory]\n", argv[0]);
+                printf("          [-l bus latency us] [-s sampling period us] [-t seconds per sampling run] [-q]\n");
+                return 1;
+        }
+    }
+    if (quick)
+        seconds = seconds > 0.5 ? 0.5 : seconds;
+
+    int status = 0;
+    long mismatches = check_units();
+    if (mismatches > 0)
+    {
+        fprintf(stderr, "\033[31m%ld register values are converted differently by the batch conversions.\033[0m\n", mismatches);
+        status = 1;
+    }
+    add_result("units_check", 0, "mismatches", mismatches, "count");
+
+    if (bench_registers(backend) != 0)
+        status = 1;
+    for (int k=0; k<NUM_SENSOR_COUNTS; k++)
+    {
+        if (bench_sampling(SENSOR_COUNTS[k], latency_us, period_us, seconds) != 0)
+        {
+            fprintf(stderr, "\033[31mThe sampling benchmark of %d sensors failed.\033[0m\n", SENSOR_COUNTS[k]);
+            status = 1;
+        }
+    }
+    if (bench_units() != 0)
+        status = 1;
+    for (int k=0; k<NUM_SENSOR_COUNTS; k++)
+    {
+        if (bench_writers(SENSOR_COUNTS[k], dir) != 0)
+        {
+            fprintf(stderr, "\033[31mThe writer benchmarks of %d sensors failed.\033[0m\n", SENSOR_COUNTS[k]);
+            status = 1;
+        }
+    }
+
+    FILE *f = output ? fopen(output, "w") : stdout;
+    if (f == NULL)
+    {
+        fprintf(stderr, "\033[31mCannot create %s.\033[0m\n", output);
+        return 1;
+    }
+    write_json(f, label, latency_us, period_us);
+    if (output != NULL)
+    {
+        if (fclose(f) != 0)
+            status = 1;
+        fprintf(stderr, "Results were written to %s.\n", output);
+    }
+    return status;
+}
@@ -0,0 +1,115 @@
+#include "bus.h"
+#include "sim_ina260.h"
+#include "smbus.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <stdio.h>
+#include <errno.h>
+#define VERBOSE 0
+
+#define I2C_DEV_FILE "/dev/i2c-%d"
+
+static int i2c_dev_open(int adapter, __u8 dev_addr)
+{
+	// Returns a file id
+	int fd = 0;
+	char fileName[32];
+	snprintf(fileName, sizeof(fileName), I2C_DEV_FILE, adapter);
+
+	// Open port for reading and writing
+	if ((fd = open(fileName, O_RDWR)) < 0)
+	{
+		if (VERBOSE) printf("Error! Cannot opend the port\n");
+		return -1;
+	}
+
+	// Set the port options and set the address of the device
+	if (ioctl(fd, I2C_SLAVE, dev_addr) < 0)
+	{
+		close(fd);
+		if (VERBOSE) printf("Device with device address  %02x is not reachable\n",dev_addr);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int i2c_dev_open_adapter(int adapter)
+{
+	char fileName[32];
+	snprintf(fileName, sizeof(fileName), I2C_DEV_FILE, adapter);
+	int fd = open(fileName, O_RDWR);
+	if (fd < 0)
+	{
+		if (VERBOSE) printf("Error! Cannot opend the port\n");
+		return -1;
+	}
+	return fd;
+}
+
+static int i2c_dev_transfer(int fd, struct i2c_msg *msgs, int nmsgs)
+{
+	struct i2c_rdwr_ioctl_data rdwr;
+	rdwr.msgs = msgs;
+	rdwr.nmsgs = nmsgs;
+
+	int res = ioctl(fd, I2C_RDWR, &rdwr);
+	return res < 0 ? -errno : res;
+}
+
+static int i2c_dev_read_raw(int fd, __u8 *buf, int len)
+{
+	ssize_t res = read(fd, buf, len);
+	return res < 0 ? -errno : (int)res;
+}
+
+static void i2c_dev_close(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+const struct bus_ops i2c_dev_bus = {
+	.name = "i2c-dev",
+	.open = i2c_dev_open,
+	.close = i2c_dev_close,
+	.read_word = i2c_smbus_read_word_data,
+	.write_word = i2c_smbus_write_word_data,
+	.read_raw = i2c_dev_read_raw,
+	.open_adapter = i2c_dev_open_adapter,
+	.transfer = i2c_dev_transfer,
+};
+
+const struct bus_ops *bus = &i2c_dev_bus;
+
+int bus_select(const char *spec)
+{
+	/*
+	Selects the active bus backend
+
+	Parameters:
+		spec: backend name, optionally followed by ':' and backend options
+		      (e.g. "sim:latency_us=50,bus_hz=1000000")
+
+	Returns 0 on success, -1 if the backend or its options are unknown
+	*/
+	const char *opts = strchr(spec, ':');
+	size_t len = opts ? (size_t)(opts - spec) : strlen(spec);
+
+	if (len == strlen(i2c_dev_bus.name) && strncmp(spec, i2c_dev_bus.name, len) == 0)
+	{
+		bus = &i2c_dev_bus;
+		return 0;
+	}
+	if (len == strlen(sim_bus.name) && strncmp(spec, sim_bus.name, len) == 0)
+	{
+		if (opts && sim_ina260_parse(opts + 1) != 0)
+			return -1;
+		bus = &sim_bus;
+		return 0;
+	}
+	return -1;
+}
@@ -0,0 +1,52 @@
+/*
+Bus backends used by the INA260 driver.
+
+The driver never talks to /dev/i2c-* directly. Every transaction goes
+through the active backend so the same acquisition code can run against
+real hardware (i2c-dev) or against the in-process simulated INA260 bank.
+Handles are bound to an adapter (the N of /dev/i2c-N), so sensors can be
+spread over several buses.
+
+	i2c-dev		Linux i2c-dev character device (default)
+	sim		Simulated INA260 devices, see sim_ina260.h
+*/
+
+#include <linux/types.h>
+#include <linux/i2c.h>
+
+#ifndef _BUS_H_
+#define _BUS_H_
+
+#define BUS_DEFAULT_ADAPTER 1	// /dev/i2c-1, the I2C bus of the Raspberry Pi header
+
+struct bus_ops
+{
+	const char *name;
+
+	// Opens a handle bound to a device address on an adapter. Returns a handle >= 0 or -1
+	int (*open)(int adapter, __u8 dev_addr);
+	void (*close)(int fd);
+
+	// SMBus word transactions. Words are in SMBus (wire) byte order.
+	// Returns the word (read) or 0 (write) on success, a negative errno on failure
+	__s32 (*read_word)(int fd, __u8 command);
+	__s32 (*write_word)(int fd, __u8 command, __u16 value);
+
+	// Plain read of len bytes, without a command byte (the device answers from its register pointer).
+	// Returns the number of bytes read or a negative errno
+	int (*read_raw)(int fd, __u8 *buf, int len);
+
+	// Opens a handle to the adapter itself (not bound to a device) for combined transfers
+	int (*open_adapter)(int adapter);
+
+	// Combined transfer (I2C_RDWR): all messages in one transaction joined by repeated starts.
+	// Returns the number of messages transferred or a negative errno
+	int (*transfer)(int fd, struct i2c_msg *msgs, int nmsgs);
+};
+
+extern const struct bus_ops i2c_dev_bus;
+extern const struct bus_ops *bus;
+
+int bus_select(const char *spec);
+
+#endif
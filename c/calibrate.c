@@ -0,0 +1,139 @@
+#include "calibrate.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int read_sensor_regs(struct ina260_dev *dev, __u32 fields)
+{
+	// Reads the enabled registers of a sensor, returns the number of failed reads
+	__u16 value;
+	int errors = 0;
+	if (fields & CAPTURE_FIELD_CURRENT)
+		errors += ina260_dev_read(dev, REG_CURRENT, &value) != INA260_OK;
+	if (fields & CAPTURE_FIELD_VOLTAGE)
+		errors += ina260_dev_read(dev, REG_BUS_VOLTAGE, &value) != INA260_OK;
+	if (fields & CAPTURE_FIELD_POWER)
+		errors += ina260_dev_read(dev, REG_POWER, &value) != INA260_OK;
+	return errors;
+}
+
+static int finish_sensor(struct ina260_dev *dev, const struct ina260_profile *profile, int alert_enable)
+{
+	// Releases the alert and triggers the next conversion, as the sampler does after reading a sensor
+	int errors = 0;
+	if (alert_enable)
+		errors += ina260_dev_conversion_ready(dev) < 0;
+	if (profile->triggered)
+		errors += ina260_dev_trigger(dev) != INA260_OK;
+	return errors;
+}
+
+static int time_bus(struct calibration *cal, int adapter, struct ina260_dev *devs, const struct ina260_profile *profiles,
+		    const __u8 *reachable, int num_sensors, __u32 fields, int batch_enable, int alert_enable,
+		    struct lat_hist *rows)
+{
+	// Times CALIBRATION_ROWS rows of one bus. Returns -1 if the combined transfer cannot be set up
+	struct ina260_batch *batch = NULL;
+	__u16 regs[INA260_BATCH_MAX_READS];
+	if (batch_enable)
+	{
+		batch = (struct ina260_batch*) malloc(sizeof(struct ina260_batch));
+		if (batch == NULL || ina260_batch_init(batch, adapter) != 0)
+		{
+			free(batch);
+			return -1;
+		}
+		for (int s = 0; s < num_sensors; s++)
+		{
+			if (reachable[s] == 0 || devs[s].adapter != adapter)
+				continue;
+			if (fields & CAPTURE_FIELD_CURRENT)
+				ina260_batch_add(batch, &devs[s], REG_CURRENT, 0);
+			if (fields & CAPTURE_FIELD_VOLTAGE)
+				ina260_batch_add(batch, &devs[s], REG_BUS_VOLTAGE, 0);
+			if (fields & CAPTURE_FIELD_POWER)
+				ina260_batch_add(batch, &devs[s], REG_POWER, 0);
+		}
+	}
+
+	for (int r = 0; r < CALIBRATION_ROWS; r++)
+	{
+		long long start_ns = lat_now_ns();
+		if (batch != NULL)
+			cal->errors += ina260_batch_read(batch, regs) != 0;
+		for (int s = 0; s < num_sensors; s++)
+		{
+			if (reachable[s] == 0 || devs[s].adapter != adapter)
+				continue;
+			if (batch == NULL)
+				cal->errors += read_sensor_regs(&devs[s], fields);
+			cal->errors += finish_sensor(&devs[s], &profiles[s], alert_enable);
+		}
+		lat_hist_record(rows, lat_now_ns() - start_ns);
+	}
+	if (batch != NULL)
+	{
+		ina260_batch_close(batch);
+		free(batch);
+	}
+	return 0;
+}
+
+int calibrate_buses(struct calibration *cal, struct ina260_dev *devs, const struct ina260_profile *profiles,
+		    const __u8 *reachable, int num_sensors, __u32 fields, int batch_enable, int alert_enable)
+{
+	/*
+	Times the register transactions of every configured sensor and of a whole row on every bus
+
+	Parameters:
+		devs, profiles, reachable: configured sensors, in capture order
+		fields: CAPTURE_FIELD_* registers read in every row
+		batch_enable, alert_enable: sampling mode of the measurement
+
+	Returns 0 on success, -1 if memory cannot be allocated or a combined transfer cannot be set up
+	*/
+	memset(cal, 0, sizeof(*cal));
+	cal->rows = CALIBRATION_ROWS;
+	cal->adapter = -1;
+	struct lat_hist *h = (struct lat_hist*) malloc(sizeof(struct lat_hist));
+	if (h == NULL)
+		return -1;
+
+	// Each sensor alone
+	for (int s = 0; s < num_sensors; s++)
+	{
+		if (reachable[s] == 0)
+			continue;
+		memset(h, 0, sizeof(*h));
+		for (int r = 0; r < CALIBRATION_ROWS; r++)
+		{
+			long long start_ns = lat_now_ns();
+			cal->errors += read_sensor_regs(&devs[s], fields);
+			lat_hist_record(h, lat_now_ns() - start_ns);
+		}
+		cal->sensor_ns[s] = lat_hist_quantile(h, 0.5);
+	}
+
+	// Whole rows, one bus at a time
+	int status = 0;
+	for (int s = 0; s < num_sensors && status == 0; s++)
+	{
+		int adapter = devs[s].adapter;
+		int seen = 0;
+		for (int k = 0; k < s; k++)
+			seen |= reachable[k] && devs[k].adapter == adapter;
+		if (reachable[s] == 0 || seen)
+			continue;
+		memset(h, 0, sizeof(*h));
+		status = time_bus(cal, adapter, devs, profiles, reachable, num_sensors, fields, batch_enable, alert_enable, h);
+		__u32 row_ns = lat_hist_quantile(h, 0.99);
+		if (status == 0 && row_ns >= cal->row_ns)
+		{
+			cal->row_ns = row_ns;
+			cal->row_median_ns = lat_hist_quantile(h, 0.5);
+			cal->adapter = adapter;
+		}
+	}
+	free(h);
+	cal->min_period_us = ((__u64)cal->row_ns * (100 + CALIBRATION_MARGIN_PCT) / 100 + 999) / 1000;
+	return status;
+}
@@ -0,0 +1,41 @@
+/*
+Startup calibration of the bus cost.
+
+Before a measurement starts, every bus reads its configured sensors the way
+the sampler will: the same registers, one transaction per register or one
+combined transfer per row (-B), plus the Mask/Enable read that releases the
+alert (-A) and the Configuration write that triggers the next conversion
+(triggered profiles). The buses are timed one after the other; they run in
+parallel during the measurement, so the cost of a row is the one of the
+slowest bus.
+
+From the 99th percentile of the row time, with a safety margin for the rest
+of the sampling loop, follows the shortest sampling period the buses can
+sustain. The cost of each sensor alone (median of its own reads) is kept as
+well, for the capture metadata.
+*/
+
+#include "INA260.h"
+#include "capture.h"
+
+#ifndef _CALIBRATE_H_
+#define _CALIBRATE_H_
+
+#define CALIBRATION_ROWS 200		// Rows timed on each bus
+#define CALIBRATION_MARGIN_PCT 25	// Safety margin added to the row time
+
+struct calibration
+{
+	int rows;			// Rows timed on each bus
+	__u32 sensor_ns[CAPTURE_MAX_SENSORS];	// Median time to read the registers of each sensor
+	__u32 row_ns;			// 99th percentile of the row time of the slowest bus
+	__u32 row_median_ns;		// Median row time of that bus
+	int adapter;			// Slowest bus
+	long errors;			// Failed transactions
+	__u32 min_period_us;		// Shortest sustainable sampling period, margin included
+};
+
+int calibrate_buses(struct calibration *cal, struct ina260_dev *devs, const struct ina260_profile *profiles,
+		    const __u8 *reachable, int num_sensors, __u32 fields, int batch_enable, int alert_enable);
+
+#endif
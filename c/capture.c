@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_Static_assert(sizeof(struct capture_header) == CAPTURE_HEADER_SIZE, "capture header must stay 256 bytes");
+
+#define CAPTURE_GROW_RECORDS (1 << 20) // Growth step of streamed captures
+
+void capture_header_init(struct capture_header *hdr, __u8 num_sensors, const __u8 *addrs, const __u8 *buses,
+			 const __u8 *reachable, __u32 fields, __u32 conversion_time_us)
+{
+	/*
+	Fills the header describing the capture layout
+
+	Parameters:
+		addrs: I2C address of each sensor
+		buses: I2C adapter of each sensor
+		reachable: 1 for the sensors that are sampled
+		fields: CAPTURE_FIELD_* bits of the registers stored for each sensor
+	*/
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	hdr->version = CAPTURE_VERSION;
+	hdr->header_size = CAPTURE_HEADER_SIZE;
+	hdr->num_sensors = num_sensors;
+	hdr->fields = fields;
+	hdr->num_fields = __builtin_popcount(fields);
+	hdr->conversion_time_us = conversion_time_us;
+	hdr->record_size = (sizeof(struct sample_record) + (num_sensors * hdr->num_fields + 1) * sizeof(__u16) + 3) & ~3u;
+	for (int s = 0; s < num_sensors && s < CAPTURE_MAX_SENSORS; s++)
+	{
+		hdr->sensor_addrs[s] = addrs[s];
+		hdr->sensor_buses[s] = buses[s];
+		hdr->reachable[s] = reachable[s];
+	}
+}
+
+int capture_multi_bus(const struct capture_header *hdr)
+{
+	// Returns 1 if the sensors are spread over several adapters (so addresses alone do not name them)
+	for (__u32 s = 1; s < hdr->num_sensors && s < CAPTURE_MAX_SENSORS; s++)
+	{
+		if (hdr->sensor_buses[s] != hdr->sensor_buses[0])
+			return 1;
+	}
+	return 0;
+}
+
+void capture_header_start(struct capture_header *hdr, struct timespec start_realtime, long long start_monotonic_us)
+{
+	// Records the clock anchors the time offsets are relative to
+	hdr->start_realtime_sec = start_realtime.tv_sec;
+	hdr->start_realtime_nsec = start_realtime.tv_nsec;
+	hdr->start_monotonic_us = start_monotonic_us;
+}
+
+static int capture_map(struct capture_file *cf, __u64 capacity)
+{
+	size_t size = CAPTURE_HEADER_SIZE + capacity * cf->hdr->record_size;
+	void *map;
+
+	// Reserve the blocks so a full disk is reported here rather than as SIGBUS while sampling
+	if (posix_fallocate(cf->fd, 0, size) != 0 && ftruncate(cf->fd, size) != 0)
+		return -1;
+
+	if (cf->map == NULL)
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cf->fd, 0);
+	else
+		map = mremap(cf->map, cf->map_size, size, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED)
+		return -1;
+
+	cf->map = map;
+	cf->map_size = size;
+	cf->capacity = capacity;
+	cf->hdr = (struct capture_header *)cf->map;
+	return 0;
+}
+
+int capture_create(struct capture_file *cf, const char *filename, const struct capture_header *hdr, __u64 capacity)
+{
+	/*
+	Creates a capture file sized for capacity records and maps it
+
+	Returns 0 on success, -1 on failure (errno is set)
+	*/
+	memset(cf, 0, sizeof(*cf));
+	cf->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (cf->fd < 0)
+		return -1;
+
+	// capture_map() needs the record size before the header is mapped
+	cf->hdr = (struct capture_header *)hdr;
+	if (capture_map(cf, capacity) != 0)
+	{
+		close(cf->fd);
+		return -1;
+	}
+	memcpy(cf->hdr, hdr, sizeof(*hdr));
+	return 0;
+}
+
+int capture_reserve(struct capture_file *cf, __u64 capacity)
+{
+	// Grows the file and the mapping so it can hold at least capacity records
+	if (capacity <= cf->capacity)
+		return 0;
+	return capture_map(cf, capacity);
+}
+
+struct sample_record *capture_slot(struct capture_file *cf, __u64 index)
+{
+	// Returns record index inside the mapping (index must be below the capacity)
+	return (struct sample_record *)(cf->map + CAPTURE_HEADER_SIZE + index * cf->hdr->record_size);
+}
+
+int capture_append(struct capture_file *cf, const struct sample_record *rec)
+{
+	// Copies a record after the last appended one, growing the file when needed
+	if (cf->count == cf->capacity && capture_reserve(cf, cf->capacity + CAPTURE_GROW_RECORDS) != 0)
+		return -1;
+	memcpy(capture_slot(cf, cf->count), rec, cf->hdr->record_size);
+	cf->count++;
+	return 0;
+}
+
+int capture_close(struct capture_file *cf, __u64 num_records)
+{
+	/*
+	Finalizes the header, trims the file to num_records records and unmaps it.
+	The data is left to the page cache; nothing waits for the disk here.
+
+	Returns 0 on success, -1 on failure
+	*/
+	int status = 0;
+	cf->hdr->num_records = num_records;
+	size_t size = CAPTURE_HEADER_SIZE + num_records * cf->hdr->record_size;
+
+	munmap(cf->map, cf->map_size);
+	if (ftruncate(cf->fd, size) != 0)
+		status = -1;
+	if (close(cf->fd) != 0)
+		status = -1;
+	cf->map = NULL;
+	cf->hdr = NULL;
+	return status;
+}
+
+int capture_open(struct capture_file *cf, const char *filename)
+{
+	/*
+	Maps an existing capture file read-only
+
+	Returns 0 on success, -1 if the file cannot be read or is not a capture
+	*/
+	struct stat st;
+	memset(cf, 0, sizeof(*cf));
+	cf->fd = open(filename, O_RDONLY);
+	if (cf->fd < 0)
+		return -1;
+	if (fstat(cf->fd, &st) != 0 || st.st_size < CAPTURE_HEADER_SIZE)
+	{
+		close(cf->fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	cf->map_size = st.st_size;
+	cf->map = mmap(NULL, cf->map_size, PROT_READ, MAP_SHARED, cf->fd, 0);
+	if (cf->map == MAP_FAILED)
+	{
+		close(cf->fd);
+		return -1;
+	}
+	madvise(cf->map, cf->map_size, MADV_SEQUENTIAL);
+	cf->hdr = (struct capture_header *)cf->map;
+
+	// Version 1 captures differ only by the gap mask, which capture_gaps() derives from their registers
+	if (memcmp(cf->hdr->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 || cf->hdr->version == 0 ||
+	    cf->hdr->version > CAPTURE_VERSION || cf->hdr->record_size == 0 || cf->hdr->num_sensors > CAPTURE_MAX_SENSORS)
+	{
+		capture_release(cf);
+		errno = EINVAL;
+		return -1;
+	}
+
+	// A capture that was not closed properly still has all the records the file size allows
+	cf->capacity = (cf->map_size - CAPTURE_HEADER_SIZE) / cf->hdr->record_size;
+	cf->count = cf->hdr->num_records && cf->hdr->num_records <= cf->capacity ? cf->hdr->num_records : cf->capacity;
+	return 0;
+}
+
+void capture_release(struct capture_file *cf)
+{
+	// Unmaps a capture opened with capture_open()
+	munmap(cf->map, cf->map_size);
+	close(cf->fd);
+	cf->map = NULL;
+	cf->hdr = NULL;
+}
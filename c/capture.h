@@ -0,0 +1,127 @@
+/*
+Binary capture format.
+
+A capture file is a fixed 256 byte header followed by fixed-size records:
+
+	struct capture_header	sensor addresses, enabled fields, conversion
+				time, the Configuration register of every
+				sensor, the bus cost measured at startup and
+				the clock anchors of the measurement
+	struct sample_record	__u32 time offset (us since the start of the
+				measurement), the raw __u16 registers of the row
+				and the __u16 gap mask of the row
+
+Records hold, for each sensor, its current register (if enabled), its voltage
+register (if enabled) and its power register (if enabled). Everything is
+stored in host byte order. Bit s of the gap mask is set when sensor s has no
+value in the row (read error, sensor being recovered, or its bus missed the
+deadline of the row); its registers then hold CAPTURE_MISSING, which is also a
+valid reading, so only the mask tells the two apart (capture_gaps()). Version 1
+captures have no gap mask and mark missing registers with CAPTURE_MISSING
+alone, capture_gaps() reads both.
+
+Files are written through a pre-sized shared mapping, so the sampling loop
+stores rows straight into the page cache and saving only truncates the file to
+its final length. ina260_convert turns a capture into the CSV layout.
+*/
+
+#include <linux/types.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#define CAPTURE_MAGIC "INA260C"
+#define CAPTURE_VERSION 2
+#define CAPTURE_HEADER_SIZE 256
+#define CAPTURE_MAX_SENSORS 16
+
+#define CAPTURE_FIELD_CURRENT 0x01
+#define CAPTURE_FIELD_VOLTAGE 0x02
+#define CAPTURE_FIELD_POWER 0x04
+
+// Register value stored for a sensor that has no value in a row, the gap mask of the row tells whether it is missing
+#define CAPTURE_MISSING 0x7FFF
+
+struct capture_header
+{
+	char magic[8];
+	__u32 version;
+	__u32 header_size;
+	__u32 record_size;
+	__u32 num_sensors;
+	__u32 fields;			// CAPTURE_FIELD_* bits
+	__u32 num_fields;
+	__u32 conversion_time_us;
+	__u32 reserved;
+	__u64 num_records;
+	__s64 start_realtime_sec;	// Wall clock at the start of the measurement
+	__s64 start_realtime_nsec;
+	__s64 start_monotonic_us;	// CLOCK_MONOTONIC at the start of the measurement
+	__u8 sensor_addrs[CAPTURE_MAX_SENSORS];
+	__u8 reachable[CAPTURE_MAX_SENSORS];
+	__u8 sensor_buses[CAPTURE_MAX_SENSORS];	// I2C adapter of each sensor
+	__u16 sensor_config[CAPTURE_MAX_SENSORS];	// Configuration register each sensor was verified with, 0 if unknown
+	__u32 sensor_cost_ns[CAPTURE_MAX_SENSORS];	// Median time to read the registers of each sensor, 0 if not calibrated
+	__u32 row_cost_ns;		// 99th percentile of the row time of the slowest bus, 0 if not calibrated
+	__u32 min_period_us;		// Shortest sampling period the buses sustain, 0 if not calibrated
+	__u8 padding[CAPTURE_HEADER_SIZE - 224];
+};
+
+struct sample_record
+{
+	__u32 time_offset;
+	__u16 regs[];
+};
+
+struct capture_file
+{
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	__u64 capacity;		// Number of records the mapping can hold
+	__u64 count;		// Number of records appended with capture_append()
+	struct capture_header *hdr;
+};
+
+void capture_header_init(struct capture_header *hdr, __u8 num_sensors, const __u8 *addrs, const __u8 *buses,
+			 const __u8 *reachable, __u32 fields, __u32 conversion_time_us);
+int capture_multi_bus(const struct capture_header *hdr);
+void capture_header_start(struct capture_header *hdr, struct timespec start_realtime, long long start_monotonic_us);
+
+int capture_create(struct capture_file *cf, const char *filename, const struct capture_header *hdr, __u64 capacity);
+int capture_reserve(struct capture_file *cf, __u64 capacity);
+struct sample_record *capture_slot(struct capture_file *cf, __u64 index);
+int capture_append(struct capture_file *cf, const struct sample_record *rec);
+int capture_close(struct capture_file *cf, __u64 num_records);
+
+int capture_open(struct capture_file *cf, const char *filename);
+void capture_release(struct capture_file *cf);
+
+static inline const struct sample_record *capture_record(const struct capture_header *hdr, const void *base, __u64 index)
+{
+	return (const struct sample_record *)((const unsigned char *)base + index * hdr->record_size);
+}
+
+static inline __u16 capture_gaps(const struct capture_header *hdr, const struct sample_record *rec)
+{
+	// Returns the gap mask of a row: bit s is set when sensor s has no value
+	__u32 num_cells = hdr->num_sensors * hdr->num_fields;
+	if (hdr->version >= 2)
+		return rec->regs[num_cells];
+	__u16 gaps = 0;
+	for (__u32 c = 0; c < num_cells; c++)
+	{
+		if (rec->regs[c] == CAPTURE_MISSING)
+			gaps |= 1 << (c / hdr->num_fields);
+	}
+	return gaps;
+}
+
+static inline void capture_set_gaps(const struct capture_header *hdr, struct sample_record *rec, __u16 gaps)
+{
+	rec->regs[hdr->num_sensors * hdr->num_fields] = gaps;
+}
+
+#endif
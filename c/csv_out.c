@@ -0,0 +1,231 @@
+#include "csv_out.h"
+#include "INA260.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static char *put_u64(char *p, unsigned long long v)
+{
+	// Writes v in decimal at p and returns the end of the digits
+	char tmp[20];
+	char *t = tmp + sizeof(tmp);
+	while (v >= 100)
+	{
+		unsigned idx = (v % 100) * 2;
+		v /= 100;
+		*--t = digit_pairs[idx + 1];
+		*--t = digit_pairs[idx];
+	}
+	if (v >= 10)
+	{
+		*--t = digit_pairs[v * 2 + 1];
+		*--t = digit_pairs[v * 2];
+	}
+	else
+		*--t = '0' + v;
+
+	size_t n = tmp + sizeof(tmp) - t;
+	memcpy(p, t, n);
+	return p + n;
+}
+
+static char *put_int(char *p, int v)
+{
+	if (v < 0)
+	{
+		*p++ = '-';
+		return put_u64(p, -(long long)v);
+	}
+	return put_u64(p, v);
+}
+
+static void csv_flush(struct csv_out *out)
+{
+	// Hands the whole buffer to the kernel, retrying partial writes
+	size_t done = 0;
+	while (done < out->len)
+	{
+		ssize_t n = write(out->fd, out->buf + done, out->len - done);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			out->error = 1;
+			break;
+		}
+		done += n;
+		out->bytes += n;
+	}
+	out->len = 0;
+}
+
+static void csv_update_date(struct csv_out *out, long long abs_us)
+{
+	// Caches the date of abs_us and the wall clock range of that day
+	time_t sec = abs_us / 1000000;
+	struct tm ct;
+	localtime_r(&sec, &ct);
+	snprintf(out->date, sizeof(out->date), "%02d/%02d/%04d,", (ct.tm_mon+1), ct.tm_mday, (ct.tm_year+1900));
+	out->date_len = strlen(out->date);
+
+	ct.tm_hour = 0;
+	ct.tm_min = 0;
+	ct.tm_sec = 0;
+	ct.tm_isdst = -1;
+	out->day_start_us = (long long)mktime(&ct) * 1000000;
+	ct.tm_mday++;
+	ct.tm_isdst = -1;
+	out->next_day_us = (long long)mktime(&ct) * 1000000;
+}
+
+int csv_open(struct csv_out *out, const char *filename, const struct capture_header *hdr)
+{
+	/*
+	Creates the CSV file and writes the header line
+
+	Parameters:
+		hdr: layout and clock anchors of the rows that will be written
+
+	Returns 0 on success, -1 if the file cannot be created
+	*/
+	memset(out, 0, sizeof(*out));
+	out->buf = malloc(CSV_BUFFER_SIZE);
+	if (out->buf == NULL)
+		return -1;
+	out->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out->fd < 0)
+	{
+		free(out->buf);
+		return -1;
+	}
+	out->hdr = hdr;
+	out->num_cells = units_layout(hdr, out->kinds);
+
+	// Date (as long as the cached one can be), time of the day (20 digits at most) and a sign plus 5 digits
+	// (or 6 digits of power) per value
+	out->max_row = (sizeof(out->date) - 1) + 1 + 20 + hdr->num_sensors * hdr->num_fields * 7 + 1;
+
+	char *p = out->buf;
+	p += sprintf(p,"Date,Time of the day (us)");
+	int multi_bus = capture_multi_bus(hdr);
+	for (__u32 s=0; s<hdr->num_sensors; s++)
+	{
+		if (hdr->reachable[s]==1)
+		{
+			// Sensors are named by address, prefixed with their adapter when they are on several buses
+			char name[16];
+			if (multi_bus)
+				snprintf(name, sizeof(name), "%d-%#02X", hdr->sensor_buses[s], hdr->sensor_addrs[s]);
+			else
+				snprintf(name, sizeof(name), "%#02X", hdr->sensor_addrs[s]);
+
+			if (hdr->fields & CAPTURE_FIELD_CURRENT)
+				p += sprintf(p,",Sensor %s current (mA)",name);
+
+			if (hdr->fields & CAPTURE_FIELD_VOLTAGE)
+				p += sprintf(p,",Sensor %s voltage (mV)",name);
+
+			if (hdr->fields & CAPTURE_FIELD_POWER)
+				p += sprintf(p,",Sensor %s power (mW)",name);
+		}
+	}
+	*p++ = '\n';
+	out->len = p - out->buf;
+
+	out->start_us = hdr->start_realtime_sec * 1000000LL + hdr->start_realtime_nsec / 1000;
+	csv_update_date(out, out->start_us);
+	return 0;
+}
+
+void csv_write_row(struct csv_out *out, const struct sample_record *rec)
+{
+	const struct capture_header *hdr = out->hdr;
+	int current_enable = (hdr->fields & CAPTURE_FIELD_CURRENT) != 0;
+	int voltage_enable = (hdr->fields & CAPTURE_FIELD_VOLTAGE) != 0;
+	int power_enable = (hdr->fields & CAPTURE_FIELD_POWER) != 0;
+
+	if (out->len + out->max_row > CSV_BUFFER_SIZE)
+		csv_flush(out);
+
+	// Time offsets are 32 bit microseconds and wrap around after about 71 minutes
+	if (out->rows > 0 && rec->time_offset < out->prev_offset)
+		out->time_base += 1LL << 32;
+	out->prev_offset = rec->time_offset;
+	long long abs_us = out->start_us + out->time_base + rec->time_offset;
+	if (abs_us >= out->next_day_us || abs_us < out->day_start_us)
+		csv_update_date(out, abs_us);
+
+	// Writing date (month, day, and year)
+	char *p = out->buf + out->len;
+	memcpy(p, out->date, out->date_len);
+	p += out->date_len;
+
+	// Writing time of the day in microseconds (number of microseconds past since 12:00AM)
+	p = put_u64(p, abs_us - out->day_start_us);
+
+	// Writing Sensor Data
+	__s32 row[UNITS_MAX_CELLS];
+	units_row(rec->regs, out->kinds, row, out->num_cells);
+	__u16 gaps = capture_gaps(hdr, rec);
+	const __s32 *values = row;
+	for (__u32 s=0; s<hdr->num_sensors; s++, values += hdr->num_fields)
+	{
+		if (hdr->reachable[s]==1)
+		{
+			// Missing values are left empty
+			int present = (gaps & (1 << s)) == 0;
+			if (current_enable)
+			{
+				*p++ = ',';
+				if (present)
+					p = put_int(p, values[0]);
+			}
+			if (voltage_enable)
+			{
+				*p++ = ',';
+				if (present)
+					p = put_int(p, values[current_enable]);
+			}
+			if (power_enable)
+			{
+				*p++ = ',';
+				if (present)
+					p = put_u64(p, values[current_enable + voltage_enable]);
+			}
+		}
+	}
+	*p++ = '\n';
+	out->len = p - out->buf;
+	out->rows++;
+}
+
+int csv_close(struct csv_out *out)
+{
+	/*
+	Flushes the remaining rows and closes the file
+
+	Returns 0 on success, -1 if any write failed
+	*/
+	csv_flush(out);
+	if (close(out->fd) != 0)
+		out->error = 1;
+	free(out->buf);
+	out->buf = NULL;
+	return out->error ? -1 : 0;
+}
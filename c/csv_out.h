@@ -0,0 +1,48 @@
+/*
+CSV output of captured rows.
+
+Layout: "Date,Time of the day (us)" followed by the current (mA) and/or
+voltage (mV) column of every reachable sensor.
+
+Rows are formatted by hand into a large buffer that is handed to the kernel
+with a few big write() calls. The date column is cached and only recomputed
+when a row crosses local midnight, so no localtime() or printf() runs per row.
+The registers of a row are converted together by units_row().
+*/
+
+#include "capture.h"
+#include "units.h"
+
+#ifndef _CSV_OUT_H_
+#define _CSV_OUT_H_
+
+#define CSV_BUFFER_SIZE (1 << 20)
+
+struct csv_out
+{
+	int fd;
+	const struct capture_header *hdr;
+	char *buf;
+	size_t len;
+	size_t max_row;		// Upper bound of the length of one row
+	__u8 kinds[UNITS_MAX_CELLS];	// Unit of every register of a row
+	int num_cells;
+	int error;		// Set once a write() failed
+	unsigned long long bytes;	// Bytes handed to the kernel so far
+
+	long long start_us;	// Wall clock at the start of the measurement
+	long long day_start_us;	// Local midnight of the cached date
+	long long next_day_us;	// Local midnight of the following day
+	char date[40];		// "MM/DD/YYYY," of the cached day, sized for any value of the struct tm fields
+	size_t date_len;
+
+	long long time_base;	// Accumulated wraparounds of the 32 bit time offsets
+	__u32 prev_offset;
+	long rows;
+};
+
+int csv_open(struct csv_out *out, const char *filename, const struct capture_header *hdr);
+void csv_write_row(struct csv_out *out, const struct sample_record *rec);
+int csv_close(struct csv_out *out);
+
+#endif
@@ -0,0 +1,69 @@
+#include "deadline.h"
+#include <errno.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+long long sched_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sched_init(struct deadline_sched *sc, long long start_ns, long long period_ns, long long spin_ns)
+{
+	/*
+	Starts a timeline whose first deadline is start_ns
+
+	Parameters:
+		period_ns: time between deadlines
+		spin_ns: time spun before each deadline (covers the wake-up latency of the sleep)
+	*/
+	sc->start_ns = start_ns;
+	sc->period_ns = period_ns;
+	sc->spin_ns = spin_ns;
+	sc->next = 0;
+	sc->overruns = 0;
+	sc->max_lateness_ns = 0;
+	sc->lateness_ns = 0;
+
+	// The default 50 us timer slack of the thread would eat most of the spin window
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+}
+
+long long sched_wait(struct deadline_sched *sc)
+{
+	/*
+	Waits for the next deadline
+
+	Returns the index of the deadline that was waited for
+	*/
+	long long deadline = sc->start_ns + sc->next * sc->period_ns;
+	long long now = sched_now_ns();
+
+	if (now - deadline >= sc->period_ns)
+	{
+		// Whole periods have passed since the deadline: skip them and take the current one late
+		long long missed = (now - deadline) / sc->period_ns;
+		sc->overruns += missed;
+		sc->next += missed;
+		deadline += missed * sc->period_ns;
+	}
+
+	long long wake = deadline - sc->spin_ns;
+	if (wake > now)
+	{
+		struct timespec ts;
+		ts.tv_sec = wake / 1000000000LL;
+		ts.tv_nsec = wake % 1000000000LL;
+		// A signal ends the sleep early and the rest of the wait is spun
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	while ((now = sched_now_ns()) < deadline)
+		;
+
+	sc->lateness_ns = now - deadline;
+	if (sc->lateness_ns > sc->max_lateness_ns)
+		sc->max_lateness_ns = sc->lateness_ns;
+	return sc->next++;
+}
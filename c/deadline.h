@@ -0,0 +1,31 @@
+/*
+Fixed-rate scheduler on absolute deadlines.
+
+Deadline i is start + i * period on CLOCK_MONOTONIC, so the time a sample
+takes never shifts the following ones. The caller sleeps with
+clock_nanosleep(TIMER_ABSTIME) until spin before the deadline and spins for the
+rest, which keeps the wake-up precise without holding a core for the whole
+period. Deadlines that have already passed by a full period when the caller
+comes back are skipped and counted as overruns, the timeline itself is never
+moved.
+*/
+
+#ifndef _DEADLINE_H_
+#define _DEADLINE_H_
+
+struct deadline_sched
+{
+	long long start_ns;
+	long long period_ns;
+	long long spin_ns;		// Time spun before each deadline instead of sleeping
+	long long next;			// Index of the next deadline
+	long overruns;			// Deadlines skipped because the caller came back too late
+	long long max_lateness_ns;	// Largest delay between a deadline and the wake-up
+	long long lateness_ns;		// Delay of the last wake-up
+};
+
+long long sched_now_ns(void);
+void sched_init(struct deadline_sched *sc, long long start_ns, long long period_ns, long long spin_ns);
+long long sched_wait(struct deadline_sched *sc);
+
+#endif
@@ -0,0 +1,207 @@
+#include "energy.h"
+#include "INA260.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int find_sensor(const struct capture_header *hdr, int adapter, int addr)
+{
+	for (__u32 s = 0; s < hdr->num_sensors; s++)
+	{
+		if (hdr->sensor_buses[s] == adapter && hdr->sensor_addrs[s] == addr)
+			return s;
+	}
+	return -1;
+}
+
+int energy_load(struct energy_meter *em, const char *filename, const struct capture_header *hdr)
+{
+	/*
+	Reads the rail topology and prepares the meter for the rows of hdr
+
+	Returns 0 on success, -1 if the file cannot be read, or the number of the
+	first line that is malformed, names a sensor that is not captured or
+	exceeds ENERGY_MAX_GPUS/ENERGY_MAX_RAILS
+	*/
+	memset(em, 0, sizeof(*em));
+	em->hdr = hdr;
+	FILE *f = fopen(filename, "r");
+	if (f == NULL)
+		return -1;
+
+	char line[256];
+	int line_num = 0;
+	int status = 0;
+	while (status == 0 && fgets(line, sizeof(line), f) != NULL)
+	{
+		line_num++;
+		char gpu[ENERGY_NAME_LEN], rail[ENERGY_NAME_LEN], sensors[160];
+		char *p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		if (sscanf(p, "%31s %31s %159s", gpu, rail, sensors) != 3 || em->num_rails >= ENERGY_MAX_RAILS)
+		{
+			status = line_num;
+			break;
+		}
+
+		int g = 0;
+		while (g < em->num_gpus && strcmp(em->gpus[g].name, gpu) != 0)
+			g++;
+		if (g == em->num_gpus)
+		{
+			if (em->num_gpus >= ENERGY_MAX_GPUS)
+			{
+				status = line_num;
+				break;
+			}
+			strcpy(em->gpus[em->num_gpus++].name, gpu);
+		}
+
+		struct energy_rail *r = &em->rails[em->num_rails++];
+		strcpy(r->name, rail);
+		r->gpu = g;
+
+		// <adapter>:<addr>[,<addr>...]
+		char *q = sensors;
+		int adapter = strtol(q, &q, 0);
+		if (*q++ != ':')
+			status = line_num;
+		while (status == 0)
+		{
+			int s = find_sensor(hdr, adapter, strtol(q, &q, 0));
+			if (s < 0 || r->num_sensors >= CAPTURE_MAX_SENSORS)
+				status = line_num;
+			else
+				r->sensors[r->num_sensors++] = s;
+			if (*q != ',')
+				break;
+			q++;
+		}
+		if (status == 0 && *q != '\0')
+			status = line_num;
+	}
+	fclose(f);
+	return status;
+}
+
+void energy_init_total(struct energy_meter *em, const struct capture_header *hdr)
+{
+	// Prepares the meter without a topology: a single GPU "total" with every reachable sensor as one rail
+	memset(em, 0, sizeof(*em));
+	em->hdr = hdr;
+	em->num_gpus = 1;
+	em->num_rails = 1;
+	strcpy(em->gpus[0].name, "total");
+	strcpy(em->rails[0].name, "all");
+	for (__u32 s = 0; s < hdr->num_sensors; s++)
+	{
+		if (hdr->reachable[s])
+			em->rails[0].sensors[em->rails[0].num_sensors++] = s;
+	}
+}
+
+static void acc_add(struct energy_acc *acc, __u64 uw, __u32 dt_us, int first)
+{
+	// Adds the trapezoid between the previous row and a row dt_us later with power uw
+	if (!first)
+	{
+		// (prev + cur) / 2 * dt in pJ, kept in half pJ and split at a second so the products fit in 64 bits
+		__u64 p2 = acc->prev_uw + uw;
+		acc->half_uj += p2 * (dt_us / 1000000);
+		acc->half_pj += p2 * (dt_us % 1000000);
+		acc->half_uj += acc->half_pj / 1000000;
+		acc->half_pj %= 1000000;
+	}
+	acc->prev_uw = uw;
+	if (uw > acc->peak_uw)
+		acc->peak_uw = uw;
+}
+
+void energy_add(struct energy_meter *em, const struct sample_record *rec)
+{
+	// Integrates one row into the energy of every rail and GPU
+	const struct capture_header *hdr = em->hdr;
+	int current_enable = (hdr->fields & CAPTURE_FIELD_CURRENT) != 0;
+	int voltage_enable = (hdr->fields & CAPTURE_FIELD_VOLTAGE) != 0;
+	int power_enable = (hdr->fields & CAPTURE_FIELD_POWER) != 0;
+
+	// A sensor without a value in the row keeps its last power
+	__u16 gaps = capture_gaps(hdr, rec);
+	const __u16 *regs = rec->regs;
+	for (__u32 s = 0; s < hdr->num_sensors; s++, regs += hdr->num_fields)
+	{
+		if (hdr->reachable[s] == 0 || (gaps & (1 << s)))
+			continue;
+		if (power_enable)
+			em->sensor_uw[s] = regs[current_enable + voltage_enable] * 10000ULL;
+		else if (current_enable && voltage_enable)
+		{
+			// Reverse current (noise around zero) counts as no power
+			__s64 raw = (__s16)regs[0] * (__s64)regs[1];
+			em->sensor_uw[s] = raw > 0 ? raw * 25 / 16 : 0;
+		}
+	}
+
+	// Unsigned difference so the wraparound of the 32 bit offsets is harmless
+	int first = em->rows == 0;
+	__u32 dt_us = rec->time_offset - em->prev_offset;
+	if (!first)
+		em->elapsed_us += dt_us;
+
+	__u64 gpu_uw[ENERGY_MAX_GPUS] = {0};
+	for (int r = 0; r < em->num_rails; r++)
+	{
+		struct energy_rail *rail = &em->rails[r];
+		__u64 uw = 0;
+		for (int k = 0; k < rail->num_sensors; k++)
+			uw += em->sensor_uw[rail->sensors[k]];
+		acc_add(&rail->acc, uw, dt_us, first);
+		gpu_uw[rail->gpu] += uw;
+	}
+	for (int g = 0; g < em->num_gpus; g++)
+		acc_add(&em->gpus[g].acc, gpu_uw[g], dt_us, first);
+
+	em->prev_offset = rec->time_offset;
+	em->rows++;
+}
+
+int energy_report_due(struct energy_meter *em)
+{
+	// Returns 1 once every ENERGY_REPORT_PERIOD_S of measurement time
+	if (em->elapsed_us - em->report_us < ENERGY_REPORT_PERIOD_S * 1000000ULL)
+		return 0;
+	em->report_us = em->elapsed_us;
+	return 1;
+}
+
+static void acc_print(const char *name, const struct energy_acc *acc, double elapsed_s)
+{
+	double energy_j = acc->half_uj / 2e6 + acc->half_pj / 2e12;
+	double avg_w = elapsed_s > 0 ? energy_j / elapsed_s : acc->prev_uw / 1e6;
+	printf("%-24s %12.3f J  average %9.3f W  peak %9.3f W\n", name, energy_j, avg_w, acc->peak_uw / 1e6);
+}
+
+void energy_print(const struct energy_meter *em, int with_rails)
+{
+	/*
+	Prints the energy, average and peak power of every GPU so far
+
+	Parameters:
+		with_rails: also print every rail of the GPUs
+	*/
+	double elapsed_s = em->elapsed_us / 1e6;
+	char name[2 * ENERGY_NAME_LEN + 2];
+	printf("Energy over %.3f s:\n", elapsed_s);
+	for (int g = 0; g < em->num_gpus; g++)
+	{
+		acc_print(em->gpus[g].name, &em->gpus[g].acc, elapsed_s);
+		for (int r = 0; r < em->num_rails && with_rails; r++)
+		{
+			if (em->rails[r].gpu != g)
+				continue;
+			snprintf(name, sizeof(name), "  %s", em->rails[r].name);
+			acc_print(name, &em->rails[r].acc, elapsed_s);
+		}
+	}
+}
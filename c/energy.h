@@ -0,0 +1,75 @@
+/*
+Online energy of every GPU, integrated from the rows as they are captured.
+
+The topology file maps sensors to the power rails of the GPUs, one rail per
+line (empty lines and lines starting with # are ignored):
+
+	<gpu> <rail> <adapter>:<addr>[,<addr>...]
+
+e.g. "gpu0 pcie12v 1:0x40" and "gpu0 8pin 1:0x41". The power of a rail is the
+sum of its sensors and the power of a GPU the sum of its rails.
+
+The power of a sensor comes from its power register (10 mW/bit) when it is
+captured, otherwise from its current and voltage registers (1.25 mA/bit times
+1.25 mV/bit = 1.5625 uW/bit^2). Energy is integrated with the trapezoidal rule
+over the real time between rows, in integer microwatts and microseconds, and
+accumulated exactly in half microjoules plus a remainder in half picojoules.
+A sensor without a value in a row keeps its last power. Only the previous row
+is kept, so memory use does not depend on the measurement time.
+*/
+
+#include "capture.h"
+
+#ifndef _ENERGY_H_
+#define _ENERGY_H_
+
+#define ENERGY_MAX_GPUS 8
+#define ENERGY_MAX_RAILS 16
+#define ENERGY_NAME_LEN 32
+#define ENERGY_REPORT_PERIOD_S 10	// Time between the reports printed during the measurement
+
+// Trapezoidal integrator of a power signal
+struct energy_acc
+{
+	__u64 half_uj;		// Energy in units of 0.5 uJ
+	__u64 half_pj;		// Remainder in units of 0.5 pJ (below 10^6)
+	__u64 prev_uw;		// Power of the previous row
+	__u64 peak_uw;
+};
+
+struct energy_rail
+{
+	char name[ENERGY_NAME_LEN];
+	int gpu;			// Index of the GPU in energy_meter.gpus
+	int num_sensors;
+	int sensors[CAPTURE_MAX_SENSORS];	// Index of each sensor in the rows
+	struct energy_acc acc;
+};
+
+struct energy_gpu
+{
+	char name[ENERGY_NAME_LEN];
+	struct energy_acc acc;
+};
+
+struct energy_meter
+{
+	const struct capture_header *hdr;
+	int num_gpus;
+	int num_rails;
+	struct energy_gpu gpus[ENERGY_MAX_GPUS];
+	struct energy_rail rails[ENERGY_MAX_RAILS];
+	__u64 sensor_uw[CAPTURE_MAX_SENSORS];	// Last known power of each sensor
+	long rows;
+	__u32 prev_offset;
+	__u64 elapsed_us;		// Time from the first row to the last one
+	__u64 report_us;		// Elapsed time at the last periodic report
+};
+
+int energy_load(struct energy_meter *em, const char *filename, const struct capture_header *hdr);
+void energy_init_total(struct energy_meter *em, const struct capture_header *hdr);
+void energy_add(struct energy_meter *em, const struct sample_record *rec);
+int energy_report_due(struct energy_meter *em);
+void energy_print(const struct energy_meter *em, int with_rails);
+
+#endif
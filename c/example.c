@@ -1,12 +1,34 @@
 #include "INA260.h"
+#include "bus.h"
+#include "spsc_ring.h"
+#include "capture.h"
+#include "csv_out.h"
+#include "summary.h"
+#include "alert.h"
+#include "sim_ina260.h"
+#include "sampler.h"
+#include "energy.h"
+#include "segment.h"
+#include "live.h"
+#include "marker.h"
+#include "phase.h"
+#include "calibrate.h"
+#include "rollup.h"
+#include "store.h"
+#include "rt.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include <time.h>
 #include<signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <errno.h>
 
 u_int8_t user_interrupt = 0;
 u_int8_t i2c_error_ind = 0;
@@ -18,7 +40,36 @@ __u8 SENSOR_ADDRS[] = {0x40, 0x41, 0x44, 0x45};
 #define MIN_SIM_TIME 0.1
 
 #define INIT_RETRY_NUM 10 // Number of retries to initially configure a sensor
-#define I2C_RETRY_NUM 100 // Number of retries to retry i2c bus during measurement
+
+#define STREAM_RING_SLOTS 65536 // Number of rows the sampler can be ahead of the writer thread in streaming mode
+#define STREAM_IDLE_SLEEP_US 1000 // Writer thread sleep time when there is nothing to write
+
+#define MERGE_IDLE_SLEEP_US 200 // Merger sleep time when a bus has not reached the next deadline yet
+
+#define ALERT_TIMEOUT_MIN_MS 10 // A sensor that did not signal a conversion within max(this, 4 conversion periods) is read anyway
+
+#define FORMAT_CSV 0
+#define FORMAT_BIN 1
+
+#define CALIBRATION_REFUSE 0 // Stop before the measurement if the sampling period is shorter than the buses sustain
+#define CALIBRATION_WARN 1
+#define CALIBRATION_OFF 2
+
+static const int CONVERSION_TIMES[] = {140, 204, 332, 588, 1100, 2116, 4156, 8244};
+
+struct stream_writer
+{
+    struct spsc_ring ring;
+    const struct capture_header *hdr;
+    u_int8_t format;
+    struct csv_out csv;
+    struct capture_file capture;
+    u_int8_t segmented;
+    struct segment_writer segments;
+    struct run_summary summary;
+    long write_errors;
+    atomic_int done;
+};
 
 // unit conversion code, just to make the conversion more obvious and self-documenting
 static long long SecondsToMicros(long long secs) {return secs*1000000;}
@@ -39,6 +90,185 @@ void time_sig_handler(int signum){
     measurement_timeout = 1;
 }
 
+static void *stream_writer_thread(void *arg)
+{
+    // Drains the ring to the output file until the sampler is done and the ring is empty
+    struct stream_writer *w = (struct stream_writer*) arg;
+    for (;;)
+    {
+        const struct sample_record *rec = spsc_ring_peek(&w->ring);
+        if (rec == NULL)
+        {
+            if (atomic_load_explicit(&w->done, memory_order_acquire))
+            {
+                rec = spsc_ring_peek(&w->ring);
+                if (rec == NULL)
+                    break;
+            }
+            else
+            {
+                usleep(STREAM_IDLE_SLEEP_US);
+                continue;
+            }
+        }
+        if (w->segmented)
+        {
+            if (segment_write(&w->segments, rec) != 0)
+                w->write_errors++;
+        }
+        else if (w->format == FORMAT_BIN)
+        {
+            if (capture_append(&w->capture, rec) != 0)
+                w->write_errors++;
+        }
+        else
+            csv_write_row(&w->csv, rec);
+        summary_add(&w->summary, w->hdr, rec);
+        spsc_ring_release(&w->ring);
+    }
+    return NULL;
+}
+
+static void report_latency(struct bus_sampler *samplers, int num_buses, FILE *dump)
+{
+    // Prints the tail latencies of every bus and, if dump is given, writes all the histograms to it
+    char name[64];
+    printf("Latency (us)               count       p50       p99     p99.9       max  errors retries rereads\n");
+    if (dump != NULL)
+        fprintf(dump, "histogram,low_ns,high_ns,count\n");
+    for (int b=0; b<num_buses; b++)
+    {
+        struct bus_sampler *bs = &samplers[b];
+        const struct ina260_latency *lat = bs->latency;
+        for (int k=0; k<bs->num_sensors; k++)
+        {
+            int s = bs->devs[k].addr & (INA260_LAT_SENSORS - 1);
+            long retries = bs->retries[k], rereads = bs->rereads[k]; // Reported once per sensor, on its first line
+            for (int r=0; r<INA260_LAT_REGS; r++)
+            {
+                snprintf(name, sizeof(name), "%d-%#02X %s", bs->adapter, bs->devs[k].addr, ina260_reg_name(r));
+                if (lat->regs[s][r].count == 0 && lat->errors[s][r] == 0)
+                    continue;
+                lat_hist_print(name, &lat->regs[s][r], lat->errors[s][r], retries, rereads);
+                retries = 0;
+                rereads = 0;
+                if (dump != NULL)
+                    lat_hist_dump(dump, name, &lat->regs[s][r]);
+            }
+        }
+        snprintf(name, sizeof(name), "%d batch", bs->adapter);
+        lat_hist_print(name, &lat->batch, lat->batch_errors, 0, 0);
+        if (dump != NULL)
+            lat_hist_dump(dump, name, &lat->batch);
+        snprintf(name, sizeof(name), "%d wake-up jitter", bs->adapter);
+        lat_hist_print(name, &bs->jitter, 0, 0, 0);
+        if (dump != NULL)
+            lat_hist_dump(dump, name, &bs->jitter);
+        snprintf(name, sizeof(name), "%d row", bs->adapter);
+        lat_hist_print(name, &bs->row_time, 0, 0, 0);
+        if (dump != NULL)
+            lat_hist_dump(dump, name, &bs->row_time);
+    }
+}
+
+static void report_gaps(const struct bus_sampler *samplers, int num_buses)
+{
+    // Prints the sensors that had rows without a value, with the recoveries that brought them back
+    for (int b=0; b<num_buses; b++)
+    {
+        const struct bus_sampler *bs = &samplers[b];
+        for (int k=0; k<bs->num_sensors; k++)
+        {
+            const struct sensor_recovery *rc = &bs->recovery[k];
+            if (rc->gaps == 0)
+                continue;
+            printf("\033[0;33mSensor %d-%#02X: %ld samples without a value, %ld recoveries in %ld attempts%s. \033[0m\n",
+                   bs->adapter, bs->devs[k].addr, rc->gaps, rc->recoveries, bs->retries[k],
+                   rc->state != SENSOR_OK ? ", still recovering at the end" : "");
+        }
+    }
+}
+
+static void report_realtime(const struct bus_sampler *samplers, int num_buses, const struct rt_usage *process)
+{
+    // Prints what still disturbed the measurement in real-time mode: involuntary context switches and page faults
+    for (int b=0; b<num_buses; b++)
+    {
+        const struct rt_usage *u = &samplers[b].usage;
+        if (u->nivcsw > 0 || u->majflt > 0)
+            printf("\033[0;33mSampler of bus %d: %ld involuntary context switches, %ld major and %ld minor page faults. \033[0m\n",
+                   samplers[b].adapter, u->nivcsw, u->majflt, u->minflt);
+        else
+            printf("Sampler of bus %d: no involuntary context switch or major page fault, %ld minor page faults.\n",
+                   samplers[b].adapter, u->minflt);
+    }
+    if (process->majflt > 0)
+        printf("\033[0;33m%ld major page faults in the whole process during the measurement. \033[0m\n", process->majflt);
+}
+
+static const char *profile_settings(const char *spec)
+{
+    // Returns the settings of a profile "[[<adapter>:]<addr>:]<key>=<value>,...", after its sensor selector
+    const char *eq = strchr(spec, '=');
+    const char *settings = spec;
+    for (const char *p = spec; eq != NULL && p < eq; p++)
+    {
+        if (*p == ':')
+            settings = p + 1;
+    }
+    return settings;
+}
+
+static int profile_selects(const char *spec, int adapter, int addr)
+{
+    // Returns 1 if the profile applies to the sensor, 0 if not and -1 if its selector is malformed
+    const char *settings = profile_settings(spec);
+    if (settings == spec || strncmp(spec, "all:", 4) == 0)
+        return 1;
+    char *end;
+    long first = strtol(spec, &end, 0);
+    if (end == spec || *end != ':')
+        return -1;
+    if (end + 1 == settings)
+        return first == addr;
+    const char *p = end + 1;
+    long second = strtol(p, &end, 0);
+    if (end == p || end + 1 != settings)
+        return -1;
+    return first == adapter && second == addr;
+}
+
+static long build_profiles(struct ina260_profile *profiles, int num_sensors, const __u8 *buses, const __u8 *addrs,
+                           char **specs, int num_specs, u_int8_t current_convert, u_int8_t voltage_convert, int sampling_time)
+{
+    // Sets the profile of each sensor: the sampling time of -s, then the matching -C profiles in order
+    // Returns the longest conversion cycle of the sensors in microseconds
+    long longest_cycle_us = 0;
+    for (int k=0; k<num_sensors; k++)
+    {
+        ina260_profile_default(&profiles[k], current_convert, voltage_convert, sampling_time);
+        for (int p=0; p<num_specs; p++)
+        {
+            if (profile_selects(specs[p], buses[k], addrs[k]) == 1)
+                ina260_profile_parse(profile_settings(specs[p]), &profiles[k]);
+        }
+        if (ina260_profile_cycle_us(&profiles[k]) > longest_cycle_us)
+            longest_cycle_us = ina260_profile_cycle_us(&profiles[k]);
+    }
+    return longest_cycle_us;
+}
+
+static void side_file_name(const char *filename, const char *suffix, char *name, size_t len)
+{
+    // Names a file written next to the output file: run.csv gives run<suffix>
+    snprintf(name, len, "%s", filename);
+    char *dot = strrchr(name, '.');
+    char *slash = strrchr(name, '/');
+    if (dot != NULL && (slash == NULL || dot > slash))
+        *dot = '\0';
+    snprintf(name + strlen(name), len - strlen(name), "%s", suffix);
+}
+
 int main(int argc, char **argv)
 {
     signal(SIGUSR1,usr_sig_handler); // Registering signal handler
@@ -50,29 +280,80 @@ int main(int argc, char **argv)
     char *filename = "measurements.csv";
     u_int8_t current_enable = 0;
     u_int8_t voltage_enable = 0;
+    u_int8_t power_enable = 0;
     int usr_sampling_time = DEFAULT_SAMPLING_TIME;
+    u_int8_t stream_enable = 0;
+    u_int8_t compress_enable = 0;
+    u_int8_t format = FORMAT_CSV;
+    u_int8_t batch_enable = 0;
+    u_int8_t fast_read = 0;
+    char *alert_spec = NULL;
+    __u8 sensor_addrs[CAPTURE_MAX_SENSORS]; // Address and adapter of each sensor
+    __u8 sensor_buses[CAPTURE_MAX_SENSORS];
+    int num_assigned = 0; // Number of sensors assigned with -a
+    char *latency_file = NULL;
+    char *topology_file = NULL;
+    char *segment_spec = NULL;
+    char *live_name = NULL;
+    char *marker_name = NULL;
+    mode_t marker_mode = MARKER_DEFAULT_MODE;
+    u_int8_t auto_sampling_time = 0;
+    int calibration_policy = CALIBRATION_REFUSE;
+    char *rollup_spec = NULL;
+    char *rt_spec = NULL;
+    char *profile_specs[CAPTURE_MAX_SENSORS];
+    int num_profile_specs = 0;
+    struct segment_limits segment_limits;
+    u_int8_t time_given = 0;
     // Parsing the input arguments
-    while ((c = getopt (argc, argv, "hn:t:f:cvs:")) != -1)
+    while ((c = getopt (argc, argv, "hn:t:f:cvws:b:SF:BPA:a:L:G:R:M:E:C:K:U:ZT:")) != -1)
     {
         switch (c)
             {
             case 'h':
                 printf("-h             Display this help and exit\n");
-                printf("-t             Set entire measurement time (between %.2f and %.2f seconds\n",(float)MIN_SIM_TIME,(float)MAX_SIM_TIME);
+                printf("-t             Set entire measurement time (at least %.2f seconds; at most %.2f seconds for buffered captures,\n",(float)MIN_SIM_TIME,(float)MAX_SIM_TIME);
+                printf("               no upper limit with -S, -R or -Z)\n");
                 printf("-c             Enable the current consumption measurement\n");
                 printf("-v             Enable the voltage measurement\n");
+                printf("-w             Enable the power measurement (one register read per sensor)\n");
                 printf("-s             Set INA260 sampling time (valid values: 140, 204, 332,\n");
-                printf("               588, 1100, 2116, 4156, 8244 microseconds)\n");
+                printf("               588, 1100, 2116, 4156, 8244 microseconds) or auto: the shortest the buses sustain\n");
+                printf("-K             Bus calibration policy when the buses cannot sustain the sampling time:\n");
+                printf("               refuse (default, stop before measuring), warn (measure anyway) or off (no calibration)\n");
+                printf("-C             Set the conversion profile of sensors: [[<adapter>:]<addr>:]<key>=<value>[,...], keys\n");
+                printf("               ct, ict, vct (conversion times in us), avg (1 to 1024) and mode (continuous or triggered),\n");
+                printf("               e.g. 0x44:avg=64,ct=1100 (repeatable, later profiles override earlier ones, default -s)\n");
                 printf("-n             Set number of sensors (between 1 and %d) \n", sizeof(SENSOR_ADDRS)/sizeof(SENSOR_ADDRS[0]));
+                printf("-a             Assign sensors to an I2C adapter: <adapter>:<addr>[,<addr>...], e.g. 3:0x40,0x41\n");
+                printf("               (repeat for each adapter, replaces -n; every adapter is sampled by its own thread)\n");
                 printf("-f             Set file name to store measurements\n");
+                printf("-F             Set file format: csv (default) or bin (convert with ina260_convert)\n");
+                printf("-b             Set bus backend: i2c-dev (default) or sim[:options]\n");
+                printf("               (sim options: latency_us, bus_hz, error_ppm, seed)\n");
+                printf("-S             Stream samples to the file while measuring (no measurement time limit)\n");
+                printf("-Z             Keep the samples compressed in memory until they are written (csv, no time limit)\n");
+                printf("-B             Read all sensors with one combined I2C transfer per sample\n");
+                printf("-P             Fast reads: skip the register select byte when the sensor already points to the register\n");
+                printf("-A             Sample on the conversion ready alerts instead of a timer: <gpiochip>:<line>[,<line>...]\n");
+                printf("               (one line per sensor, e.g. /dev/gpiochip0:17,27) or sim for the simulated sensors\n");
+                printf("-L             Write the latency histograms to a CSV file (histogram,low_ns,high_ns,count)\n");
+                printf("-G             Integrate the energy of every GPU, from a file of lines <gpu> <rail> <adapter>:<addr>[,<addr>...]\n");
+                printf("               (needs -w, or -c and -v)\n");
+                printf("-R             Continuous measurement into rotating segments until stopped (SIGUSR1, SIGINT or SIGTERM):\n");
+                printf("               size=<bytes>[K|M|G],time=<seconds>,keep=<segments>,max=<bytes>[K|M|G] (implies -S)\n");
+                printf("-M             Publish the samples to other processes in the shared memory object <name>, e.g. /ina260\n");
+                printf("               (read them with live.h or ina260_live)\n");
+                printf("-E             Accept begin/end phase markers in the shared memory object <name>[:<mode>], e.g. /ina260-markers\n");
+                printf("               (post them with marker.h or ina260_mark) and report the time and energy of every label;\n");
+                printf("               the object is created with the octal <mode>, default 0660 (owner and group may post)\n");
+                printf("-U             Write rollups (count, min, max, mean, p50, p90, p99) over windows, e.g. 1ms,10ms,1s\n");
+                printf("-T             Real-time mode: SCHED_FIFO samplers pinned to the isolated CPUs (auto) or to a CPU list,\n");
+                printf("               e.g. 2-3, with the memory locked and every buffer prefaulted (needs root or CAP_SYS_NICE)\n");
                 return 0;
             case 't':
                 meas_time = atof(optarg); // Measurement time in seconds (by default it is set to 0.1 seconds)
-                if (meas_time > MAX_SIM_TIME)
-                {
-                    printf("Simulation time is set for too long\n");
-                    return 1;
-                }
+                time_given = 1;
                 if (meas_time < MIN_SIM_TIME)
                 {
                     printf("Simulation time is set for too short\n");
@@ -85,8 +366,18 @@ int main(int argc, char **argv)
             case 'v':
                 voltage_enable = 1;
                 break;
+            case 'w':
+                power_enable = 1;
+                break;
 
             case 's':
+                if (strcmp(optarg, "auto") == 0)
+                {
+                    auto_sampling_time = 1;
+                    usr_sampling_time = CONVERSION_TIMES[0];
+                    break;
+                }
+                auto_sampling_time = 0;
                 usr_sampling_time = atoi(optarg);
                 if (usr_sampling_time != 140  && usr_sampling_time != 204  && usr_sampling_time != 332  && \
                     usr_sampling_time != 588  && usr_sampling_time != 1100 && usr_sampling_time != 2116 && \
@@ -110,10 +401,134 @@ int main(int argc, char **argv)
                     return 1;
                 }
                 break;
+            case 'a':
+            {
+                char *end;
+                long adapter = strtol(optarg, &end, 0);
+                if (*end != ':' || adapter < 0 || adapter >= INA260_MAX_ADAPTERS)
+                {
+                    printf("\033[31mInvalid sensor assignment %s.\033[0m\n", optarg);
+                    return 1;
+                }
+                do
+                {
+                    unsigned long addr = strtoul(end + 1, &end, 0);
+                    if ((*end != ',' && *end != '\0') || addr == 0 || addr > 0x7F || num_assigned >= CAPTURE_MAX_SENSORS)
+                    {
+                        printf("\033[31mInvalid sensor assignment %s.\033[0m\n", optarg);
+                        return 1;
+                    }
+                    sensor_buses[num_assigned] = adapter;
+                    sensor_addrs[num_assigned] = addr;
+                    num_assigned++;
+                } while (*end == ',');
+                break;
+            }
             case 'f':
                 filename = optarg;
                 break;
-            case '?': 
+            case 'F':
+                if (strcmp(optarg, "csv") == 0)
+                    format = FORMAT_CSV;
+                else if (strcmp(optarg, "bin") == 0)
+                    format = FORMAT_BIN;
+                else
+                {
+                    printf("\033[31mUnknown file format %s.\033[0m\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                stream_enable = 1;
+                break;
+            case 'Z':
+                compress_enable = 1;
+                break;
+            case 'B':
+                batch_enable = 1;
+                break;
+            case 'P':
+                fast_read = 1;
+                break;
+            case 'A':
+                alert_spec = optarg;
+                break;
+            case 'L':
+                latency_file = optarg;
+                break;
+            case 'G':
+                topology_file = optarg;
+                break;
+            case 'M':
+                live_name = optarg;
+                break;
+            case 'E':
+            {
+                marker_name = optarg;
+                char *mode = strrchr(optarg, ':');
+                if (mode != NULL)
+                {
+                    char *end;
+                    unsigned long value = strtoul(mode + 1, &end, 8);
+                    if (end == mode + 1 || *end != '\0' || value > 0777)
+                    {
+                        printf("\033[31mInvalid mode of the marker queue (-E <name>[:<mode>]).\033[0m\n");
+                        return 1;
+                    }
+                    marker_mode = value;
+                    *mode = '\0';
+                }
+                break;
+            }
+            case 'U':
+                rollup_spec = optarg;
+                break;
+            case 'T':
+                rt_spec = optarg;
+                break;
+            case 'K':
+                if (strcmp(optarg, "refuse") == 0)
+                    calibration_policy = CALIBRATION_REFUSE;
+                else if (strcmp(optarg, "warn") == 0)
+                    calibration_policy = CALIBRATION_WARN;
+                else if (strcmp(optarg, "off") == 0)
+                    calibration_policy = CALIBRATION_OFF;
+                else
+                {
+                    printf("\033[31mUnknown calibration policy %s.\033[0m\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'C':
+            {
+                struct ina260_profile check;
+                ina260_profile_default(&check, 1, 1, DEFAULT_SAMPLING_TIME);
+                if (num_profile_specs == CAPTURE_MAX_SENSORS || profile_selects(optarg, 0, 0) < 0 ||
+                    ina260_profile_parse(profile_settings(optarg), &check) != 0)
+                {
+                    printf("\033[31mInvalid conversion profile %s.\033[0m\n", optarg);
+                    return 1;
+                }
+                profile_specs[num_profile_specs++] = optarg;
+                break;
+            }
+            case 'R':
+                segment_spec = optarg;
+                if (segment_parse_limits(optarg, &segment_limits) != 0)
+                {
+                    printf("\033[31mInvalid segment limits %s.\033[0m\n", optarg);
+                    return 1;
+                }
+                stream_enable = 1;
+                break;
+            case 'b':
+                if (bus_select(optarg) != 0)
+                {
+                    printf("\033[31mUnknown bus backend %s.\033[0m\n", optarg);
+                    return 1;
+                }
+                break;
+            case '?':
                 if (optopt == 't' || optopt == 'n')
                     fprintf (stderr, "Option -%c requires an argument.\n", optopt);
                 else if (isprint (optopt))
@@ -128,21 +543,116 @@ int main(int argc, char **argv)
         }
 
     }
-    if (voltage_enable==0 && current_enable==0)
+    if (voltage_enable==0 && current_enable==0 && power_enable==0)
         current_enable = 1;
 
-    printf("Measurement time is set to %.2f seconds. \n",meas_time);
-    
+    // Without -a the first sensors of the default address list are used, on the default adapter
+    if (num_assigned > 0)
+        num_sensors = num_assigned;
+    else
+    {
+        for (int k=0; k<num_sensors; k++)
+        {
+            sensor_addrs[k] = SENSOR_ADDRS[k];
+            sensor_buses[k] = BUS_DEFAULT_ADAPTER;
+        }
+    }
+
+    // The power register is computed by the sensor from its current and voltage conversions, so both are enabled
+    // in the sensor whenever power is measured, even if only the power register is read
+    u_int8_t current_convert = current_enable | power_enable;
+    u_int8_t voltage_convert = voltage_enable | power_enable;
+
+    // Conversion profile of each sensor. With -s auto the sensors start with the shortest conversion time
+    // and the sampling time is chosen by the bus calibration
+    struct ina260_profile profiles[CAPTURE_MAX_SENSORS];
+    long longest_cycle_us = build_profiles(profiles, num_sensors, sensor_buses, sensor_addrs, profile_specs, num_profile_specs,
+                                           current_convert, voltage_convert, usr_sampling_time);
+
+    __u64 rollup_windows[ROLLUP_MAX_LEVELS];
+    int num_rollup_levels = 0;
+    if (rollup_spec != NULL && (num_rollup_levels = rollup_parse(rollup_spec, rollup_windows, ROLLUP_MAX_LEVELS)) < 0)
+    {
+        printf("\033[31mInvalid rollup windows %s (at most %d lengths in us, ms or s).\033[0m\n", rollup_spec, ROLLUP_MAX_LEVELS);
+        return 1;
+    }
+
+    if (auto_sampling_time && calibration_policy == CALIBRATION_OFF)
+    {
+        printf("\033[31m-s auto needs the bus calibration, it cannot be used with -K off.\033[0m\n");
+        return 1;
+    }
+
+    // Buffered captures keep every sample in memory, streaming captures only the ring
+    if (compress_enable && (stream_enable || format == FORMAT_BIN))
+    {
+        printf("\033[31m-Z compresses the samples of buffered csv measurements, it cannot be used with -S, -R or -F bin.\033[0m\n");
+        return 1;
+    }
+
+    // Buffered captures keep every sample in memory, streaming captures only the ring and compressed captures
+    // allocate memory as they grow
+    if (meas_time > MAX_SIM_TIME && stream_enable == 0 && compress_enable == 0)
+    {
+        printf("Simulation time is set for too long\n");
+        return 1;
+    }
+
+    // Real-time mode: the samplers run with SCHED_FIFO on the CPUs of -T. The memory is locked before the
+    // buffers are allocated, so every later allocation is resident as soon as it is mapped
+    int rt_cpus[RT_MAX_CPUS];
+    int num_rt_cpus = 0;
+    if (rt_spec != NULL)
+    {
+        if (strcmp(rt_spec, "auto") == 0)
+        {
+            num_rt_cpus = rt_isolated_cpus(rt_cpus, RT_MAX_CPUS);
+            if (num_rt_cpus == 0)
+                printf("\033[0;33mNo CPU is isolated (isolcpus=), the samplers keep their default CPUs. \033[0m\n");
+        }
+        else
+        {
+            num_rt_cpus = rt_parse_cpus(rt_spec, rt_cpus, RT_MAX_CPUS);
+            for (int k=0; k<num_rt_cpus; k++)
+            {
+                if (rt_cpus[k] >= sysconf(_SC_NPROCESSORS_CONF))
+                    num_rt_cpus = -1;
+            }
+            if (num_rt_cpus <= 0)
+            {
+                printf("\033[31mInvalid CPU list %s (auto or e.g. 2-3,5).\033[0m\n", rt_spec);
+                return 1;
+            }
+        }
+        if (rt_lock_memory() != 0)
+            printf("\033[0;33mThe memory could not be locked (%s), raise RLIMIT_MEMLOCK or run as root. \033[0m\n", strerror(errno));
+    }
+
+    // Segmented measurements run until they are stopped, unless a measurement time is given
+    u_int8_t continuous = segment_spec != NULL && time_given == 0;
+    if (continuous)
+    {
+        signal(SIGINT,usr_sig_handler);
+        signal(SIGTERM,usr_sig_handler);
+        printf("Measurement runs until it is stopped with SIGUSR1, SIGINT or SIGTERM.\n");
+    }
+    else
+        printf("Measurement time is set to %.2f seconds. \n",meas_time);
+
     // Reporting start time and approximate finish time of the program
-    struct timespec st_date_time; 
+    struct timespec st_date_time;
     clock_gettime(CLOCK_REALTIME, &st_date_time);
     struct tm *st_time = localtime(&st_date_time.tv_sec);
     printf("Starting time:           %02d:%02d:%02d \n",st_time->tm_hour,st_time->tm_min,st_time->tm_sec);
-    st_date_time.tv_sec = st_date_time.tv_sec + round(meas_time);
-    struct tm *end_time = localtime(&st_date_time.tv_sec);
-    printf("Approximate finish time: %02d:%02d:%02d \n",end_time->tm_hour,end_time->tm_min,end_time->tm_sec);
+    if (continuous == 0)
+    {
+        st_date_time.tv_sec = st_date_time.tv_sec + round(meas_time);
+        struct tm *end_time = localtime(&st_date_time.tv_sec);
+        printf("Approximate finish time: %02d:%02d:%02d \n",end_time->tm_hour,end_time->tm_min,end_time->tm_sec);
+    }
 
     printf("Number of active sensors is set to %d. \n", num_sensors);
+    printf("Bus backend: %s\n", bus->name);
     if (voltage_enable==1)
         printf("Voltage measurement is enabled.\n");
     else
@@ -153,50 +663,13 @@ int main(int argc, char **argv)
     else
         printf("\033[0;33mCurrent measurement is disabled. \033[0m \n");
 
-    
-    printf("Sampling time is set to %d microseconds. \n",usr_sampling_time);
-
-    // Number of samples required for the measurements.
-    long measurement_time_us = usr_sampling_time;
-    long num_samples = round((meas_time*1000000)/measurement_time_us);
-
-    // Definining the array that contains time took to measure each sample in microseconds
-    // with reference to starting time of entire measeasurement  
-    __u32 *time_offset_buffer;
-    time_offset_buffer = (__u32*) malloc(num_samples * sizeof(__u32));
-    if (time_offset_buffer==NULL)
-        {
-            printf("Could not allocate memory for time_offset_buffer\n");
-            return 1;
-        }
-
-    // Definining the array that contains measured voltage current samples (register values)  
-    __u16 *current_buffer;
-    __u16 *voltage_buffer;
-    if (current_enable == 1)
-    {
-        current_buffer = (__u16*) malloc(num_samples * ((long)num_sensors) *sizeof(__u16));
-        if (current_buffer==NULL)
-            {
-                printf("Could not allocate memory for current_buffer.\n");
-                return 1;
-            }
-    }
-
-    if (voltage_enable == 1)
-    {
-        voltage_buffer = (__u16*) malloc(num_samples * ((long)num_sensors) *sizeof(__u16));
-        if (voltage_buffer==NULL)
-            {
-                printf("Could not allocate memory for voltage_buffer.\n");
-                return 1;
-            }
-    }
+    if (power_enable==1)
+        printf("Power measurement is enabled.\n");
 
 
-    // File ID of each sensor
-    int *fd;
-    fd = (int*) malloc(num_sensors *sizeof(int));
+    // Device context of each sensor
+    struct ina260_dev *devs;
+    devs = (struct ina260_dev*) calloc(num_sensors, sizeof(struct ina260_dev));
 
     // The flag that shows if the sensor is reachable or not
     __u8 *reachable;
@@ -209,224 +682,715 @@ int main(int argc, char **argv)
         reachable[s] = 0;
         long long time_before_init = getCurrentTimeMicros();
 
+        int status = INA260_ERR_OPEN;
         for (int r=0; r<INIT_RETRY_NUM; r++)
         {
-            fd[s] = i2c_init(SENSOR_ADDRS[s]);
-            if (ina260_config(fd[s], current_enable, voltage_enable, usr_sampling_time)==0)
+            status = ina260_dev_open(&devs[s], sensor_buses[s], sensor_addrs[s]);
+            if (status == INA260_OK)
+                status = ina260_dev_configure_profile(&devs[s], &profiles[s]);
+            if (status == INA260_OK)
             {
                 printf("\033[0;32mSensor %d succesfully configured. \033[0m \n", s);
-                reachable[s]=1; 
+                reachable[s]=1;
                 long long time_after_init = getCurrentTimeMicros();
                 printf("Elapsed time for first initialization of Sensor %d: %lld us\n",s ,time_after_init-time_before_init);
                 break;
             }
+            ina260_dev_close(&devs[s]);
             usleep(30000);
         }
 
         if (reachable[s]==0)
         {
-            printf("\033[31mSensor %d is unreachable.  \033[0m\n", s);
+            printf("\033[31mSensor %d is unreachable (%s).  \033[0m\n", s, ina260_strerror(status));
         }
 
     }
-    long long nextExecTimeMicros; // Holds the next time to execute measurements
-    long long microsToSleepFor;
-    long long meas_starting_timestamp; // Starting time of the measurement (using high presicion clock)
 
-    meas_starting_timestamp = getCurrentTimeMicros();
-    nextExecTimeMicros = meas_starting_timestamp + measurement_time_us;
-    printf("Measruement started. Please wait...\n");
-    alarm(meas_time+1);
-    long captured_samples = num_samples;
-    struct timespec starting_date_time; // Starting time of the measurement in wall-clock which includes year, month, day, ... (lower precision)
-    clock_gettime(CLOCK_REALTIME, &starting_date_time);
-    int i2c_retry_cnt = 0;
-   for (long i =0; i<num_samples; i++)
+    // Layout of the rows: for each sensor, its current register (if enabled), its voltage register (if enabled)
+    // and its power register (if enabled)
+    struct capture_header hdr;
+    __u32 fields = (current_enable ? CAPTURE_FIELD_CURRENT : 0) | (voltage_enable ? CAPTURE_FIELD_VOLTAGE : 0) |
+                   (power_enable ? CAPTURE_FIELD_POWER : 0);
+
+    // Timing the transactions of a row on every bus before the measurement, to choose (-s auto) or check the sampling time
+    struct calibration cal;
+    memset(&cal, 0, sizeof(cal));
+    if (calibration_policy != CALIBRATION_OFF)
     {
-        // Making sure there is at least measurement_time_us microseconds between measurments
-        microsToSleepFor = nextExecTimeMicros - getCurrentTimeMicros();
-        while(microsToSleepFor>0 && i!=0) // Busy waiting sleep works more precise than using usleep!
+        if (calibrate_buses(&cal, devs, profiles, reachable, num_sensors, fields, batch_enable, alert_spec != NULL) != 0)
         {
-            microsToSleepFor = nextExecTimeMicros - getCurrentTimeMicros();
+            printf("\033[31mCould not calibrate the buses.\033[0m\n");
+            return 1;
         }
+        if (cal.adapter >= 0)
+            printf("Bus calibration: a row takes %.1f us (median %.1f us) on the slowest bus (%d), the shortest sustainable sampling time is %u us.\n",
+                   cal.row_ns / 1000.0, cal.row_median_ns / 1000.0, cal.adapter, cal.min_period_us);
+        if (cal.errors > 0)
+            printf("\033[0;33m%ld transactions failed during the calibration. \033[0m\n", cal.errors);
 
-        // Calculating the next time to do the measurements 
-        nextExecTimeMicros = getCurrentTimeMicros() + measurement_time_us;
-
-        // Calculating the time elapsed to perform one measurement from all the sensor since the starting timestamp
-        time_offset_buffer[i] = getCurrentTimeMicros() - meas_starting_timestamp;
-
-        // Performing one measurement for each of the available sensor
-        for (s=0; s<num_sensors; s++)
+        // The sampling period is the conversion time on a timer and the cycle of the slowest sensor with alerts
+        if (auto_sampling_time)
         {
-            if (reachable[s]==1)
+            int chosen = 0;
+            for (int t=0; t<(int)(sizeof(CONVERSION_TIMES)/sizeof(CONVERSION_TIMES[0])) && chosen == 0; t++)
             {
-                int Err = 0;
-                do
+                long cycle_us = build_profiles(profiles, num_sensors, sensor_buses, sensor_addrs, profile_specs, num_profile_specs,
+                                               current_convert, voltage_convert, CONVERSION_TIMES[t]);
+                if ((alert_spec != NULL ? cycle_us : CONVERSION_TIMES[t]) >= cal.min_period_us)
                 {
-                    if (Err != 0)
-                    {
-                        fd[s] = i2c_init(SENSOR_ADDRS[s]);
-                        Err = ina260_config(fd[s], current_enable, voltage_enable, usr_sampling_time);
-                        printf("\033[31mI2C Error! \033[0m \n");
-                        i2c_retry_cnt++;
-                    }
-                    if (current_enable == 1)
+                    chosen = CONVERSION_TIMES[t];
+                    longest_cycle_us = cycle_us;
+                }
+            }
+            if (chosen == 0)
+            {
+                printf("\033[31mNo sampling time is long enough for the buses. Use fewer sensors per bus, -B, -P or -w.\033[0m\n");
+                return 1;
+            }
+            if (chosen != usr_sampling_time)
+            {
+                // The sensors were configured with the shortest conversion time
+                usr_sampling_time = chosen;
+                for (s=0; s<num_sensors; s++)
+                {
+                    if (reachable[s] == 1 && ina260_dev_configure_profile(&devs[s], &profiles[s]) != INA260_OK)
                     {
-                        current_buffer[i*((long)num_sensors)+(long)s] = current_read(fd[s]);
-                        if (current_buffer[i*((long)num_sensors)+(long)s]==0x7fff)
-                            Err = 1;
+                        printf("\033[31mSensor %d is unreachable.  \033[0m\n", s);
+                        reachable[s] = 0;
                     }
+                }
+            }
+            printf("Sampling time %d us was selected automatically.\n", usr_sampling_time);
+        }
+        long period_us = alert_spec != NULL ? longest_cycle_us : usr_sampling_time;
+        if (period_us < cal.min_period_us)
+        {
+            printf("\033[%sThe buses cannot sustain a sampling time of %ld us (%u us or more are needed). Use -s auto, a longer -s,\n"
+                   "fewer sensors per bus, -B, -P or -w%s.\033[0m\n", calibration_policy == CALIBRATION_WARN ? "0;33m" : "31m",
+                   period_us, cal.min_period_us, calibration_policy == CALIBRATION_WARN ? "" : " (or -K warn to measure anyway)");
+            if (calibration_policy == CALIBRATION_REFUSE)
+                return 1;
+        }
+    }
 
-                    if (voltage_enable == 1)
-                    {
-                        voltage_buffer[i*((long)num_sensors)+(long)s] = voltage_read(fd[s]);
-                        if (voltage_buffer[i*((long)num_sensors)+(long)s]==0x7fff)
-                            Err = 1;
-                    }
-                    if (i2c_retry_cnt>=I2C_RETRY_NUM)
-                        i2c_error_ind = 1;
+    printf("Sampling time is set to %d microseconds. \n",usr_sampling_time);
+    for (int k=0; k<num_sensors && num_profile_specs > 0; k++)
+    {
+        printf("Sensor %d (%d-%#02X): current %d us, voltage %d us, %d averages, %s, a result every %ld us\n", k,
+               sensor_buses[k], sensor_addrs[k], profiles[k].current_ct_us, profiles[k].voltage_ct_us, profiles[k].averages,
+               profiles[k].triggered ? "triggered" : "continuous", ina260_profile_cycle_us(&profiles[k]));
+    }
 
-                } while(Err != 0 && i2c_error_ind == 0);
-            }
+    // Number of samples required for the measurements.
+    long measurement_time_us = usr_sampling_time;
+    // With conversion ready alerts a row is taken per conversion cycle of the slowest sensor, which converts every enabled
+    // measurement in turn (and averages them)
+    if (alert_spec != NULL)
+        measurement_time_us = longest_cycle_us;
+    long num_samples = continuous ? LONG_MAX : round((meas_time*1000000)/measurement_time_us);
+
+    capture_header_init(&hdr, num_sensors, sensor_addrs, sensor_buses, reachable, fields, usr_sampling_time);
+    for (s=0; s<num_sensors; s++)
+    {
+        hdr.sensor_config[s] = devs[s].config;
+        hdr.sensor_cost_ns[s] = cal.sensor_ns[s];
+    }
+    hdr.row_cost_ns = cal.row_ns;
+    hdr.min_period_us = cal.min_period_us;
+    long num_fields = hdr.num_fields;
+
+    // Energy of the GPUs, integrated from the rows as they are merged. Without a topology the phase markers
+    // are attributed the energy of all the sensors together, when it can be computed
+    struct energy_meter meter;
+    int energy_enable = topology_file != NULL;
+    if (topology_file == NULL && marker_name != NULL && (power_enable == 1 || (current_enable == 1 && voltage_enable == 1)))
+    {
+        energy_init_total(&meter, &hdr);
+        energy_enable = 1;
+    }
+    if (topology_file != NULL)
+    {
+        if (power_enable == 0 && (current_enable == 0 || voltage_enable == 0))
+        {
+            printf("\033[31mThe energy of the GPUs needs the power (-w) or the current and voltage (-c -v) of the sensors.\033[0m\n");
+            return 1;
         }
-        if (user_interrupt==1)
+        int res = energy_load(&meter, topology_file, &hdr);
+        if (res < 0)
         {
-            printf("Program was interrupted by user.\n");
-            captured_samples = i;
-            break;
+            printf("\033[31mCould not read the topology file %s.\033[0m\n", topology_file);
+            return 1;
         }
-        if (measurement_timeout==1)
+        if (res > 0)
         {
-            printf("Measurement time has been reached.\n");
-            captured_samples = i;
-            break;
+            printf("\033[31mInvalid line %d in the topology file %s (unknown sensor or too many GPUs or rails).\033[0m\n", res, topology_file);
+            return 1;
         }
-        if (i2c_error_ind==1)
+        for (int r=0; r<meter.num_rails; r++)
         {
-            printf("\033[31mI2C bus error caused the program to stop. %lld \033[0m \n");
-            captured_samples = i;
-            break;
+            for (int k=0; k<meter.rails[r].num_sensors; k++)
+            {
+                if (reachable[meter.rails[r].sensors[k]] == 0)
+                    printf("\033[0;33mThe sensor of rail %s of %s is unreachable, its power is not counted. \033[0m\n",
+                           meter.rails[r].name, meter.gpus[meter.rails[r].gpu].name);
+            }
         }
     }
+
+    // Conversion ready alerts: each sensor pulls its ALERT line low when a new conversion is available
+    struct alert_line *alerts = (struct alert_line*) malloc(num_sensors * sizeof(struct alert_line));
+    int alert_timeout_ms = 4 * longest_cycle_us / 1000;
+    if (alert_timeout_ms < ALERT_TIMEOUT_MIN_MS)
+        alert_timeout_ms = ALERT_TIMEOUT_MIN_MS;
     for (s=0; s<num_sensors; s++)
+        alerts[s].fd = -1;
+    if (alert_spec != NULL)
     {
-        if (reachable[s]==1)
+        char *chip = strdup(alert_spec);
+        char *lines = strchr(chip, ':');
+        if (lines != NULL)
+            *lines++ = '\0';
+        if (strcmp(alert_spec, "sim") != 0 && lines == NULL)
+        {
+            printf("\033[31mInvalid alert lines %s.\033[0m\n", alert_spec);
+            return 1;
+        }
+        for (s=0; s<num_sensors; s++)
         {
-            close(fd[s]);
+            unsigned int offset = lines ? strtoul(lines, &lines, 0) : 0;
+            if (lines != NULL && *lines == ',')
+                lines++;
+            if (reachable[s]==0)
+                continue;
+            if (ina260_dev_alert_conversion_ready(&devs[s]) != INA260_OK)
+            {
+                printf("\033[31mCould not enable the conversion ready alert of sensor %d.\033[0m\n", s);
+                return 1;
+            }
+            if (strcmp(alert_spec, "sim") == 0)
+            {
+                int sim_fd = sim_ina260_alert_fd(sensor_buses[s], sensor_addrs[s]);
+                if (sim_fd >= 0)
+                    alert_open_counter(&alerts[s], sim_fd);
+            }
+            else
+                alert_open_gpio(&alerts[s], chip, offset);
+            if (alerts[s].fd < 0)
+            {
+                printf("\033[31mCould not open the alert line of sensor %d.\033[0m\n", s);
+                return 1;
+            }
         }
+        free(chip);
+        printf("Conversion ready alerts are enabled.\n");
     }
 
-    // Writing Data to file
-    printf("Measruement is done. Writing to file...\n");
-    struct timespec w_st, w_et;// Writing to file starting and ending time
-    clock_gettime(CLOCK_REALTIME, &w_st);
-    long long min_meas_time = 1000000000;
-    long long max_meas_time = 0;
-    long long avg_meas_time = 0;
-    long long sum_meas_time = 0;
-
-    FILE *fpt;
-    fpt = fopen(filename, "w+");
-    fprintf(fpt,"Date,Time of the day (us)");
+    // The sensors are configured, from now on registers are only read
     for (s=0; s<num_sensors; s++)
+        devs[s].fast_read = fast_read;
+    if (fast_read == 1)
+        printf("Fast reads are enabled.\n");
 
-        if (reachable[s]==1)
+    // One acquisition thread per adapter with reachable sensors, each pinned to its own CPU (CPU 0 is left to the
+    // merger and the interrupts when there are enough of them)
+    struct sampler_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.current_enable = current_enable;
+    cfg.voltage_enable = voltage_enable;
+    cfg.power_enable = power_enable;
+    cfg.current_convert = current_convert;
+    cfg.voltage_convert = voltage_convert;
+    cfg.batch_enable = batch_enable;
+    cfg.alert_enable = alert_spec != NULL;
+    cfg.num_fields = num_fields;
+    cfg.num_samples = num_samples;
+    cfg.period_ns = measurement_time_us*1000;
+    cfg.alert_timeout_ms = alert_timeout_ms;
+    cfg.rt_priority = rt_spec != NULL ? RT_PRIORITY : 0;
+    atomic_init(&cfg.stop, 0);
+
+    struct bus_sampler samplers[CAPTURE_MAX_SENSORS];
+    int num_buses = 0;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (s=0; s<num_sensors; s++)
+    {
+        if (reachable[s]==0)
+            continue;
+        int b = 0;
+        while (b < num_buses && samplers[b].adapter != sensor_buses[s])
+            b++;
+        if (b == num_buses)
+        {
+            int cpu = num_cpus > 1 ? (b + 1) % num_cpus : -1;
+            if (num_rt_cpus > 0)
+                cpu = rt_cpus[b % num_rt_cpus];
+            if (sampler_init(&samplers[b], &cfg, sensor_buses[s], cpu) != 0)
             {
-                if (current_enable == 1)
-                    fprintf(fpt,",Sensor %#02X current (mA)",SENSOR_ADDRS[s]);
+                printf("Could not allocate memory for the bus samplers.\n");
+                return 1;
+            }
+            num_buses++;
+        }
+        sampler_add_sensor(&samplers[b], &devs[s], &profiles[s], reachable[s], alerts[s], s);
+    }
+    if (num_buses > 1)
+        printf("Sampling %d I2C buses in parallel.\n", num_buses);
+    for (int b=0; b<num_buses && rt_spec != NULL; b++)
+    {
+        if (samplers[b].cpu >= 0)
+            printf("Real-time mode: bus %d is sampled on CPU %d with SCHED_FIFO priority %d.\n", samplers[b].adapter,
+                   samplers[b].cpu, RT_PRIORITY);
+        else
+            printf("Real-time mode: bus %d is sampled with SCHED_FIFO priority %d.\n", samplers[b].adapter, RT_PRIORITY);
+    }
+    if (batch_enable == 1)
+        printf("Batched reads are enabled (one combined transfer per bus and sample).\n");
+
+    // Definining the storage of the rows (time offset in microseconds with reference to starting time
+    // of entire measurement followed by the register values):
+    //   streaming: a bounded ring drained by the writer thread, so memory use does not depend on the measurement time
+    //   buffered csv: an array holding every row, written to the file once the measurement is over
+    //   buffered bin: the pre-sized capture file itself, mapped in memory
+    //   compressed csv: blocks of delta coded rows, decoded when the file is written
+    struct stream_writer writer;
+    struct capture_file capture;
+    struct sample_store store;
+    unsigned char *records = NULL;
+    struct sample_record *scratch_record = NULL;
+    u_int8_t store_full = 0;
 
-                if (voltage_enable == 1)
-                    fprintf(fpt,",Sensor %#02X voltage (mV)",SENSOR_ADDRS[s]);
+    if (stream_enable == 1)
+    {
+        if (spsc_ring_init(&writer.ring, hdr.record_size, STREAM_RING_SLOTS) != 0)
+        {
+            printf("Could not allocate memory for the streaming ring.\n");
+            return 1;
+        }
+        scratch_record = (struct sample_record*) calloc(1, writer.ring.slot_size);
+        if (scratch_record == NULL)
+        {
+            printf("Could not allocate memory for the streaming ring.\n");
+            return 1;
+        }
+        atomic_init(&writer.done, 0);
+        printf("Streaming mode is enabled.\n");
+    }
+    else if (format == FORMAT_BIN)
+    {
+        if (capture_create(&capture, filename, &hdr, num_samples) != 0)
+        {
+            printf("Could not create the capture file %s.\n", filename);
+            return 1;
+        }
+        records = (unsigned char*) capture_slot(&capture, 0);
+    }
+    else if (compress_enable == 1)
+    {
+        scratch_record = (struct sample_record*) calloc(1, hdr.record_size);
+        if (scratch_record == NULL || store_init(&store, &hdr) != 0)
+        {
+            printf("Could not allocate memory for the sample store.\n");
+            return 1;
+        }
+        printf("Samples are kept compressed in memory.\n");
+    }
+    else
+    {
+        records = (unsigned char*) malloc(num_samples * (long)hdr.record_size);
+        if (records==NULL)
+            {
+                printf("Could not allocate memory for the sample buffer.\n");
+                return 1;
             }
-    
-    fprintf(fpt,"\n");
-    long long time_of_day_us;
-    struct timespec timestamp;
-    struct tm *st = localtime(&starting_date_time.tv_sec);
-    long long starting_time_of_day_us = 0;
-    starting_time_of_day_us = (((long long)(st->tm_hour))*3600 + ((long long)(st->tm_min))*60 + ((long long)(st->tm_sec)))*1000000 + (long long) starting_date_time.tv_nsec/1000;
-    signed short max_current = 0;
-    signed short min_current = 0x7FFF;
-    signed short max_voltage = 0;
-    signed short min_voltage = 0x7FFF;
-    signed short current_ma = 0;
-    signed short voltage_mv = 0;
-
-    for (long i =0; i<captured_samples-1; i++)
-    {
-        timestamp.tv_sec = starting_date_time.tv_sec + (time_offset_buffer[i] + starting_date_time.tv_nsec/1000)/1000000;
-        struct tm *ct = localtime(&timestamp.tv_sec);
-
-        // Writing date (year, month, and day)
-        fprintf(fpt,"%02d/%02d/%04d,",(ct->tm_mon+1), ct->tm_mday, (ct->tm_year+1900));
-        
-        // Writing time of the day in microseconds (number of microseconds past since 12:00AM)
-        time_of_day_us = starting_time_of_day_us + (long long)time_offset_buffer[i];
-        fprintf(fpt,"%lld",time_of_day_us);
-
-        // Writing Sensor Data
-        for (s=0; s<num_sensors; s++)
+    }
+
+    // Real-time mode: the pages the merger writes are mapped before the start timestamp (the samplers map theirs
+    // when they are started)
+    if (rt_spec != NULL)
+    {
+        if (stream_enable == 1)
+            rt_prefault(writer.ring.slots, (writer.ring.mask + 1) * writer.ring.slot_size);
+        else if (records != NULL)
+            rt_prefault(records, num_samples * (long)hdr.record_size);
+        if (scratch_record != NULL)
+            rt_prefault(scratch_record, hdr.record_size);
+        rt_prefault_stack();
+    }
+
+    pthread_barrier_init(&cfg.start, NULL, num_buses + 1);
+    for (int b=0; b<num_buses; b++)
+    {
+        if (sampler_start(&samplers[b]) != 0)
         {
-            if (reachable[s]==1)
+            printf("\033[31mCould not start the sampler of I2C bus %d%s.\033[0m\n", samplers[b].adapter,
+                   rt_spec != NULL ? " (SCHED_FIFO needs root or CAP_SYS_NICE)" : "");
+            return 1;
+        }
+    }
+
+    pthread_t writer_tid;
+    long dropped_rows = 0;
+
+    long long meas_starting_timestamp; // Starting time of the measurement (using high presicion clock)
+
+    meas_starting_timestamp = getCurrentTimeMicros();
+    printf("Measruement started. Please wait...\n");
+    if (continuous == 0)
+        alarm(meas_time+1);
+    long captured_samples = 0;
+    struct timespec starting_date_time; // Starting time of the measurement in wall-clock which includes year, month, day, ... (lower precision)
+    clock_gettime(CLOCK_REALTIME, &starting_date_time);
+    capture_header_start(&hdr, starting_date_time, meas_starting_timestamp);
+    if (format == FORMAT_BIN && stream_enable == 0)
+        capture_header_start(capture.hdr, starting_date_time, meas_starting_timestamp);
+    if (stream_enable == 1)
+    {
+        writer.hdr = &hdr;
+        writer.format = format;
+        writer.segmented = segment_spec != NULL;
+        writer.write_errors = 0;
+        summary_init(&writer.summary);
+        int open_err;
+        if (writer.segmented)
+            open_err = segment_open(&writer.segments, filename, &hdr, format == FORMAT_BIN, segment_limits);
+        else if (format == FORMAT_BIN)
+            open_err = capture_create(&writer.capture, filename, &hdr, 0);
+        else
+            open_err = csv_open(&writer.csv, filename, &hdr);
+        if (open_err != 0)
+        {
+            printf("Could not create the file %s.\n", filename);
+            return 1;
+        }
+        pthread_create(&writer_tid, NULL, stream_writer_thread, &writer);
+    }
+
+    // Live feed: the rows are published as they are merged, for readers in other processes
+    struct live_writer live;
+    if (live_name != NULL)
+    {
+        if (live_create(&live, live_name, &hdr, LIVE_DEFAULT_SLOTS) != 0)
+        {
+            printf("\033[31mCould not create the live feed %s.\033[0m\n", live_name);
+            return 1;
+        }
+        printf("Samples are published to the live feed %s.\n", live_name);
+    }
+
+    // Phase markers: placed on the time base of the rows as they are merged
+    struct marker_queue markers;
+    struct phase_table *phases = NULL;
+    char markers_file[PATH_MAX], phases_file[PATH_MAX];
+    if (marker_name != NULL)
+    {
+        side_file_name(filename, ".markers.csv", markers_file, sizeof(markers_file));
+        side_file_name(filename, ".phases.csv", phases_file, sizeof(phases_file));
+        phases = (struct phase_table*) malloc(sizeof(struct phase_table));
+        if (phases == NULL || phase_init(phases, &hdr, energy_enable ? &meter : NULL, markers_file) != 0)
+        {
+            printf("\033[31mCould not create the marker log %s.\033[0m\n", markers_file);
+            return 1;
+        }
+        if (marker_create(&markers, marker_name, MARKER_DEFAULT_SLOTS, marker_mode) != 0)
+        {
+            printf("\033[31mCould not create the marker queue %s.\033[0m\n", marker_name);
+            return 1;
+        }
+        printf("Phase markers are accepted in %s%s.\n", marker_name, energy_enable ? "" : " (durations only, no power is measured)");
+    }
+
+    // Rollups: the whole run for the final report, plus the windows of -U written as they close
+    struct rollup *rollups = (struct rollup*) malloc(sizeof(struct rollup));
+    if (rollups == NULL)
+    {
+        printf("Could not allocate memory for the rollups.\n");
+        return 1;
+    }
+    rollup_init(rollups, &hdr);
+    for (int l=0; l<num_rollup_levels; l++)
+    {
+        char window[24], suffix[48], rollup_file[PATH_MAX];
+        rollup_window_name(rollup_windows[l], window, sizeof(window));
+        snprintf(suffix, sizeof(suffix), ".rollup-%s.csv", window);
+        side_file_name(filename, suffix, rollup_file, sizeof(rollup_file));
+        if (rollup_add_level(rollups, rollup_windows[l], rollup_file) != 0)
+        {
+            printf("\033[31mCould not create the rollup file %s.\033[0m\n", rollup_file);
+            return 1;
+        }
+        printf("Rollups over %s windows are written to %s.\n", window, rollup_file);
+    }
+
+    // Releasing the samplers: they all count their deadlines from the same starting time
+    cfg.start_us = meas_starting_timestamp;
+    struct rt_usage process_usage;
+    rt_usage_self(&process_usage);
+    pthread_barrier_wait(&cfg.start);
+
+    // Merging the rows of the buses, in deadline order, into the rows of the capture
+    for (;;)
+    {
+        // Destination of the next row: the next ring slot in streaming mode, the next buffered record otherwise
+        struct sample_record *record;
+        if (stream_enable == 1)
+        {
+            record = (struct sample_record*) spsc_ring_reserve(&writer.ring);
+            if (record == NULL)
+                record = scratch_record; // The writer thread fell behind, the row is dropped
+        }
+        else if (compress_enable == 1)
+            record = scratch_record;
+        else
+            record = (struct sample_record*) (records + captured_samples*(long)hdr.record_size);
+
+        for (int b=0; b<num_buses; b++)
+        {
+            if (samplers[b].i2c_error)
+                i2c_error_ind = 1;
+        }
+        if (user_interrupt==1 || measurement_timeout==1 || i2c_error_ind==1 || store_full==1)
+            atomic_store_explicit(&cfg.stop, 1, memory_order_relaxed);
+
+        // Taking the markers first: one posted before a row was sampled is always placed by that row
+        if (marker_name != NULL)
+        {
+            struct marker m;
+            while (marker_poll(&markers, &m) == 1)
+                phase_mark(phases, &m);
+        }
+
+        int merged = sampler_merge_next(samplers, num_buses, &hdr, record);
+        if (merged < 0)
+            break;
+        if (merged == 0)
+        {
+            usleep(MERGE_IDLE_SLEEP_US);
+            continue;
+        }
+        if (compress_enable == 1 && store_append(&store, record) != 0)
+        {
+            // Out of memory: the row is lost and the measurement stops
+            store_full = 1;
+            continue;
+        }
+        if (live_name != NULL)
+            live_publish(&live, record);
+        // Integrating before the row is handed over, so rows the writer drops still count
+        if (energy_enable)
+        {
+            energy_add(&meter, record);
+            if (topology_file != NULL && energy_report_due(&meter))
+                energy_print(&meter, 0);
+        }
+        if (marker_name != NULL)
+            phase_row(phases, record);
+        rollup_add(rollups, record);
+        if (stream_enable == 1)
+        {
+            if (record == scratch_record)
+                dropped_rows++;
+            else
+                spsc_ring_commit(&writer.ring);
+        }
+        captured_samples++;
+    }
+
+    long alert_timeouts = 0;
+    long bus_dropped_rows = 0;
+    long overruns = 0;
+    long long max_lateness_ns = 0;
+    for (int b=0; b<num_buses; b++)
+        sampler_join(&samplers[b]);
+    FILE *latency_dump = NULL;
+    if (latency_file != NULL && (latency_dump = fopen(latency_file, "w")) == NULL)
+        printf("\033[31mCould not open %s to write the latency histograms.\033[0m\n", latency_file);
+    report_latency(samplers, num_buses, latency_dump);
+    report_gaps(samplers, num_buses);
+    if (rt_spec != NULL)
+    {
+        struct rt_usage usage;
+        rt_usage_self(&usage);
+        rt_usage_since(&usage, &process_usage);
+        report_realtime(samplers, num_buses, &usage);
+    }
+    if (latency_dump != NULL)
+        fclose(latency_dump);
+    for (int b=0; b<num_buses; b++)
+    {
+        if (samplers[b].i2c_error)
+            i2c_error_ind = 1;
+        bus_dropped_rows += samplers[b].dropped_rows;
+        alert_timeouts += samplers[b].alert_timeouts;
+        overruns += samplers[b].sched.overruns;
+        if (samplers[b].sched.max_lateness_ns > max_lateness_ns)
+            max_lateness_ns = samplers[b].sched.max_lateness_ns;
+        sampler_free(&samplers[b]);
+    }
+    pthread_barrier_destroy(&cfg.start);
+    if (live_name != NULL)
+        live_destroy(&live);
+    int open_phases = 0;
+    if (marker_name != NULL)
+    {
+        struct marker m;
+        while (marker_poll(&markers, &m) == 1)
+            phase_mark(phases, &m);
+        if (marker_dropped(&markers) > 0)
+            printf("\033[0;33m%llu phase markers were dropped because the marker queue was full. \033[0m\n",
+                   (unsigned long long)marker_dropped(&markers));
+        marker_destroy(&markers);
+        open_phases = phase_finish(phases);
+        if (open_phases < 0)
+            printf("\033[31mWriting the marker log %s failed.\033[0m\n", markers_file);
+        else if (open_phases > 0)
+            printf("\033[0;33m%d phases were still open and were closed at the last sample. \033[0m\n", open_phases);
+    }
+    if (rollup_finish(rollups) != 0)
+        printf("\033[31mWriting the rollups failed.\033[0m\n");
+    // Encoding the last block now, so a failure is reported with the other end-of-run messages
+    unsigned long long store_lost = 0;
+    if (compress_enable == 1 && store_flush(&store) != 0)
+        store_lost = store.rows - store.encoded_rows;
+    if (user_interrupt==1)
+        printf("Program was interrupted by user.\n");
+    else if (measurement_timeout==1)
+        printf("Measurement time has been reached.\n");
+    if (i2c_error_ind==1)
+        printf("\033[31mI2C bus error caused the program to stop.\033[0m \n");
+    if (store_full==1)
+        printf("\033[31mThe sample store ran out of memory, the measurement was stopped.\033[0m \n");
+    if (store_lost > 0)
+        printf("\033[31mThe sample store ran out of memory for its last block, %llu samples were dropped.\033[0m \n", store_lost);
+    if (alert_spec == NULL && overruns > 0)
+        printf("\033[0;33m%ld sampling deadlines were missed (latest wake-up %lld us after its deadline). \033[0m\n",
+               overruns, max_lateness_ns/1000);
+    if (bus_dropped_rows > 0)
+        printf("\033[0;33m%ld samples were dropped because the merger could not keep up. \033[0m\n", bus_dropped_rows);
+    if (alert_timeouts > 0)
+        printf("\033[0;33m%ld samples were read without a conversion ready alert. \033[0m\n", alert_timeouts);
+    free(alerts);
+
+    struct run_summary summary;
+    long written_rows;
+    int write_status = 0;
+    struct timespec w_st, w_et;// Writing to file starting and ending time
+    if (stream_enable == 1)
+    {
+        // Waiting for the writer thread to drain the ring
+        printf("Measruement is done. Flushing the remaining samples...\n");
+        clock_gettime(CLOCK_REALTIME, &w_st);
+        atomic_store_explicit(&writer.done, 1, memory_order_release);
+        pthread_join(writer_tid, NULL);
+        if (writer.segmented)
+        {
+            written_rows = writer.segments.rows;
+            write_status = segment_close(&writer.segments);
+            printf("%llu segments were written, %ld of them were deleted by the retention limits.\n",
+                   (unsigned long long)writer.segments.seq, writer.segments.deleted);
+        }
+        else if (format == FORMAT_BIN)
+        {
+            written_rows = writer.capture.count;
+            write_status = capture_close(&writer.capture, writer.capture.count);
+        }
+        else
+        {
+            written_rows = writer.csv.rows;
+            write_status = csv_close(&writer.csv);
+        }
+        if (writer.write_errors > 0)
+            write_status = -1;
+        summary = writer.summary;
+        if (dropped_rows > 0)
+            printf("\033[0;33m%ld samples were dropped because the writer could not keep up. \033[0m\n", dropped_rows);
+    }
+    else
+    {
+        summary_init(&summary);
+        for (long i =0; i<captured_samples && compress_enable == 0; i++)
+            summary_add(&summary, &hdr, (struct sample_record*) (records + i*(long)hdr.record_size));
+        if (compress_enable == 1)
+        {
+            printf("%llu samples were kept in %.2f MB (%.2f bytes per sample, %.1f times less than uncompressed).\n",
+                   (unsigned long long)store.encoded_rows, store.allocated / 1e6,
+                   store.encoded_rows ? (double)store.bytes / store.encoded_rows : 0,
+                   store.bytes ? (double)store.encoded_rows * hdr.record_size / store.bytes : 0);
+        }
+
+        // Writing Data to file
+        printf("Measruement is done. Writing to file...\n");
+        clock_gettime(CLOCK_REALTIME, &w_st);
+        written_rows = captured_samples;
+        if (format == FORMAT_BIN)
+        {
+            // The rows are already in the mapped file, only the header and the file size are left
+            write_status = capture_close(&capture, captured_samples);
+        }
+        else
+        {
+            struct csv_out out;
+            if (csv_open(&out, filename, &hdr) != 0)
             {
-                if (current_enable == 1)
+                printf("Could not create the file %s.\n", filename);
+                return 1;
+            }
+            if (compress_enable == 1)
+            {
+                // Decoding the rows once, for the summary and the file
+                struct store_reader reader;
+                if (store_reader_init(&reader, &store) != 0)
                 {
-                    current_ma = reg_to_amp(current_buffer[i*((long)num_sensors)+((long)s)]);
-                    fprintf(fpt,",%d",current_ma);
-                    if (current_ma > max_current)
-                        max_current = current_ma;
-                    if (current_ma < min_current)
-                        min_current = current_ma;
+                    printf("Could not allocate memory for the sample store.\n");
+                    return 1;
                 }
-                if (voltage_enable == 1)
+                while (store_read(&reader, scratch_record) == 1)
                 {
-                    voltage_mv = reg_to_volt(voltage_buffer[i*((long)num_sensors)+((long)s)]);
-                    fprintf(fpt,",%d",voltage_mv);
-                    if (voltage_mv > max_voltage)
-                        max_voltage = voltage_mv;
-                    if (voltage_mv < min_voltage)
-                        min_voltage = voltage_mv;
+                    summary_add(&summary, &hdr, scratch_record);
+                    csv_write_row(&out, scratch_record);
                 }
+                store_reader_free(&reader);
+                store_free(&store);
+                free(scratch_record);
+                written_rows = store.encoded_rows;
             }
+            for (long i =0; i<captured_samples && compress_enable == 0; i++)
+                csv_write_row(&out, (struct sample_record*) (records + i*(long)hdr.record_size));
+            write_status = csv_close(&out);
+            free(records);
         }
-        long long time_diff = time_offset_buffer[i+1]-time_offset_buffer[i];
-        sum_meas_time = sum_meas_time + time_diff;
-        if (time_diff>max_meas_time)
-            max_meas_time = time_diff;
-
-        if (time_diff<min_meas_time)
-            min_meas_time = time_diff;
-
-
-        fprintf(fpt,"\n");
-    }    
-    fclose(fpt);
+    }
 
     clock_gettime(CLOCK_REALTIME, &w_et);
-    printf("Writing measruements to file is succesfully finished!\n");
-    printf("It took %ld seconds to write %ld samples to file.\n",(w_et.tv_sec-w_st.tv_sec),captured_samples-1);
-
-    avg_meas_time = sum_meas_time/(captured_samples-1);
-    printf("Maximum measurement time: %lld us\n", max_meas_time);
-    printf("Minimum measurement time: %lld us\n", min_meas_time);
-    printf("Average measurement time: %lld us\n", avg_meas_time);
+    if (write_status == 0)
+        printf("Writing measruements to file is succesfully finished!\n");
+    else
+        printf("\033[31mWriting measurements to file failed.\033[0m\n");
+    long long write_ms = (w_et.tv_sec-w_st.tv_sec)*1000LL + (w_et.tv_nsec-w_st.tv_nsec)/1000000;
+    printf("It took %lld ms to write %ld samples to file.\n",write_ms,written_rows);
 
-    free(time_offset_buffer);
-    if (current_enable==1)
+    summary_print_times(&summary);
+    rollup_print(rollups);
+    free(rollups);
+    if (topology_file != NULL)
+        energy_print(&meter, 1);
+    if (marker_name != NULL)
     {
-        printf("Maximum Current recorded: %d mA\n",max_current);
-        printf("Minimum Current recorded: %d mA\n",min_current);
-        free(current_buffer);
+        phase_print(phases);
+        if (phase_write(phases, phases_file) == 0)
+            printf("Phase markers were written to %s and the phases to %s.\n", markers_file, phases_file);
+        else
+            printf("\033[31mWriting the phases to %s failed.\033[0m\n", phases_file);
+        free(phases);
     }
-    if (voltage_enable==1)
+
+    if (stream_enable == 1)
     {
-        printf("Maximum Voltage recorded: %d mV\n",max_voltage);
-        printf("Minimum Voltage recorded: %d mV\n",min_voltage);
-        free(voltage_buffer);
+        spsc_ring_free(&writer.ring);
+        free(scratch_record);
     }
-    free(fd);
+    free(devs);
     free(reachable);
 
-    return 0;
+    return write_status == 0 ? 0 : 1;
 }
@@ -0,0 +1,62 @@
+#include "capture.h"
+#include "csv_out.h"
+#include "summary.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// Converts a binary capture written with "example -F bin" to the CSV layout of example
+int main(int argc, char **argv)
+{
+    if (argc != 3 || strcmp(argv[1], "-h") == 0)
+    {
+        printf("Usage: %s <capture.bin> <output.csv>\n", argv[0]);
+        return argc == 2 ? 0 : 1;
+    }
+
+    struct capture_file capture;
+    if (capture_open(&capture, argv[1]) != 0)
+    {
+        printf("\033[31mCannot read the capture %s: %s\033[0m\n", argv[1], strerror(errno));
+        return 1;
+    }
+    const struct capture_header *hdr = capture.hdr;
+    const unsigned char *records = capture.map + hdr->header_size;
+
+    printf("Capture of %u sensors, %llu samples, sampling time %u microseconds.\n",
+           hdr->num_sensors, (unsigned long long)capture.count, hdr->conversion_time_us);
+    if (hdr->min_period_us > 0)
+        printf("Calibrated bus cost: %.1f us per row, %u us or more sustained.\n", hdr->row_cost_ns / 1000.0,
+               hdr->min_period_us);
+    if (hdr->num_records == 0)
+        printf("\033[0;33mThe capture was not closed properly, converting every record the file holds. \033[0m\n");
+
+    struct timespec w_st, w_et;
+    clock_gettime(CLOCK_MONOTONIC, &w_st);
+
+    struct csv_out out;
+    struct run_summary summary;
+    if (csv_open(&out, argv[2], hdr) != 0)
+    {
+        printf("\033[31mCannot create %s: %s\033[0m\n", argv[2], strerror(errno));
+        capture_release(&capture);
+        return 1;
+    }
+    summary_init(&summary);
+    for (__u64 i = 0; i < capture.count; i++)
+    {
+        const struct sample_record *rec = capture_record(hdr, records, i);
+        csv_write_row(&out, rec);
+        summary_add(&summary, hdr, rec);
+    }
+    int status = csv_close(&out);
+
+    clock_gettime(CLOCK_MONOTONIC, &w_et);
+    long long write_ms = (w_et.tv_sec-w_st.tv_sec)*1000LL + (w_et.tv_nsec-w_st.tv_nsec)/1000000;
+    printf("It took %lld ms to write %ld samples to %s.\n", write_ms, out.rows, argv[2]);
+    summary_print(&summary, hdr);
+
+    capture_release(&capture);
+    return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+#include "live.h"
+#include "INA260.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IDLE_SLEEP_US 1000 // Sleep time when no new row is published
+
+static void print_row(const struct capture_header *hdr, const struct sample_record *rec)
+{
+    // Prints the time offset and the enabled values of every reachable sensor, empty when missing
+    int current_enable = (hdr->fields & CAPTURE_FIELD_CURRENT) != 0;
+    int voltage_enable = (hdr->fields & CAPTURE_FIELD_VOLTAGE) != 0;
+    int power_enable = (hdr->fields & CAPTURE_FIELD_POWER) != 0;
+    printf("%u", rec->time_offset);
+    __u16 gaps = capture_gaps(hdr, rec);
+    const __u16 *regs = rec->regs;
+    for (__u32 s = 0; s < hdr->num_sensors; s++, regs += hdr->num_fields)
+    {
+        if (hdr->reachable[s] == 0)
+            continue;
+        int present = (gaps & (1 << s)) == 0;
+        if (current_enable)
+            present ? printf(",%d", reg_to_amp(regs[0])) : printf(",");
+        if (voltage_enable)
+            present ? printf(",%d", reg_to_volt(regs[current_enable])) : printf(",");
+        if (power_enable)
+            present ? printf(",%u", reg_to_watt(regs[current_enable + voltage_enable])) : printf(",");
+    }
+    printf("\n");
+}
+
+// Prints the rows published by "example -M <name>": the latest one with -l, otherwise every row until the measurement ends
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3 || strcmp(argv[1], "-h") == 0 || (argc == 3 && strcmp(argv[2], "-l") != 0))
+    {
+        printf("Usage: %s <name> [-l]\n", argv[0]);
+        return argc == 2 ? 0 : 1;
+    }
+
+    struct live_reader reader;
+    if (live_open(&reader, argv[1]) != 0)
+    {
+        printf("\033[31mCannot open the live feed %s.\033[0m\n", argv[1]);
+        return 1;
+    }
+    const struct capture_header *hdr = &reader.hdr->capture;
+    struct sample_record *rec = (struct sample_record*) malloc(hdr->record_size);
+
+    if (argc == 3)
+    {
+        if (live_latest(&reader, rec) == 0)
+            print_row(hdr, rec);
+        else
+            printf("No sample was published yet.\n");
+    }
+    else
+    {
+        for (;;)
+        {
+            int running = live_running(&reader);
+            if (live_next(&reader, rec) == 1)
+                print_row(hdr, rec);
+            else if (running)
+                usleep(IDLE_SLEEP_US);
+            else
+                break;
+        }
+        if (reader.lost > 0)
+            fprintf(stderr, "\033[0;33m%llu rows were overwritten before they could be read. \033[0m\n",
+                    (unsigned long long)reader.lost);
+    }
+
+    free(rec);
+    live_close(&reader);
+    return 0;
+}
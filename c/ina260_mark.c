@@ -0,0 +1,70 @@
+#include "marker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s <name> begin <label>\n", prog);
+    printf("       %s <name> end <label>\n", prog);
+    printf("       %s <name> run <label> <command> [args...]\n", prog);
+}
+
+// Posts phase markers to "example -E <name>" from scripts: a single begin or end, or a begin and an end around a command
+int main(int argc, char **argv)
+{
+    if (argc < 4 || (strcmp(argv[2], "run") == 0 && argc < 5))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    __u32 event;
+    if (strcmp(argv[2], "begin") == 0 && argc == 4)
+        event = MARKER_BEGIN;
+    else if (strcmp(argv[2], "end") == 0 && argc == 4)
+        event = MARKER_END;
+    else if (strcmp(argv[2], "run") == 0)
+        event = 0;
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct marker_client mc;
+    if (marker_open(&mc, argv[1]) != 0)
+    {
+        printf("\033[31mCannot open the marker queue %s.\033[0m\n", argv[1]);
+        return 1;
+    }
+
+    int status = 0, dropped = 0;
+    if (event != 0)
+        dropped = marker_post(&mc, event, argv[3]) != 0;
+    else
+    {
+        // The exit status is the one of the command
+        dropped = marker_begin(&mc, argv[3]) != 0;
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            execvp(argv[4], argv + 4);
+            perror(argv[4]);
+            _exit(127);
+        }
+        int wstatus = 127 << 8;
+        if (pid > 0)
+            waitpid(pid, &wstatus, 0);
+        dropped |= marker_end(&mc, argv[3]) != 0;
+        status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    }
+    if (dropped)
+    {
+        fprintf(stderr, "\033[0;33mThe marker queue %s is full, a marker was dropped.\033[0m\n", argv[1]);
+        if (event != 0)
+            status = 1;
+    }
+    marker_close(&mc);
+    return status;
+}
@@ -0,0 +1,78 @@
+#include "latency.h"
+
+__u64 lat_bucket_low(int bucket)
+{
+	// Returns the smallest value of a bucket
+	if (bucket < 2 * LAT_SUB_BUCKETS)
+		return bucket;
+	int shift = bucket / LAT_SUB_BUCKETS - 1;
+	return (__u64)(LAT_SUB_BUCKETS + bucket % LAT_SUB_BUCKETS) << shift;
+}
+
+__u64 lat_bucket_high(int bucket)
+{
+	// Returns the largest value of a bucket
+	if (bucket < 2 * LAT_SUB_BUCKETS)
+		return bucket;
+	int shift = bucket / LAT_SUB_BUCKETS - 1;
+	return lat_bucket_low(bucket) + (1ULL << shift) - 1;
+}
+
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+	for (int i = 0; i < LAT_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum_ns += src->sum_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+}
+
+__u64 lat_hist_quantile(const struct lat_hist *h, double q)
+{
+	/*
+	Returns the value below which a fraction q of the recorded values lie,
+	rounded up to the end of its bucket (never above the largest recorded value)
+	*/
+	if (h->count == 0)
+		return 0;
+	__u64 rank = (__u64)(q * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	__u64 seen = 0;
+	for (int i = 0; i < LAT_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen >= rank)
+		{
+			__u64 high = lat_bucket_high(i);
+			return high < h->max_ns ? high : h->max_ns;
+		}
+	}
+	return h->max_ns;
+}
+
+void lat_hist_print(const char *name, const struct lat_hist *h, long errors, long retries, long rereads)
+{
+	/*
+	Prints one line of the latency report in microseconds. Lines with errors,
+	retries or rereads are highlighted
+	*/
+	if (h->count == 0 && errors == 0 && retries == 0 && rereads == 0)
+		return;
+	const char *color = (errors > 0 || retries > 0 || rereads > 0) ? "\033[0;33m" : "";
+	printf("%s%-22s %9llu %9.1f %9.1f %9.1f %9.1f %7ld %7ld %7ld%s\n", color, name, (unsigned long long)h->count,
+	       lat_hist_quantile(h, 0.5) / 1000.0, lat_hist_quantile(h, 0.99) / 1000.0,
+	       lat_hist_quantile(h, 0.999) / 1000.0, h->max_ns / 1000.0, errors, retries, rereads, color[0] ? "\033[0m" : "");
+}
+
+void lat_hist_dump(FILE *f, const char *name, const struct lat_hist *h)
+{
+	// Writes the non-empty buckets of a histogram as "name,low_ns,high_ns,count" lines
+	for (int i = 0; i < LAT_BUCKETS; i++)
+	{
+		if (h->buckets[i] > 0)
+			fprintf(f, "%s,%llu,%llu,%u\n", name, (unsigned long long)lat_bucket_low(i),
+				(unsigned long long)lat_bucket_high(i), h->buckets[i]);
+	}
+}
@@ -0,0 +1,69 @@
+/*
+Log-bucketed latency histograms (HDR style).
+
+Values are nanoseconds. Below 2^LAT_SUB_BITS every value has its own bucket;
+above it, every power of two is split into 2^LAT_SUB_BITS linear buckets, so
+a bucket is never wider than 1/16 (6.25 %) of the values it holds. Values up to
+2^LAT_MAX_BITS ns (about 68 s) are kept, larger ones go to the last bucket.
+
+Recording is a few shifts and an increment, cheap enough to wrap every i2c
+transaction. A histogram belongs to one thread; histograms of several threads
+are combined with lat_hist_merge() once the threads are joined.
+*/
+
+#include <linux/types.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 36
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS)
+
+struct lat_hist
+{
+	__u64 count;
+	__u64 sum_ns;
+	__u64 max_ns;
+	__u32 buckets[LAT_BUCKETS];
+};
+
+static inline long long lat_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline int lat_bucket(__u64 ns)
+{
+	if (ns >= (1ULL << LAT_MAX_BITS))
+		return LAT_BUCKETS - 1;
+	if (ns < LAT_SUB_BUCKETS)
+		return ns;
+	int shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+	return (shift + 1) * LAT_SUB_BUCKETS + (int)(ns >> shift) - LAT_SUB_BUCKETS;
+}
+
+static inline void lat_hist_record(struct lat_hist *h, long long ns)
+{
+	if (ns < 0)
+		ns = 0;
+	h->buckets[lat_bucket(ns)]++;
+	h->count++;
+	h->sum_ns += ns;
+	if ((__u64)ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+__u64 lat_bucket_low(int bucket);
+__u64 lat_bucket_high(int bucket);
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+__u64 lat_hist_quantile(const struct lat_hist *h, double q);
+void lat_hist_print(const char *name, const struct lat_hist *h, long errors, long retries, long rereads);
+void lat_hist_dump(FILE *f, const char *name, const struct lat_hist *h);
+
+#endif
@@ -0,0 +1,77 @@
+#include "live.h"
+#include <stdio.h>
+
+int live_create(struct live_writer *w, const char *name, const struct capture_header *capture, __u32 num_slots)
+{
+	/*
+	Creates (or replaces) the shared memory feed <name>
+
+	Parameters:
+		capture: layout and clock anchors of the rows that will be published
+		num_slots: number of rows kept for the readers (power of two)
+
+	Returns 0 on success, -1 on failure (errno is set)
+	*/
+	memset(w, 0, sizeof(*w));
+	snprintf(w->name, sizeof(w->name), "%s", name);
+	size_t header_size = (sizeof(struct live_header) + LIVE_CACHELINE - 1) & ~(size_t)(LIVE_CACHELINE - 1);
+	size_t slot_size = (sizeof(struct live_slot) + capture->record_size + LIVE_CACHELINE - 1) & ~(size_t)(LIVE_CACHELINE - 1);
+	w->map_size = header_size + num_slots * slot_size;
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, w->map_size) != 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	void *map = mmap(NULL, w->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return -1;
+	}
+
+	// The object is zero filled: no row is published and every slot sequence is 0
+	w->hdr = (struct live_header *)map;
+	w->slots = (unsigned char *)map + header_size;
+	w->hdr->version = LIVE_VERSION;
+	w->hdr->header_size = header_size;
+	w->hdr->slot_size = slot_size;
+	w->hdr->num_slots = num_slots;
+	w->hdr->capture = *capture;
+	atomic_store_explicit(&w->hdr->running, 1, memory_order_relaxed);
+	atomic_store_explicit(&w->hdr->published, 0, memory_order_relaxed);
+
+	// Readers check the magic last
+	atomic_thread_fence(memory_order_release);
+	memcpy(w->hdr->magic, LIVE_MAGIC, sizeof(LIVE_MAGIC));
+	return 0;
+}
+
+void live_publish(struct live_writer *w, const struct sample_record *rec)
+{
+	// Publishes the next row. Never waits for the readers
+	__u64 n = w->count++;
+	struct live_slot *slot = (struct live_slot *)(w->slots + (n & (w->hdr->num_slots - 1)) * (size_t)w->hdr->slot_size);
+	atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&slot->rec, rec, w->hdr->capture.record_size);
+	atomic_store_explicit(&slot->seq, 2 * n + 2, memory_order_release);
+	atomic_store_explicit(&w->hdr->published, n + 1, memory_order_release);
+}
+
+void live_destroy(struct live_writer *w)
+{
+	/*
+	Marks the feed as finished and removes its name. Readers that have it
+	mapped keep the last rows until they unmap it
+	*/
+	atomic_store_explicit(&w->hdr->running, 0, memory_order_release);
+	munmap(w->hdr, w->map_size);
+	shm_unlink(w->name);
+	w->hdr = NULL;
+}
@@ -0,0 +1,199 @@
+/*
+Live sample feed in POSIX shared memory.
+
+With "example -M <name>" every row is also published into the shared memory
+object <name> (see shm_open(3)), a ring of fixed-size slots after a header:
+
+	struct live_header	magic, slot layout, the capture header of the
+				measurement (sensors, fields and clock anchors) and
+				the number of rows published so far
+	slot i			__u64 sequence number followed by a
+				struct sample_record (time offset and raw registers)
+
+Row n (counting from 0) goes to slot n % num_slots. Each slot is a seqlock:
+the writer sets its sequence to 2n+1 while it copies the row and to 2n+2 once
+the row is complete. A reader copies a row out of a slot and keeps it only if
+the sequence was 2n+2 both before and after the copy, so readers never block
+the writer and need no system call once the object is mapped. A reader that
+falls more than num_slots rows behind loses the oldest rows; live_next()
+skips them and counts them.
+
+The reader side is entirely in this header: include it, call live_open() and
+then live_latest() or live_next() as often as needed. The raw registers are
+converted with reg_to_amp(), reg_to_volt() and reg_to_watt() (INA260.h) or by
+hand (1.25 mA, 1.25 mV and 10 mW per bit).
+*/
+
+#include "capture.h"
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef _LIVE_H_
+#define _LIVE_H_
+
+#define LIVE_MAGIC "INA260L"
+#define LIVE_VERSION 1
+#define LIVE_DEFAULT_SLOTS 4096
+#define LIVE_CACHELINE 64
+
+struct live_header
+{
+	char magic[8];
+	__u32 version;
+	__u32 header_size;		// Offset of the first slot
+	__u32 slot_size;
+	__u32 num_slots;		// Power of two
+	atomic_int running;		// 1 while the measurement runs
+	__u32 reserved;
+	struct capture_header capture;	// Layout and clock anchors of the rows
+	_Alignas(LIVE_CACHELINE) atomic_ullong published;	// Number of rows published so far
+};
+
+struct live_slot
+{
+	atomic_ullong seq;		// 2n+1 while row n is written, 2n+2 once it is complete
+	struct sample_record rec;
+};
+
+// Writer (live.c)
+struct live_writer
+{
+	char name[256];
+	struct live_header *hdr;
+	unsigned char *slots;
+	size_t map_size;
+	__u64 count;
+};
+
+int live_create(struct live_writer *w, const char *name, const struct capture_header *capture, __u32 num_slots);
+void live_publish(struct live_writer *w, const struct sample_record *rec);
+void live_destroy(struct live_writer *w);
+
+// Reader
+struct live_reader
+{
+	const struct live_header *hdr;
+	const unsigned char *slots;
+	size_t map_size;
+	__u64 next;			// Next row returned by live_next()
+	__u64 lost;			// Rows overwritten before live_next() reached them
+};
+
+static inline int live_open(struct live_reader *r, const char *name)
+{
+	/*
+	Maps the feed <name> read-only. live_next() starts at the oldest row still in the ring
+
+	Returns 0 on success, -1 if the feed does not exist or is not a feed
+	*/
+	memset(r, 0, sizeof(*r));
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct live_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	r->hdr = (const struct live_header *)map;
+	r->map_size = st.st_size;
+	if (memcmp(r->hdr->magic, LIVE_MAGIC, sizeof(LIVE_MAGIC)) != 0 || r->hdr->version != LIVE_VERSION ||
+	    r->hdr->header_size + (size_t)r->hdr->num_slots * r->hdr->slot_size > r->map_size)
+	{
+		munmap(map, r->map_size);
+		return -1;
+	}
+	r->slots = (const unsigned char *)map + r->hdr->header_size;
+	__u64 published = atomic_load_explicit(&r->hdr->published, memory_order_acquire);
+	r->next = published > r->hdr->num_slots ? published - r->hdr->num_slots : 0;
+	return 0;
+}
+
+static inline void live_close(struct live_reader *r)
+{
+	munmap((void *)r->hdr, r->map_size);
+	r->hdr = NULL;
+}
+
+static inline __u64 live_published(const struct live_reader *r)
+{
+	return atomic_load_explicit(&r->hdr->published, memory_order_acquire);
+}
+
+static inline int live_running(const struct live_reader *r)
+{
+	return atomic_load_explicit(&r->hdr->running, memory_order_acquire);
+}
+
+static inline int live_read(const struct live_reader *r, __u64 n, struct sample_record *out)
+{
+	/*
+	Copies row n into out (capture.record_size bytes)
+
+	Returns 0 on success, -1 if row n is not published yet and -2 if it was overwritten
+	*/
+	const struct live_header *hdr = r->hdr;
+	struct live_slot *slot = (struct live_slot *)(r->slots + (n & (hdr->num_slots - 1)) * (size_t)hdr->slot_size);
+	__u64 want = 2 * n + 2;
+	__u64 before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+	if (before != want)
+		return before < want ? -1 : -2;
+	memcpy(out, &slot->rec, hdr->capture.record_size);
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != want)
+		return -2;
+	return 0;
+}
+
+static inline int live_latest(const struct live_reader *r, struct sample_record *out)
+{
+	/*
+	Copies the most recent row into out
+
+	Returns 0 on success, -1 if no row was published yet
+	*/
+	for (;;)
+	{
+		__u64 published = live_published(r);
+		if (published == 0)
+			return -1;
+		// Overwritten only if the writer went around the whole ring meanwhile, then take the newer row
+		if (live_read(r, published - 1, out) == 0)
+			return 0;
+	}
+}
+
+static inline int live_next(struct live_reader *r, struct sample_record *out)
+{
+	/*
+	Copies the next row of the stream into out
+
+	Returns 1 if a row was copied, 0 if the reader is up to date
+	*/
+	for (;;)
+	{
+		int res = live_read(r, r->next, out);
+		if (res == 0)
+		{
+			r->next++;
+			return 1;
+		}
+		if (res == -1)
+			return 0;
+		// The row was overwritten: skipping to the oldest row still in the ring
+		__u64 published = live_published(r);
+		__u64 oldest = published > r->hdr->num_slots ? published - r->hdr->num_slots : 0;
+		if (oldest <= r->next)
+			oldest = r->next + 1;
+		r->lost += oldest - r->next;
+		r->next = oldest;
+	}
+}
+
+#endif
@@ -0,0 +1,93 @@
+#include "marker.h"
+#include <stdio.h>
+
+int marker_create(struct marker_queue *q, const char *name, __u32 num_slots, mode_t mode)
+{
+	/*
+	Creates (or replaces) the marker queue <name>
+
+	Parameters:
+		num_slots: number of markers the queue holds before they are dropped (power of two)
+		mode: permissions of the shared memory object, e.g. MARKER_DEFAULT_MODE
+
+	Returns 0 on success, -1 on failure (errno is set)
+	*/
+	memset(q, 0, sizeof(*q));
+	snprintf(q->name, sizeof(q->name), "%s", name);
+	q->map_size = sizeof(struct marker_header) + num_slots * sizeof(struct marker_slot);
+	q->num_slots = num_slots;
+
+	// An object left by an earlier run may have other permissions, the mode applies to the new one
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode & 0777);
+	if (fd < 0)
+		return -1;
+	// Not reduced by the umask, a group of producers needs the write bit
+	fchmod(fd, mode & 0777);
+	if (ftruncate(fd, q->map_size) != 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	void *map = mmap(NULL, q->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return -1;
+	}
+
+	q->hdr = (struct marker_header *)map;
+	q->hdr->version = MARKER_VERSION;
+	q->hdr->num_slots = num_slots;
+	for (__u32 i = 0; i < num_slots; i++)
+		atomic_store_explicit(&q->hdr->slots[i].seq, i, memory_order_relaxed);
+	atomic_store_explicit(&q->hdr->running, 1, memory_order_relaxed);
+
+	// Producers check the magic last
+	atomic_thread_fence(memory_order_release);
+	memcpy(q->hdr->magic, MARKER_MAGIC, sizeof(MARKER_MAGIC));
+	return 0;
+}
+
+int marker_poll(struct marker_queue *q, struct marker *out)
+{
+	/*
+	Takes the next posted marker, in ticket order
+
+	Returns 1 if a marker was copied to out, 0 if the queue is empty
+	*/
+	struct marker_header *hdr = q->hdr;
+	__u64 n = q->tail;
+	struct marker_slot *slot = &hdr->slots[n & (q->num_slots - 1)];
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) != n + 1)
+		return 0;
+	*out = slot->m;
+	out->label[MARKER_LABEL_LEN - 1] = '\0';
+	// Labels end up in CSV files
+	for (char *c = out->label; *c != '\0'; c++)
+	{
+		if (*c == ',' || *c == '"' || *c == '\n' || *c == '\r')
+			*c = '_';
+	}
+	// Handing the slot over to ticket n + num_slots
+	atomic_store_explicit(&slot->seq, n + q->num_slots, memory_order_release);
+	q->tail = n + 1;
+	atomic_store_explicit(&hdr->tail, q->tail, memory_order_relaxed);
+	return 1;
+}
+
+__u64 marker_dropped(const struct marker_queue *q)
+{
+	return atomic_load_explicit(&q->hdr->dropped, memory_order_relaxed);
+}
+
+void marker_destroy(struct marker_queue *q)
+{
+	// Removes the queue. Producers that still have it mapped keep posting into the unlinked object
+	atomic_store_explicit(&q->hdr->running, 0, memory_order_release);
+	munmap(q->hdr, q->map_size);
+	shm_unlink(q->name);
+	q->hdr = NULL;
+}
@@ -0,0 +1,197 @@
+/*
+Workload phase markers in POSIX shared memory.
+
+With "example -E <name>" the sampler creates the shared memory object <name>
+(see shm_open(3)), a queue that any number of processes and threads can post
+"begin <label>" and "end <label>" markers to while the measurement runs:
+
+	struct marker_header	magic, number of slots, ticket counter and the
+				number of markers dropped on a full queue
+	slot i			__u64 sequence number followed by a
+				struct marker (time, event and label)
+
+A marker is stamped with CLOCK_MONOTONIC by the process that posts it, the
+clock the sampler measures its time offsets with, so it lines up with the
+rows without depending on when the sampler drains the queue. Posting takes a
+ticket with a compare-and-swap on the ticket counter and fills the slot of the
+ticket (a bounded multi-producer queue): it never makes a system call and
+never blocks. When the sampler falls num_slots markers behind, new markers are
+dropped and counted.
+
+The object is created with mode 0660 unless another mode is
+given, so producers run as the user or in the group of the sampler. The
+sampler never trusts the shared header: it indexes the slots with its own
+copies of the slot count and of the tail.
+
+The posting side is entirely in this header:
+
+	struct marker_client mc;
+	marker_open(&mc, "/ina260-markers");
+	marker_begin(&mc, "forward");
+	...
+	marker_end(&mc, "forward");
+	marker_close(&mc);
+
+The sampler drains the queue in marker.c and attributes time and energy to
+the labels in phase.c.
+*/
+
+#include <linux/types.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef _MARKER_H_
+#define _MARKER_H_
+
+#define MARKER_MAGIC "INA260E"
+#define MARKER_VERSION 1
+#define MARKER_DEFAULT_SLOTS 4096
+#define MARKER_LABEL_LEN 48
+#define MARKER_CACHELINE 64
+#define MARKER_DEFAULT_MODE 0660	// Producers need the group of the sampler
+
+#define MARKER_BEGIN 1
+#define MARKER_END 2
+
+struct marker
+{
+	__s64 time_ns;			// CLOCK_MONOTONIC when the marker was posted
+	__u32 event;			// MARKER_BEGIN or MARKER_END
+	__u32 pid;
+	char label[MARKER_LABEL_LEN];	// Null terminated
+};
+
+struct marker_slot
+{
+	atomic_ullong seq;		// n while slot n is free for ticket n, n+1 once marker n is posted
+	struct marker m;
+};
+
+struct marker_header
+{
+	char magic[8];
+	__u32 version;
+	__u32 num_slots;		// Power of two
+	atomic_int running;		// 1 while the sampler drains the queue
+	__u32 reserved;
+	_Alignas(MARKER_CACHELINE) atomic_ullong tail;		// Next ticket drained by the sampler
+	_Alignas(MARKER_CACHELINE) atomic_ullong head;		// Next ticket handed to a producer
+	atomic_ullong dropped;		// Markers lost on a full queue
+	_Alignas(MARKER_CACHELINE) struct marker_slot slots[];
+};
+
+// Receiver (marker.c)
+struct marker_queue
+{
+	char name[256];
+	struct marker_header *hdr;
+	size_t map_size;
+	__u32 num_slots;		// Private copies: the header is writable by every producer
+	__u64 tail;
+};
+
+int marker_create(struct marker_queue *q, const char *name, __u32 num_slots, mode_t mode);
+int marker_poll(struct marker_queue *q, struct marker *out);
+__u64 marker_dropped(const struct marker_queue *q);
+void marker_destroy(struct marker_queue *q);
+
+// Producer
+struct marker_client
+{
+	struct marker_header *hdr;
+	size_t map_size;
+	__u32 pid;
+};
+
+static inline int marker_open(struct marker_client *c, const char *name)
+{
+	/*
+	Maps the queue <name> created by the sampler
+
+	Returns 0 on success, -1 if the queue does not exist or is not a marker queue
+	*/
+	memset(c, 0, sizeof(*c));
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct marker_header))
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	c->hdr = (struct marker_header *)map;
+	c->map_size = st.st_size;
+	if (memcmp(c->hdr->magic, MARKER_MAGIC, sizeof(MARKER_MAGIC)) != 0 || c->hdr->version != MARKER_VERSION ||
+	    sizeof(struct marker_header) + (size_t)c->hdr->num_slots * sizeof(struct marker_slot) > c->map_size)
+	{
+		munmap(map, c->map_size);
+		return -1;
+	}
+	c->pid = getpid();
+	return 0;
+}
+
+static inline void marker_close(struct marker_client *c)
+{
+	munmap(c->hdr, c->map_size);
+	c->hdr = NULL;
+}
+
+static inline int marker_post(struct marker_client *c, __u32 event, const char *label)
+{
+	/*
+	Posts a marker stamped with the current time. Safe to call from any thread
+
+	Returns 0 on success, -1 if the queue is full (the marker is dropped)
+	*/
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	struct marker_header *hdr = c->hdr;
+	__u64 n = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+	struct marker_slot *slot;
+	for (;;)
+	{
+		slot = &hdr->slots[n & (hdr->num_slots - 1)];
+		__s64 diff = (__s64)(atomic_load_explicit(&slot->seq, memory_order_acquire) - n);
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&hdr->head, &n, n + 1, memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// The slot still holds marker n - num_slots, not drained yet
+			atomic_fetch_add_explicit(&hdr->dropped, 1, memory_order_relaxed);
+			return -1;
+		}
+		else
+			n = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+	}
+	slot->m.time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	slot->m.event = event;
+	slot->m.pid = c->pid;
+	strncpy(slot->m.label, label, MARKER_LABEL_LEN - 1);
+	slot->m.label[MARKER_LABEL_LEN - 1] = '\0';
+	atomic_store_explicit(&slot->seq, n + 1, memory_order_release);
+	return 0;
+}
+
+static inline int marker_begin(struct marker_client *c, const char *label)
+{
+	return marker_post(c, MARKER_BEGIN, label);
+}
+
+static inline int marker_end(struct marker_client *c, const char *label)
+{
+	return marker_post(c, MARKER_END, label);
+}
+
+#endif
@@ -0,0 +1,285 @@
+#include "phase.h"
+#include <stdlib.h>
+#include <string.h>
+
+int phase_init(struct phase_table *pt, const struct capture_header *hdr, const struct energy_meter *em,
+	       const char *log_file)
+{
+	/*
+	Prepares the table for the rows of hdr. The clock anchors of hdr must be set
+
+	Parameters:
+		em: energy meter the rows are integrated by, NULL for durations only
+		log_file: file every marker is logged to, NULL for none
+
+	Returns 0 on success, -1 if the log file cannot be created
+	*/
+	memset(pt, 0, sizeof(*pt));
+	pt->hdr = hdr;
+	pt->em = em;
+	pt->num_gpus = em ? em->num_gpus : 0;
+	if (log_file != NULL)
+	{
+		pt->log = fopen(log_file, "w");
+		if (pt->log == NULL)
+			return -1;
+		fprintf(pt->log, "time_offset_us,unix_us,event,label,pid\n");
+	}
+	return 0;
+}
+
+static struct phase_label *find_label(struct phase_table *pt, const char *name, int create)
+{
+	for (int i = 0; i < pt->num_labels; i++)
+	{
+		if (strcmp(pt->labels[i].name, name) == 0)
+			return &pt->labels[i];
+	}
+	if (!create || pt->num_labels == PHASE_MAX_LABELS)
+		return NULL;
+	struct phase_label *l = &pt->labels[pt->num_labels++];
+	strcpy(l->name, name);
+	return l;
+}
+
+static void apply(struct phase_table *pt, const struct phase_pending *p, const double *uj)
+{
+	// Opens or closes the interval of the marker's label at the energy uj of every GPU
+	const struct capture_header *hdr = pt->hdr;
+	int begin = p->m.event == MARKER_BEGIN;
+	pt->markers++;
+	if (pt->log != NULL)
+	{
+		long long unix_us = hdr->start_realtime_sec * 1000000LL + hdr->start_realtime_nsec / 1000 + p->time_us;
+		fprintf(pt->log, "%lld,%lld,%s,%s,%u\n", (long long)p->time_us, unix_us, begin ? "begin" : "end",
+			p->m.label, p->m.pid);
+	}
+
+	struct phase_label *l = find_label(pt, p->m.label, begin);
+	if (l == NULL && begin)
+	{
+		pt->overflow++;
+		return;
+	}
+	if (begin)
+	{
+		if (l->depth++ == 0)
+		{
+			l->open_us = p->time_us;
+			memcpy(l->open_uj, uj, pt->num_gpus * sizeof(double));
+		}
+		return;
+	}
+	if (l == NULL || l->depth == 0)
+	{
+		pt->unmatched++;
+		return;
+	}
+	if (--l->depth > 0)
+		return;
+	__u64 d = p->time_us > l->open_us ? p->time_us - l->open_us : 0;
+	if (l->count == 0 || d < l->min_us)
+		l->min_us = d;
+	if (d > l->max_us)
+		l->max_us = d;
+	l->count++;
+	l->total_us += d;
+	for (int g = 0; g < pt->num_gpus; g++)
+		l->energy_uj[g] += uj[g] - l->open_uj[g];
+}
+
+static void place(struct phase_table *pt, const struct phase_pending *p, int next, __s64 t1, const double *uj1,
+		  const double *uw1)
+{
+	/*
+	Places a marker between the last row and the next one
+
+	Parameters:
+		next: the next row is known (t1, uj1, uw1), otherwise the marker is clamped to the last row
+	*/
+	double uj[ENERGY_MAX_GPUS];
+	__s64 t0 = pt->row_us;
+	for (int g = 0; g < pt->num_gpus; g++)
+	{
+		if (pt->rows == 0)
+			uj[g] = next ? uj1[g] : 0;
+		else if (!next || p->time_us <= t0 || t1 <= t0)
+			uj[g] = pt->row_uj[g];
+		else
+		{
+			// Trapezoid from the last row to the marker, with the power linear in between (uW * us = pJ)
+			double dt = p->time_us - t0;
+			double uw = pt->row_uw[g] + (uw1[g] - pt->row_uw[g]) * dt / (t1 - t0);
+			uj[g] = pt->row_uj[g] + dt * (pt->row_uw[g] + uw) / 2 / 1e6;
+		}
+	}
+	apply(pt, p, uj);
+}
+
+void phase_mark(struct phase_table *pt, const struct marker *m)
+{
+	// Queues a marker until the row at its time is captured
+	if (pt->num_pending == PHASE_MAX_PENDING)
+	{
+		// No room: the oldest marker is placed at the last row
+		place(pt, &pt->pending[0], 0, 0, NULL, NULL);
+		memmove(pt->pending, pt->pending + 1, --pt->num_pending * sizeof(pt->pending[0]));
+	}
+	__s64 time_us = m->time_ns / 1000 - pt->hdr->start_monotonic_us;
+
+	// Markers of concurrent producers may come slightly out of order
+	int i = pt->num_pending;
+	while (i > 0 && pt->pending[i - 1].time_us > time_us)
+	{
+		pt->pending[i] = pt->pending[i - 1];
+		i--;
+	}
+	pt->pending[i].time_us = time_us;
+	pt->pending[i].m = *m;
+	pt->num_pending++;
+}
+
+void phase_row(struct phase_table *pt, const struct sample_record *rec)
+{
+	// Places the markers up to the time of a row. Called after the row is integrated by the energy meter
+	// Time offsets are 32 bit microseconds and wrap around after about 71 minutes
+	if (pt->rows > 0 && rec->time_offset < pt->prev_offset)
+		pt->time_base += 1ULL << 32;
+	pt->prev_offset = rec->time_offset;
+	__s64 t1 = pt->time_base + rec->time_offset;
+
+	double uj1[ENERGY_MAX_GPUS], uw1[ENERGY_MAX_GPUS];
+	for (int g = 0; g < pt->num_gpus; g++)
+	{
+		const struct energy_acc *acc = &pt->em->gpus[g].acc;
+		uj1[g] = acc->half_uj / 2.0 + acc->half_pj / 2e6;
+		uw1[g] = acc->prev_uw;
+	}
+
+	int n = 0;
+	while (n < pt->num_pending && pt->pending[n].time_us <= t1)
+	{
+		place(pt, &pt->pending[n], 1, t1, uj1, uw1);
+		n++;
+	}
+	if (n > 0)
+	{
+		pt->num_pending -= n;
+		memmove(pt->pending, pt->pending + n, pt->num_pending * sizeof(pt->pending[0]));
+	}
+
+	pt->row_us = t1;
+	memcpy(pt->row_uj, uj1, pt->num_gpus * sizeof(double));
+	memcpy(pt->row_uw, uw1, pt->num_gpus * sizeof(double));
+	pt->rows++;
+}
+
+int phase_finish(struct phase_table *pt)
+{
+	/*
+	Places the markers after the last row at the last row and closes the labels still open
+
+	Returns the number of labels that were still open, or -1 if the marker log could not be written
+	*/
+	for (int i = 0; i < pt->num_pending; i++)
+		place(pt, &pt->pending[i], 0, 0, NULL, NULL);
+	pt->num_pending = 0;
+
+	int open = 0;
+	for (int i = 0; i < pt->num_labels; i++)
+	{
+		struct phase_label *l = &pt->labels[i];
+		if (l->depth == 0)
+			continue;
+		struct phase_pending p;
+		memset(&p, 0, sizeof(p));
+		p.time_us = pt->row_us > l->open_us ? pt->row_us : l->open_us;
+		p.m.event = MARKER_END;
+		strcpy(p.m.label, l->name);
+		l->depth = 1;
+		apply(pt, &p, pt->row_uj);
+		pt->markers--;
+		open++;
+	}
+
+	if (pt->log != NULL)
+	{
+		int err = ferror(pt->log);
+		if (fclose(pt->log) != 0 || err)
+			open = -1;
+		pt->log = NULL;
+	}
+	return open;
+}
+
+static double label_energy_j(const struct phase_table *pt, const struct phase_label *l)
+{
+	double uj = 0;
+	for (int g = 0; g < pt->num_gpus; g++)
+		uj += l->energy_uj[g];
+	return uj / 1e6;
+}
+
+void phase_print(const struct phase_table *pt)
+{
+	// Prints the intervals, time and energy of every label
+	printf("Phases (%ld markers):\n", pt->markers);
+	if (pt->num_gpus > 0)
+		printf("%-24s %8s %12s %12s %14s %12s\n", "label", "count", "total (s)", "mean (ms)", "energy (J)", "average (W)");
+	else
+		printf("%-24s %8s %12s %12s\n", "label", "count", "total (s)", "mean (ms)");
+	for (int i = 0; i < pt->num_labels; i++)
+	{
+		const struct phase_label *l = &pt->labels[i];
+		double total_s = l->total_us / 1e6;
+		double mean_ms = l->count > 0 ? l->total_us / 1e3 / l->count : 0;
+		printf("%-24s %8ld %12.6f %12.3f", l->name, l->count, total_s, mean_ms);
+		if (pt->num_gpus > 0)
+		{
+			double energy_j = label_energy_j(pt, l);
+			printf(" %14.6f %12.3f", energy_j, total_s > 0 ? energy_j / total_s : 0);
+		}
+		printf("\n");
+	}
+	if (pt->unmatched > 0)
+		printf("\033[0;33m%ld end markers had no matching begin. \033[0m\n", pt->unmatched);
+	if (pt->overflow > 0)
+		printf("\033[0;33m%ld markers were ignored, there are more than %d labels. \033[0m\n", pt->overflow,
+		       PHASE_MAX_LABELS);
+}
+
+int phase_write(const struct phase_table *pt, const char *filename)
+{
+	/*
+	Writes the table of the labels as CSV, with the energy of every GPU when it is known
+
+	Returns 0 on success, -1 if the file cannot be written
+	*/
+	FILE *f = fopen(filename, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "label,count,total_s,mean_ms,min_ms,max_ms");
+	if (pt->num_gpus > 0)
+	{
+		fprintf(f, ",energy_j,avg_w");
+		for (int g = 0; g < pt->num_gpus; g++)
+			fprintf(f, ",%s_j", pt->em->gpus[g].name);
+	}
+	fprintf(f, "\n");
+	for (int i = 0; i < pt->num_labels; i++)
+	{
+		const struct phase_label *l = &pt->labels[i];
+		double total_s = l->total_us / 1e6;
+		fprintf(f, "%s,%ld,%.6f,%.3f,%.3f,%.3f", l->name, l->count, total_s,
+			l->count > 0 ? l->total_us / 1e3 / l->count : 0, l->min_us / 1e3, l->max_us / 1e3);
+		if (pt->num_gpus > 0)
+		{
+			double energy_j = label_energy_j(pt, l);
+			fprintf(f, ",%.6f,%.3f", energy_j, total_s > 0 ? energy_j / total_s : 0);
+			for (int g = 0; g < pt->num_gpus; g++)
+				fprintf(f, ",%.6f", l->energy_uj[g] / 1e6);
+		}
+		fprintf(f, "\n");
+	}
+	return fclose(f) == 0 ? 0 : -1;
+}
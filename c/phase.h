@@ -0,0 +1,91 @@
+/*
+Time and energy of the labelled phases of a workload.
+
+Markers (marker.h) are placed on the time base of the rows: their CLOCK_MONOTONIC
+stamp minus the start of the measurement, the way the samplers compute the
+time offsets. A marker is held until the first row at or after its time is
+captured and its energy is then interpolated inside that sampling interval
+with the same trapezoid the energy meter integrates (power linear between two
+rows), so the energy of a phase does not depend on where the markers fall
+between samples.
+
+A label is open from its first "begin" to the matching "end": nested begins
+of the same label are counted and only the outermost pair makes an interval.
+Different labels may overlap freely (e.g. a kernel inside a training step).
+An "end" without a "begin" is counted as unmatched and ignored, and labels
+still open when the measurement ends are closed at the last row (logged as an
+end with pid 0).
+
+Every marker is logged as it is placed, and the table of the labels is
+written at the end:
+
+	<output>.markers.csv	time_offset_us,unix_us,event,label,pid
+	<output>.phases.csv	label,count,total_s,mean_ms,min_ms,max_ms,energy_j,avg_w[,<gpu>_j...]
+*/
+
+#include "capture.h"
+#include "energy.h"
+#include "marker.h"
+#include <stdio.h>
+
+#ifndef _PHASE_H_
+#define _PHASE_H_
+
+#define PHASE_MAX_LABELS 256
+#define PHASE_MAX_PENDING 1024		// Markers waiting for the row at their time
+
+struct phase_label
+{
+	char name[MARKER_LABEL_LEN];
+	int depth;			// Begins not matched by an end yet
+	__s64 open_us;			// Time of the outermost begin
+	double open_uj[ENERGY_MAX_GPUS];
+	long count;			// Completed intervals
+	__u64 total_us;
+	__u64 min_us;
+	__u64 max_us;
+	double energy_uj[ENERGY_MAX_GPUS];
+};
+
+struct phase_pending
+{
+	__s64 time_us;			// Time since the start of the measurement
+	struct marker m;
+};
+
+struct phase_table
+{
+	const struct capture_header *hdr;
+	const struct energy_meter *em;	// NULL when no power is captured: durations only
+	int num_gpus;
+	FILE *log;
+
+	struct phase_label labels[PHASE_MAX_LABELS];
+	int num_labels;
+
+	// Markers sorted by time
+	struct phase_pending pending[PHASE_MAX_PENDING];
+	int num_pending;
+
+	// Last row: unwrapped time, energy so far and power of every GPU
+	long rows;
+	__u64 time_base;
+	__u32 prev_offset;
+	__s64 row_us;
+	double row_uj[ENERGY_MAX_GPUS];
+	double row_uw[ENERGY_MAX_GPUS];
+
+	long markers;
+	long unmatched;
+	long overflow;			// Markers of labels beyond PHASE_MAX_LABELS
+};
+
+int phase_init(struct phase_table *pt, const struct capture_header *hdr, const struct energy_meter *em,
+	       const char *log_file);
+void phase_mark(struct phase_table *pt, const struct marker *m);
+void phase_row(struct phase_table *pt, const struct sample_record *rec);
+int phase_finish(struct phase_table *pt);
+void phase_print(const struct phase_table *pt);
+int phase_write(const struct phase_table *pt, const char *filename);
+
+#endif
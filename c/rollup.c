@@ -0,0 +1,332 @@
+#include "rollup.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const double quantile_ps[ROLLUP_QUANTILES] = {0.5, 0.9, 0.99};
+static const char *const quantity_names[] = {"current (mA)", "voltage (mV)", "power (mW)"};
+
+static void p2_init(struct p2_quantile *q, double p)
+{
+	memset(q, 0, sizeof(*q));
+	q->p = p;
+}
+
+static void p2_add(struct p2_quantile *q, double x)
+{
+	// Adds a value to the estimate of the p-quantile
+	double *h = q->heights, *n = q->pos, *d = q->desired;
+	if (q->n < 5)
+	{
+		// Insertion into the sorted first values
+		int i = q->n++;
+		while (i > 0 && h[i - 1] > x)
+		{
+			h[i] = h[i - 1];
+			i--;
+		}
+		h[i] = x;
+		if (q->n == 5)
+		{
+			for (int k = 0; k < 5; k++)
+				n[k] = k + 1;
+			d[0] = 1;
+			d[1] = 1 + 2 * q->p;
+			d[2] = 1 + 4 * q->p;
+			d[3] = 3 + 2 * q->p;
+			d[4] = 5;
+		}
+		return;
+	}
+
+	// Cell of the value, the extreme markers follow the minimum and the maximum
+	int k;
+	if (x < h[0])
+	{
+		h[0] = x;
+		k = 0;
+	}
+	else if (x >= h[4])
+	{
+		h[4] = x;
+		k = 3;
+	}
+	else
+	{
+		k = 0;
+		while (x >= h[k + 1])
+			k++;
+	}
+	for (int i = k + 1; i < 5; i++)
+		n[i]++;
+	d[1] += q->p / 2;
+	d[2] += q->p;
+	d[3] += (1 + q->p) / 2;
+	d[4] += 1;
+	q->n++;
+
+	// Moving the middle markers towards their desired positions
+	for (int i = 1; i < 4; i++)
+	{
+		double off = d[i] - n[i];
+		if ((off >= 1 && n[i + 1] - n[i] > 1) || (off <= -1 && n[i - 1] - n[i] < -1))
+		{
+			int s = off > 0 ? 1 : -1;
+			double parabolic = h[i] + s / (n[i + 1] - n[i - 1]) *
+					   ((n[i] - n[i - 1] + s) * (h[i + 1] - h[i]) / (n[i + 1] - n[i]) +
+					    (n[i + 1] - n[i] - s) * (h[i] - h[i - 1]) / (n[i] - n[i - 1]));
+			if (h[i - 1] < parabolic && parabolic < h[i + 1])
+				h[i] = parabolic;
+			else
+				h[i] += s * (h[i + s] - h[i]) / (n[i + s] - n[i]);
+			n[i] += s;
+		}
+	}
+}
+
+static double p2_value(const struct p2_quantile *q)
+{
+	// Estimate of the quantile, exact for five values or less
+	if (q->n >= 5)
+		return q->heights[2];
+	if (q->n == 0)
+		return 0;
+	return q->heights[(int)(q->p * (q->n - 1) + 0.5)];
+}
+
+static void reset_level(struct rollup_level *l, int num_cells)
+{
+	l->rows = 0;
+	for (int c = 0; c < num_cells; c++)
+	{
+		struct rollup_cell *cell = &l->cells[c];
+		cell->count = 0;
+		cell->sum = 0;
+		for (int k = 0; k < ROLLUP_QUANTILES; k++)
+			p2_init(&cell->quantiles[k], quantile_ps[k]);
+	}
+}
+
+int rollup_parse(const char *spec, __u64 *windows_us, int max_windows)
+{
+	/*
+	Parses a comma separated list of window lengths, e.g. "1ms,10ms,1s"
+
+	Parameters:
+		spec: lengths with an optional unit (us, ms or s, microseconds by default)
+		windows_us: receives the lengths in microseconds
+
+	Returns the number of windows, or -1 for an invalid length or more than max_windows
+	*/
+	int n = 0;
+	const char *p = spec;
+	while (*p != '\0')
+	{
+		char *end;
+		double value = strtod(p, &end);
+		__u64 scale = 1;
+		if (strncmp(end, "us", 2) == 0)
+			end += 2;
+		else if (strncmp(end, "ms", 2) == 0)
+		{
+			scale = 1000;
+			end += 2;
+		}
+		else if (*end == 's')
+		{
+			scale = 1000000;
+			end++;
+		}
+		if (end == p || value <= 0 || (*end != ',' && *end != '\0') || n == max_windows)
+			return -1;
+		windows_us[n] = value * scale + 0.5;
+		if (windows_us[n] == 0)
+			return -1;
+		n++;
+		p = *end == ',' ? end + 1 : end;
+	}
+	return n > 0 ? n : -1;
+}
+
+void rollup_window_name(__u64 window_us, char *name, size_t len)
+{
+	// Short name of a window length: 1s, 10ms, 500us
+	if (window_us % 1000000 == 0)
+		snprintf(name, len, "%llus", (unsigned long long)(window_us / 1000000));
+	else if (window_us % 1000 == 0)
+		snprintf(name, len, "%llums", (unsigned long long)(window_us / 1000));
+	else
+		snprintf(name, len, "%lluus", (unsigned long long)window_us);
+}
+
+void rollup_init(struct rollup *r, const struct capture_header *hdr)
+{
+	// Prepares the whole-run level for the rows of hdr, window levels are added with rollup_add_level()
+	memset(r, 0, sizeof(*r));
+	r->hdr = hdr;
+	r->num_cells = units_layout(hdr, r->kinds);
+	reset_level(&r->run, r->num_cells);
+}
+
+int rollup_add_level(struct rollup *r, __u64 window_us, const char *filename)
+{
+	/*
+	Adds a level of windows of window_us and creates its file
+
+	Returns 0 on success, -1 if there are ROLLUP_MAX_LEVELS levels already or the file cannot be created
+	*/
+	if (r->num_levels == ROLLUP_MAX_LEVELS)
+		return -1;
+	struct rollup_level *l = &r->levels[r->num_levels];
+	memset(l, 0, sizeof(*l));
+	l->window_us = window_us;
+	l->f = fopen(filename, "w");
+	if (l->f == NULL)
+		return -1;
+	reset_level(l, r->num_cells);
+
+	const struct capture_header *hdr = r->hdr;
+	int multi_bus = capture_multi_bus(hdr);
+	static const char *const stats[] = {"count", "min", "max", "mean", "p50", "p90", "p99"};
+	fprintf(l->f, "time_offset_us,unix_us,rows");
+	for (__u32 s = 0, c = 0; s < hdr->num_sensors; s++)
+	{
+		char name[16];
+		if (multi_bus)
+			snprintf(name, sizeof(name), "%d-%#02X", hdr->sensor_buses[s], hdr->sensor_addrs[s]);
+		else
+			snprintf(name, sizeof(name), "%#02X", hdr->sensor_addrs[s]);
+		for (__u32 f = 0; f < hdr->num_fields; f++, c++)
+		{
+			for (int k = 0; hdr->reachable[s] == 1 && k < 7; k++)
+				fprintf(l->f, ",Sensor %s %s %s", name, quantity_names[r->kinds[c]], stats[k]);
+		}
+	}
+	fprintf(l->f, "\n");
+	r->num_levels++;
+	return 0;
+}
+
+static void write_window(struct rollup *r, struct rollup_level *l)
+{
+	const struct capture_header *hdr = r->hdr;
+	long long unix_us = hdr->start_realtime_sec * 1000000LL + hdr->start_realtime_nsec / 1000 + l->window_start_us;
+	fprintf(l->f, "%llu,%lld,%ld", (unsigned long long)l->window_start_us, unix_us, l->rows);
+	for (__u32 s = 0, c = 0; s < hdr->num_sensors; s++)
+	{
+		for (__u32 f = 0; f < hdr->num_fields; f++, c++)
+		{
+			const struct rollup_cell *cell = &l->cells[c];
+			if (hdr->reachable[s] == 0)
+				continue;
+			if (cell->count == 0)
+			{
+				fprintf(l->f, ",0,,,,,,");
+				continue;
+			}
+			fprintf(l->f, ",%u,%d,%d,%.3f,%.1f,%.1f,%.1f", cell->count, cell->min, cell->max,
+				(double)cell->sum / cell->count, p2_value(&cell->quantiles[0]), p2_value(&cell->quantiles[1]),
+				p2_value(&cell->quantiles[2]));
+		}
+	}
+	fprintf(l->f, "\n");
+	l->windows++;
+}
+
+static void add_values(struct rollup *r, struct rollup_level *l, __u16 gaps, const __s32 *values)
+{
+	const struct capture_header *hdr = r->hdr;
+	for (__u32 s = 0, c = 0; s < hdr->num_sensors; s++)
+	{
+		for (__u32 f = 0; f < hdr->num_fields; f++, c++)
+		{
+			if (hdr->reachable[s] == 0 || (gaps & (1 << s)))
+				continue;
+			struct rollup_cell *cell = &l->cells[c];
+			__s32 v = values[c];
+			if (cell->count == 0 || v < cell->min)
+				cell->min = v;
+			if (cell->count == 0 || v > cell->max)
+				cell->max = v;
+			cell->count++;
+			cell->sum += v;
+			for (int k = 0; k < ROLLUP_QUANTILES; k++)
+				p2_add(&cell->quantiles[k], v);
+		}
+	}
+	l->rows++;
+}
+
+void rollup_add(struct rollup *r, const struct sample_record *rec)
+{
+	// Adds a row to every level, writing the windows it closes
+	// Time offsets are 32 bit microseconds and wrap around after about 71 minutes
+	if (r->rows > 0 && rec->time_offset < r->prev_offset)
+		r->time_base += 1ULL << 32;
+	r->prev_offset = rec->time_offset;
+	__u64 t = r->time_base + rec->time_offset;
+	r->rows++;
+
+	__s32 values[UNITS_MAX_CELLS];
+	units_row(rec->regs, r->kinds, values, r->num_cells);
+	__u16 gaps = capture_gaps(r->hdr, rec);
+	for (int i = 0; i < r->num_levels; i++)
+	{
+		struct rollup_level *l = &r->levels[i];
+		if (t >= l->window_start_us + l->window_us)
+		{
+			if (l->rows > 0)
+				write_window(r, l);
+			reset_level(l, r->num_cells);
+			l->window_start_us = t - t % l->window_us;
+		}
+		add_values(r, l, gaps, values);
+	}
+	add_values(r, &r->run, gaps, values);
+}
+
+int rollup_finish(struct rollup *r)
+{
+	/*
+	Writes the last window of every level and closes the files
+
+	Returns 0 on success, -1 if any write failed
+	*/
+	for (int i = 0; i < r->num_levels; i++)
+	{
+		struct rollup_level *l = &r->levels[i];
+		if (l->rows > 0)
+			write_window(r, l);
+		int err = ferror(l->f);
+		if (fclose(l->f) != 0 || err)
+			r->error = 1;
+		l->f = NULL;
+	}
+	return r->error ? -1 : 0;
+}
+
+void rollup_print(const struct rollup *r)
+{
+	// Prints the whole-run statistics of every sensor and quantity
+	const struct capture_header *hdr = r->hdr;
+	printf("%-26s %10s %10s %10s %12s %10s %10s %10s\n", "sensor", "samples", "min", "max", "mean", "p50", "p90", "p99");
+	for (__u32 s = 0, c = 0; s < hdr->num_sensors; s++)
+	{
+		for (__u32 f = 0; f < hdr->num_fields; f++, c++)
+		{
+			const struct rollup_cell *cell = &r->run.cells[c];
+			if (hdr->reachable[s] == 0)
+				continue;
+			char name[40];
+			snprintf(name, sizeof(name), "%d-%#02X %s", hdr->sensor_buses[s], hdr->sensor_addrs[s],
+				 quantity_names[r->kinds[c]]);
+			if (cell->count == 0)
+			{
+				printf("%-26s %10u\n", name, 0);
+				continue;
+			}
+			printf("%-26s %10u %10d %10d %12.3f %10.1f %10.1f %10.1f\n", name, cell->count, cell->min, cell->max,
+			       (double)cell->sum / cell->count, p2_value(&cell->quantiles[0]), p2_value(&cell->quantiles[1]),
+			       p2_value(&cell->quantiles[2]));
+		}
+	}
+}
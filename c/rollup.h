@@ -0,0 +1,87 @@
+/*
+Online rollups of the captured values over fixed time windows.
+
+Every row is converted to mA, mV and mW (units.h) as it is merged and added to
+each rollup level. A level cuts the time of the measurement into windows of
+its length (window k covers [k x window, (k + 1) x window) from the start) and
+keeps, for every reachable sensor and enabled quantity, the count, minimum,
+maximum and mean of the window plus streaming estimates of its median, 90th
+and 99th percentiles. The percentiles use the P-square algorithm (Jain and
+Chlamtac, 1985): five markers per percentile, adjusted with a parabolic
+prediction as values arrive, so no value is stored and the cost per value is
+constant. Windows of five values or less are exact.
+
+When a row falls past its window the level writes one line and starts over,
+so the files grow with the duration over the window length instead of with
+the number of samples:
+
+	<output>.rollup-<window>.csv	time_offset_us,unix_us,rows, then for each
+					sensor and quantity: count,min,max,mean,p50,p90,p99
+
+Windows without rows are not written. A whole-run level (no file) is always
+kept and printed at the end of the measurement. Missing values are skipped.
+*/
+
+#include "capture.h"
+#include "units.h"
+#include <stdio.h>
+
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#define ROLLUP_MAX_LEVELS 8
+#define ROLLUP_QUANTILES 3		// Median, 90th and 99th percentiles
+
+struct p2_quantile
+{
+	double p;
+	int n;				// Values seen, the first five are kept in heights
+	double heights[5];
+	double pos[5];
+	double desired[5];
+};
+
+struct rollup_cell
+{
+	__u32 count;
+	__s32 min;
+	__s32 max;
+	__s64 sum;
+	struct p2_quantile quantiles[ROLLUP_QUANTILES];
+};
+
+struct rollup_level
+{
+	__u64 window_us;		// 0 for the whole run
+	__u64 window_start_us;		// Time offset of the current window
+	long rows;			// Rows of the current window
+	long windows;			// Windows written
+	FILE *f;
+	struct rollup_cell cells[UNITS_MAX_CELLS];
+};
+
+struct rollup
+{
+	const struct capture_header *hdr;
+	__u8 kinds[UNITS_MAX_CELLS];
+	int num_cells;
+	int num_levels;
+	struct rollup_level levels[ROLLUP_MAX_LEVELS];
+	struct rollup_level run;
+	int error;			// Set once a write failed
+
+	// Unwrapping of the 32 bit time offsets
+	long rows;
+	__u64 time_base;
+	__u32 prev_offset;
+};
+
+int rollup_parse(const char *spec, __u64 *windows_us, int max_windows);
+void rollup_window_name(__u64 window_us, char *name, size_t len);
+void rollup_init(struct rollup *r, const struct capture_header *hdr);
+int rollup_add_level(struct rollup *r, __u64 window_us, const char *filename);
+void rollup_add(struct rollup *r, const struct sample_record *rec);
+int rollup_finish(struct rollup *r);
+void rollup_print(const struct rollup *r);
+
+#endif
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include "rt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+int rt_parse_cpus(const char *spec, int *cpus, int max)
+{
+	/*
+	Parses a CPU list in the kernel format, e.g. "2-3,5"
+
+	Parameters:
+		cpus: receives the CPUs in the order of the list
+
+	Returns the number of CPUs, or -1 for an invalid list or more than max CPUs
+	*/
+	int n = 0;
+	const char *p = spec;
+	while (*p != '\0' && *p != '\n')
+	{
+		char *end;
+		long first = strtol(p, &end, 10), last;
+		if (end == p || first < 0)
+			return -1;
+		last = first;
+		if (*end == '-')
+		{
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first)
+				return -1;
+		}
+		if (*end != ',' && *end != '\0' && *end != '\n')
+			return -1;
+		for (long c = first; c <= last; c++)
+		{
+			if (n == max)
+				return -1;
+			cpus[n++] = c;
+		}
+		p = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+int rt_isolated_cpus(int *cpus, int max)
+{
+	// Returns the number of CPUs isolated from the scheduler (isolcpus=), 0 if there are none or the list cannot be read
+	char list[256];
+	FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+	if (f == NULL)
+		return 0;
+	int n = fgets(list, sizeof(list), f) != NULL ? rt_parse_cpus(list, cpus, max) : 0;
+	fclose(f);
+	return n > 0 ? n : 0;
+}
+
+int rt_lock_memory(void)
+{
+	/*
+	Locks the current and future memory of the process in RAM
+
+	Returns 0 on success, -1 with errno set (EPERM or ENOMEM: RLIMIT_MEMLOCK is too low)
+	*/
+	return mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
+void rt_prefault(void *buf, size_t len)
+{
+	// Writes one byte of every page of a buffer that is about to be filled, so its pages are mapped now
+	if (buf == NULL || len == 0)
+		return;
+	volatile unsigned char *p = buf;
+	long page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < len; i += page)
+		p[i] = 0;
+	p[len - 1] = 0;
+}
+
+void rt_prefault_stack(void)
+{
+	// Maps the stack the calling thread will use
+	volatile unsigned char stack[RT_STACK_PREFAULT];
+	memset((unsigned char *)stack, 0, sizeof(stack));
+}
+
+static void usage_of(int who, struct rt_usage *u)
+{
+	struct rusage ru;
+	memset(u, 0, sizeof(*u));
+	if (getrusage(who, &ru) != 0)
+		return;
+	u->nivcsw = ru.ru_nivcsw;
+	u->majflt = ru.ru_majflt;
+	u->minflt = ru.ru_minflt;
+}
+
+void rt_usage_thread(struct rt_usage *u)
+{
+	// Counters of the calling thread
+	usage_of(RUSAGE_THREAD, u);
+}
+
+void rt_usage_self(struct rt_usage *u)
+{
+	// Counters of the whole process
+	usage_of(RUSAGE_SELF, u);
+}
+
+void rt_usage_since(struct rt_usage *u, const struct rt_usage *start)
+{
+	// Turns the counters of u into the events since start
+	u->nivcsw -= start->nivcsw;
+	u->majflt -= start->majflt;
+	u->minflt -= start->minflt;
+}
@@ -0,0 +1,42 @@
+/*
+Real-time capture mode.
+
+The sampler threads run with SCHED_FIFO, pinned to isolated CPUs (the
+isolcpus= list of /sys/devices/system/cpu/isolated, or CPUs given by the user),
+so no ordinary process can preempt them between deadlines. The memory of the
+process is locked with mlockall(), which also makes every later allocation
+resident as soon as it is mapped, and the buffers of the measurement are
+written once before the start timestamp: no page fault, and no swap-in, lands
+in the timed loop.
+
+Involuntary context switches and page faults are counted with getrusage()
+over the measurement, for every sampler thread and for the whole process, so
+the report tells whether anything still disturbed the samplers.
+*/
+
+#include <stddef.h>
+
+#ifndef _RT_H_
+#define _RT_H_
+
+#define RT_PRIORITY 49			// Below the threaded interrupt handlers (50), so the I2C interrupts are still served
+#define RT_MAX_CPUS 64
+#define RT_STACK_PREFAULT (128 * 1024)	// Stack written by each sampler thread before the measurement
+
+struct rt_usage
+{
+	long nivcsw;			// Involuntary context switches
+	long majflt;			// Page faults that needed I/O
+	long minflt;			// Page faults served from memory
+};
+
+int rt_parse_cpus(const char *spec, int *cpus, int max);
+int rt_isolated_cpus(int *cpus, int max);
+int rt_lock_memory(void);
+void rt_prefault(void *buf, size_t len);
+void rt_prefault_stack(void);
+void rt_usage_thread(struct rt_usage *u);
+void rt_usage_self(struct rt_usage *u);
+void rt_usage_since(struct rt_usage *u, const struct rt_usage *start);
+
+#endif
@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+#include "sampler.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+int sampler_init(struct bus_sampler *bs, struct sampler_config *cfg, int adapter, int cpu)
+{
+	/*
+	Prepares the sampler of one adapter
+
+	Parameters:
+		cfg: settings shared by all the samplers
+		cpu: CPU the thread is pinned to, -1 for none
+
+	Returns 0 on success, -1 if memory cannot be allocated (nothing is left to free)
+	*/
+	memset(bs, 0, sizeof(*bs));
+	bs->cfg = cfg;
+	bs->adapter = adapter;
+	bs->cpu = cpu;
+	bs->batch.fd = -1;
+	bs->devs = (struct ina260_dev*) calloc(CAPTURE_MAX_SENSORS, sizeof(struct ina260_dev));
+	bs->profiles = (struct ina260_profile*) calloc(CAPTURE_MAX_SENSORS, sizeof(struct ina260_profile));
+	bs->stride = (int*) calloc(CAPTURE_MAX_SENSORS, sizeof(int));
+	bs->held = (__u16*) calloc(CAPTURE_MAX_SENSORS * cfg->num_fields, sizeof(__u16));
+	bs->reachable = (__u8*) calloc(CAPTURE_MAX_SENSORS, sizeof(__u8));
+	bs->alerts = (struct alert_line*) calloc(CAPTURE_MAX_SENSORS, sizeof(struct alert_line));
+	bs->columns = (int*) calloc(CAPTURE_MAX_SENSORS, sizeof(int));
+	bs->latency = (struct ina260_latency*) calloc(1, sizeof(struct ina260_latency));
+	atomic_init(&bs->done, 0);
+	if (bs->devs == NULL || bs->profiles == NULL || bs->stride == NULL || bs->held == NULL || bs->reachable == NULL || bs->alerts == NULL || bs->columns == NULL
+	    || bs->latency == NULL)
+	{
+		sampler_free(bs);
+		return -1;
+	}
+	return 0;
+}
+
+int sampler_add_sensor(struct bus_sampler *bs, const struct ina260_dev *dev, const struct ina260_profile *profile,
+		       __u8 reachable, struct alert_line alert, int column)
+{
+	/*
+	Assigns a configured sensor to the sampler
+
+	Parameters:
+		dev: device of the sensor, owned by the sampler from now on
+		profile: conversion settings the sensor was configured with
+		alert: conversion ready alert line of the sensor (used in alert mode)
+		column: index of the sensor in the rows of the capture
+
+	Returns 0 on success, -1 if the sampler is full
+	*/
+	int k = bs->num_sensors;
+	if (k >= CAPTURE_MAX_SENSORS)
+		return -1;
+	bs->devs[k] = *dev;
+	bs->profiles[k] = *profile;
+
+	// On a timer, a sensor that produces a result only every few deadlines is read once per result. Batched reads
+	// and alerts read every sensor of a row together
+	const struct sampler_config *cfg = bs->cfg;
+	bs->stride[k] = 1;
+	if (cfg->alert_enable == 0 && cfg->batch_enable == 0)
+	{
+		long long cycle_ns = ina260_profile_cycle_us(profile) * 1000LL;
+		if (cycle_ns > cfg->period_ns)
+			bs->stride[k] = cycle_ns / cfg->period_ns;
+	}
+	bs->reachable[k] = reachable;
+	bs->recovery[k].state = SENSOR_OK;
+	bs->recovery[k].backoff_ns = SAMPLER_BACKOFF_US * 1000LL;
+	bs->alerts[k] = alert;
+	bs->columns[k] = column;
+	bs->num_sensors++;
+	return 0;
+}
+
+static int wait_alerts(struct bus_sampler *bs, const __u8 *pending, __u8 *fired, struct pollfd *pfds)
+{
+	// Sleeps until at least one pending sensor signals a conversion and flags those that did
+	// Returns the number of sensors that signalled, 0 on a timeout and -1 if interrupted by a signal
+	int n = 0;
+	for (int k = 0; k < bs->num_sensors; k++)
+	{
+		if (pending[k] == 1)
+		{
+			pfds[n].fd = bs->alerts[k].fd;
+			pfds[n].events = POLLIN;
+			n++;
+		}
+	}
+	int res = poll(pfds, n, bs->cfg->alert_timeout_ms);
+	if (res <= 0)
+		return res < 0 ? -1 : 0;
+	n = 0;
+	int num_fired = 0;
+	for (int k = 0; k < bs->num_sensors; k++)
+	{
+		if (pending[k] == 1)
+		{
+			if (pfds[n].revents & POLLIN)
+			{
+				alert_consume(&bs->alerts[k]);
+				fired[k] = 1;
+				num_fired++;
+			}
+			n++;
+		}
+	}
+	return num_fired;
+}
+
+static void recovery_failed(struct bus_sampler *bs, int k, long long now_ns)
+{
+	// Starts the recovery of sensor k over after its backoff. A bus whose sensors are all lost stops the measurement
+	struct sensor_recovery *rc = &bs->recovery[k];
+	rc->state = SENSOR_RESET;
+	rc->due_ns = now_ns + rc->backoff_ns;
+	rc->backoff_ns = rc->backoff_ns * 2 < SAMPLER_BACKOFF_MAX_US * 1000LL ? rc->backoff_ns * 2 : SAMPLER_BACKOFF_MAX_US * 1000LL;
+	rc->failures++;
+	bs->retries[k]++;
+
+	int lost = 1;
+	for (int j = 0; j < bs->num_sensors; j++)
+	{
+		if (bs->reachable[j] == 1 && bs->recovery[j].failures < SAMPLER_I2C_RETRY_NUM)
+			lost = 0;
+	}
+	if (lost)
+		bs->i2c_error = 1;
+}
+
+static void degrade(struct bus_sampler *bs, int k)
+{
+	// Marks sensor k for recovery, starting with a reset at once
+	struct sensor_recovery *rc = &bs->recovery[k];
+	rc->state = SENSOR_RESET;
+	rc->due_ns = 0;
+	bs->retries[k]++;
+	bs->num_degraded++;
+}
+
+static void recovery_step(struct bus_sampler *bs, int k)
+{
+	// Takes the next step of the recovery of sensor k if it is due. Every step is a few transactions, the waits
+	// the sensor needs are left to the following rows
+	const struct sampler_config *cfg = bs->cfg;
+	struct sensor_recovery *rc = &bs->recovery[k];
+	struct ina260_dev *dev = &bs->devs[k];
+	long long now_ns = lat_now_ns();
+	if (now_ns < rc->due_ns)
+		return;
+
+	int status = INA260_OK;
+	enum sensor_state next = SENSOR_OK;
+	switch (rc->state)
+	{
+		case SENSOR_RESET:
+			status = ina260_dev_reset(dev);
+			rc->due_ns = now_ns + INA260_SETTLE_US * 1000LL;
+			next = SENSOR_CHECK_ID;
+			break;
+		case SENSOR_CHECK_ID:
+			status = ina260_dev_check_id(dev);
+			next = SENSOR_CONFIGURE;
+			break;
+		case SENSOR_CONFIGURE:
+			status = ina260_dev_write_config(dev, &bs->profiles[k]);
+			rc->due_ns = now_ns + INA260_SETTLE_US * 1000LL;
+			next = SENSOR_VERIFY;
+			break;
+		case SENSOR_VERIFY:
+			status = ina260_dev_verify_config(dev, &bs->profiles[k]);
+			if (cfg->alert_enable && status == INA260_OK)
+				status = ina260_dev_alert_conversion_ready(dev);
+			next = SENSOR_OK;
+			break;
+		case SENSOR_OK:
+			return;
+	}
+	if (status != INA260_OK)
+	{
+		recovery_failed(bs, k, now_ns);
+		return;
+	}
+	rc->state = next;
+	if (next == SENSOR_OK)
+	{
+		rc->failures = 0;
+		rc->backoff_ns = SAMPLER_BACKOFF_US * 1000LL;
+		rc->recoveries++;
+		bs->num_degraded--;
+	}
+}
+
+static int read_sensor(struct bus_sampler *bs, int k, __u16 *regs)
+{
+	/*
+	Reads the enabled registers of sensor k. A failed read is tried once more at
+	once (a glitch on the bus), then the sensor is degraded and recovered over
+	the next rows
+
+	Returns 0 if the values were read, -1 if the sensor has no value in this row
+	*/
+	const struct sampler_config *cfg = bs->cfg;
+	struct ina260_dev *dev = &bs->devs[k];
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (attempt > 0)
+			bs->rereads[k]++;
+		int Err = 0;
+		__u16 *reg = regs;
+		if (cfg->current_enable && ina260_dev_read(dev, REG_CURRENT, reg++) != INA260_OK)
+			Err = 1;
+		if (cfg->voltage_enable && ina260_dev_read(dev, REG_BUS_VOLTAGE, reg++) != INA260_OK)
+			Err = 1;
+		if (cfg->power_enable && ina260_dev_read(dev, REG_POWER, reg++) != INA260_OK)
+			Err = 1;
+
+		// Releasing the latched alert only after the values are read, so a conversion that completes
+		// in between is skipped rather than read twice
+		if (cfg->alert_enable && Err == 0 && ina260_dev_conversion_ready(dev) < 0)
+			Err = 1;
+
+		// Starting the next conversion of a sensor in triggered mode
+		if (bs->profiles[k].triggered && Err == 0 && ina260_dev_trigger(dev) != INA260_OK)
+			Err = 1;
+		if (Err == 0)
+			return 0;
+	}
+	degrade(bs, k);
+	return -1;
+}
+
+static void mark_gap(struct bus_sampler *bs, struct bus_row *row, int k)
+{
+	// Records that sensor k has no value in the row
+	long num_fields = bs->cfg->num_fields;
+	for (long f = 0; f < num_fields; f++)
+		row->regs[k * num_fields + f] = CAPTURE_MISSING;
+	row->gaps |= 1u << k;
+	bs->recovery[k].gaps++;
+}
+
+static void *sampler_thread(void *arg)
+{
+	struct bus_sampler *bs = (struct bus_sampler*) arg;
+	struct sampler_config *cfg = bs->cfg;
+	long num_fields = cfg->num_fields;
+	struct pollfd pfds[CAPTURE_MAX_SENSORS];
+	__u8 pending[CAPTURE_MAX_SENSORS];	// Sensors not read yet in this row
+	__u8 due[CAPTURE_MAX_SENSORS];		// Sensors to read now
+	long long last_index = -1;
+	int num_reachable = 0;
+	for (int k = 0; k < bs->num_sensors; k++)
+		num_reachable += bs->reachable[k];
+
+	ina260_set_latency(bs->latency);
+	if (cfg->rt_priority > 0)
+		rt_prefault_stack();
+	struct rt_usage usage_start;
+	pthread_barrier_wait(&cfg->start);
+	rt_usage_thread(&usage_start);
+	sched_init(&bs->sched, cfg->start_us * 1000, cfg->period_ns, SAMPLER_SPIN_US * 1000);
+
+	while (atomic_load_explicit(&cfg->stop, memory_order_relaxed) == 0)
+	{
+		long long index = 0;
+		if (cfg->alert_enable == 0 || bs->num_degraded == num_reachable)
+		{
+			// Sleeping until shortly before the next deadline and spinning for the rest. A late row
+			// skips the deadlines it missed instead of shifting the following ones. Alerts are waited for
+			// instead, unless no sensor of the bus can signal
+			index = sched_wait(&bs->sched);
+			if (index >= cfg->num_samples)
+				break;
+			lat_hist_record(&bs->jitter, bs->sched.lateness_ns);
+		}
+
+		struct bus_row *row = (struct bus_row*) spsc_ring_reserve(&bs->ring);
+		if (row == NULL)
+		{
+			// The merger fell behind. Keep the schedule and drop the row rather than wait
+			row = bs->scratch_row;
+			bs->dropped_rows++;
+		}
+
+		// Sensors being recovered have no value in the row and are not waited for
+		int num_pending = 0;
+		row->gaps = 0;
+		for (int k = 0; k < bs->num_sensors; k++)
+		{
+			pending[k] = bs->reachable[k] == 1 && bs->recovery[k].state == SENSOR_OK;
+			due[k] = 0;
+			if (bs->reachable[k] == 1 && pending[k] == 0)
+				mark_gap(bs, row, k);
+			// Repeating the last result of a sensor that has no new one at this deadline
+			if (pending[k] == 1 && bs->stride[k] > 1 && index % bs->stride[k] != 0 && last_index >= 0)
+			{
+				memcpy(row->regs + k * num_fields, bs->held + k * num_fields, num_fields * sizeof(__u16));
+				if (bs->held_gaps & (1u << k))
+					mark_gap(bs, row, k);
+				pending[k] = 0;
+			}
+			num_pending += pending[k];
+		}
+
+		int row_started = 0;
+		long long elapsed_us = 0;
+		long long row_start_ns = 0;
+		while (num_pending > 0)
+		{
+			if (cfg->alert_enable)
+			{
+				// Sleeping until sensors signal a fresh conversion. After a timeout or a signal the remaining sensors are read anyway
+				int fired = wait_alerts(bs, pending, due, pfds);
+				if (fired == 0)
+					bs->alert_timeouts++;
+				for (int k = 0; k < bs->num_sensors && fired <= 0; k++)
+					due[k] = pending[k];
+			}
+			else
+			{
+				for (int k = 0; k < bs->num_sensors; k++)
+					due[k] = pending[k];
+			}
+			for (int k = 0; k < bs->num_sensors; k++)
+			{
+				if (due[k] == 1 && pending[k] == 1)
+				{
+					pending[k] = 0;
+					num_pending--;
+				}
+			}
+
+			// Time elapsed since the start of the measurement when the row is first read
+			if (row_started == 0)
+			{
+				row_start_ns = lat_now_ns();
+				elapsed_us = row_start_ns / 1000 - cfg->start_us;
+				row->time_offset = elapsed_us;
+				row_started = 1;
+			}
+
+			// Reading every sensor of the bus at once once all of them are due. If the combined transfer
+			// fails, the row is read again sensor by sensor so a failing sensor can be found and recovered.
+			// While a sensor is recovered the others are read one by one
+			if (cfg->batch_enable && bs->num_degraded == 0)
+			{
+				if (num_pending > 0)
+					continue;
+				if (ina260_batch_read(&bs->batch, row->regs) == 0)
+				{
+					// Releasing the latched alerts and starting the next triggered conversions
+					for (int k = 0; k < bs->num_sensors; k++)
+					{
+						if (bs->reachable[k] == 1 && cfg->alert_enable)
+							ina260_dev_conversion_ready(&bs->devs[k]);
+						if (bs->reachable[k] == 1 && bs->profiles[k].triggered)
+							ina260_dev_trigger(&bs->devs[k]);
+					}
+					break;
+				}
+			}
+
+			for (int k = 0; k < bs->num_sensors; k++)
+			{
+				if (due[k] == 1)
+				{
+					if (read_sensor(bs, k, row->regs + k * num_fields) == 0)
+						bs->held_gaps &= ~(1u << k);
+					else
+					{
+						mark_gap(bs, row, k);
+						bs->held_gaps |= 1u << k;
+					}
+					memcpy(bs->held + k * num_fields, row->regs + k * num_fields, num_fields * sizeof(__u16));
+					due[k] = 0;
+				}
+			}
+		}
+
+		// One step of the recovery of every degraded sensor, after the healthy sensors are read
+		for (int k = 0; k < bs->num_sensors && bs->num_degraded > 0; k++)
+		{
+			if (bs->reachable[k] == 1 && bs->recovery[k].state != SENSOR_OK)
+				recovery_step(bs, k);
+		}
+		if (bs->i2c_error)
+			break;
+		if (row_started == 0)
+		{
+			// Every sensor repeated its last result or is being recovered
+			row_start_ns = lat_now_ns();
+			elapsed_us = row_start_ns / 1000 - cfg->start_us;
+			row->time_offset = elapsed_us;
+		}
+
+		// Rows taken on alerts are placed on the deadline grid by their time, so they line up with the other buses
+		if (cfg->alert_enable)
+		{
+			index = elapsed_us * 1000 / cfg->period_ns;
+			if (index <= last_index)
+				index = last_index + 1;
+			if (index >= cfg->num_samples)
+				break;
+		}
+		last_index = index;
+		row->index = index;
+		if (row != bs->scratch_row)
+			spsc_ring_commit(&bs->ring);
+		lat_hist_record(&bs->row_time, lat_now_ns() - row_start_ns);
+	}
+	rt_usage_thread(&bs->usage);
+	rt_usage_since(&bs->usage, &usage_start);
+	ina260_set_latency(NULL);
+	atomic_store_explicit(&bs->done, 1, memory_order_release);
+	return NULL;
+}
+
+int sampler_start(struct bus_sampler *bs)
+{
+	/*
+	Allocates the ring, builds the batched read of the sensors (if enabled) and starts the thread.
+	The thread waits on the start barrier of the configuration.
+	In real-time mode the ring is prefaulted and the thread is created with SCHED_FIFO.
+
+	Returns 0 on success, -1 on failure with errno set (ENOMEM if memory cannot be allocated)
+	*/
+	struct sampler_config *cfg = bs->cfg;
+	size_t row_size = sizeof(struct bus_row) + bs->num_sensors * cfg->num_fields * sizeof(__u16);
+	errno = ENOMEM;
+	if (spsc_ring_init(&bs->ring, row_size, SAMPLER_RING_SLOTS) != 0)
+		return -1;
+	bs->scratch_row = (struct bus_row*) calloc(1, bs->ring.slot_size);
+	if (bs->scratch_row == NULL)
+		return -1;
+	if (cfg->rt_priority > 0)
+		rt_prefault(bs->ring.slots, (bs->ring.mask + 1) * bs->ring.slot_size);
+
+	// One combined transfer per row: a pointer write and a 2 byte read for every register of every sensor of the bus
+	if (cfg->batch_enable)
+	{
+		errno = 0;
+		if (ina260_batch_init(&bs->batch, bs->adapter) != 0)
+		{
+			if (errno == 0)
+				errno = ENODEV;
+			return -1;
+		}
+		for (int k = 0; k < bs->num_sensors; k++)
+		{
+			if (bs->reachable[k] == 1)
+			{
+				long dst = k * cfg->num_fields;
+				if (cfg->current_enable)
+					ina260_batch_add(&bs->batch, &bs->devs[k], REG_CURRENT, dst++);
+				if (cfg->voltage_enable)
+					ina260_batch_add(&bs->batch, &bs->devs[k], REG_BUS_VOLTAGE, dst++);
+				if (cfg->power_enable)
+					ina260_batch_add(&bs->batch, &bs->devs[k], REG_POWER, dst++);
+			}
+		}
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (bs->cpu >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(bs->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	if (cfg->rt_priority > 0)
+	{
+		// Fails with EPERM without CAP_SYS_NICE (or an RLIMIT_RTPRIO high enough)
+		struct sched_param param = { .sched_priority = cfg->rt_priority };
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	int res = pthread_create(&bs->tid, &attr, sampler_thread, bs);
+	pthread_attr_destroy(&attr);
+	if (res != 0)
+	{
+		errno = res;
+		return -1;
+	}
+	return 0;
+}
+
+void sampler_join(struct bus_sampler *bs)
+{
+	pthread_join(bs->tid, NULL);
+}
+
+void sampler_free(struct bus_sampler *bs)
+{
+	// Closes the sensors, alert lines and batch of the sampler and releases its memory
+	for (int k = 0; k < bs->num_sensors; k++)
+	{
+		if (bs->reachable[k] == 1)
+		{
+			ina260_dev_close(&bs->devs[k]);
+			if (bs->cfg->alert_enable)
+				alert_close(&bs->alerts[k]);
+		}
+	}
+	if (bs->batch.fd >= 0)
+		ina260_batch_close(&bs->batch);
+	if (bs->ring.slots != NULL)
+		spsc_ring_free(&bs->ring);
+	free(bs->scratch_row);
+	free(bs->devs);
+	free(bs->profiles);
+	free(bs->stride);
+	free(bs->held);
+	free(bs->reachable);
+	free(bs->alerts);
+	free(bs->columns);
+	free(bs->latency);
+}
+
+int sampler_merge_next(struct bus_sampler *samplers, int num_buses, const struct capture_header *hdr, struct sample_record *out)
+{
+	/*
+	Joins the partial rows of the earliest deadline that every bus has either
+	sampled or passed
+
+	Parameters:
+		out: receives the merged row
+
+	Returns 1 if a row was merged into out, 0 if a bus has not reached the next
+	deadline yet and -1 once every sampler is done and drained
+	*/
+	const struct bus_row *heads[num_buses];
+	long long index = -1;
+	int waiting = 0;
+	for (int b = 0; b < num_buses; b++)
+	{
+		heads[b] = (const struct bus_row*) spsc_ring_peek(&samplers[b].ring);
+		if (heads[b] == NULL)
+		{
+			// A sampler that is done has committed all its rows before setting the flag
+			if (atomic_load_explicit(&samplers[b].done, memory_order_acquire) == 0)
+				waiting = 1;
+			else
+				heads[b] = (const struct bus_row*) spsc_ring_peek(&samplers[b].ring);
+		}
+		if (heads[b] != NULL && (index < 0 || heads[b]->index < index))
+			index = heads[b]->index;
+	}
+	if (waiting)
+		return 0;
+	if (index < 0)
+		return -1;
+
+	__u16 gaps = 0;
+	if (num_buses > 1)
+		out->time_offset = index * samplers[0].cfg->period_ns / 1000;
+	for (int b = 0; b < num_buses; b++)
+	{
+		struct bus_sampler *bs = &samplers[b];
+		const struct bus_row *row = heads[b];
+		int present = row != NULL && row->index == index;
+		if (present && num_buses == 1)
+			out->time_offset = row->time_offset;
+		for (int k = 0; k < bs->num_sensors; k++)
+		{
+			__u16 *dst = out->regs + bs->columns[k] * hdr->num_fields;
+			for (__u32 f = 0; f < hdr->num_fields; f++)
+				dst[f] = present ? row->regs[k * hdr->num_fields + f] : CAPTURE_MISSING;
+			if (!present || (row->gaps & (1u << k)))
+				gaps |= 1 << bs->columns[k];
+		}
+		if (present)
+			spsc_ring_release(&bs->ring);
+	}
+	capture_set_gaps(hdr, out, gaps);
+	return 1;
+}
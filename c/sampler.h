@@ -0,0 +1,147 @@
+/*
+Acquisition threads, one per I2C adapter.
+
+Every bus sampler reads the sensors of its adapter on the shared sampling
+deadlines (or on their conversion ready alerts) from a thread pinned to its own
+CPU, so the buses are sampled in parallel. All samplers are released by a
+common start barrier and use the same time base: deadline i is the start of the
+measurement plus i sampling periods on CLOCK_MONOTONIC.
+
+Each sampler hands one partial row per deadline to its own ring:
+
+	struct bus_row	deadline index, time offset and the registers of the
+			sensors of that bus
+
+and sampler_merge_next() joins the partial rows with the same deadline index
+into the rows of the capture. A bus that missed a deadline has its sensors
+marked in the gap mask of that row. With a single bus a row keeps the
+time its sensors were read at; with several buses it is stamped with its
+deadline, so the rows stay in time order even when a bus is late.
+
+A sensor that fails a read is degraded and recovered without blocking the
+others: the reset, identification, configuration and verification steps of
+ina260_dev_configure_profile() run one per row, in place of its reads, and the
+waits the sensor needs after a reset and a configuration write are deadlines
+instead of sleeps. Its rows are recorded as gaps until it is configured again.
+Failed recoveries start over after a backoff that doubles up to
+SAMPLER_BACKOFF_MAX_US. A bus stops the measurement only when all its sensors
+have failed SAMPLER_I2C_RETRY_NUM recoveries in a row.
+
+Every sampler times its own i2c transactions, wake-ups and rows into latency
+histograms that are read once the thread is joined. In real-time mode
+(rt_priority > 0, see rt.h) the threads run with SCHED_FIFO, their ring and
+stack are written before the start barrier, and their involuntary context
+switches and page faults over the measurement are kept with the statistics.
+*/
+
+#include "INA260.h"
+#include "alert.h"
+#include "capture.h"
+#include "deadline.h"
+#include "rt.h"
+#include "spsc_ring.h"
+#include <pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#define SAMPLER_SPIN_US 30		// Time spun before each sampling deadline, the rest of the period is slept
+#define SAMPLER_RING_SLOTS 65536	// Number of partial rows a sampler can be ahead of the merger
+#define SAMPLER_I2C_RETRY_NUM 100	// Failed recoveries in a row after which a sensor counts as lost
+#define SAMPLER_BACKOFF_US 1000		// Wait before the first new attempt after a failed recovery
+#define SAMPLER_BACKOFF_MAX_US 1000000
+
+// Recovery of a sensor: the steps are taken in this order, one per row
+enum sensor_state
+{
+	SENSOR_OK,
+	SENSOR_RESET,
+	SENSOR_CHECK_ID,
+	SENSOR_CONFIGURE,
+	SENSOR_VERIFY,
+};
+
+struct sensor_recovery
+{
+	enum sensor_state state;
+	long long due_ns;		// Earliest time of the next step
+	long long backoff_ns;		// Wait after the next failed recovery
+	int failures;			// Failed recoveries in a row
+	long recoveries;		// Recoveries that brought the sensor back
+	long gaps;			// Rows without a value of the sensor
+};
+
+// Settings shared by all the samplers
+struct sampler_config
+{
+	__u8 current_enable;
+	__u8 voltage_enable;
+	__u8 power_enable;
+	__u8 current_convert;		// Conversions enabled in the sensors (power needs both)
+	__u8 voltage_convert;
+	__u8 batch_enable;
+	__u8 alert_enable;
+	long num_fields;
+	long num_samples;		// Number of deadlines of the measurement
+	long long period_ns;
+	long long start_us;		// CLOCK_MONOTONIC start of the measurement, set before the start barrier
+	int alert_timeout_ms;
+	int rt_priority;		// SCHED_FIFO priority of the threads, 0 for the default policy
+	pthread_barrier_t start;
+	atomic_int stop;		// Set to end the measurement
+};
+
+struct bus_row
+{
+	__s64 index;			// Deadline index
+	__u32 time_offset;		// Microseconds since the start of the measurement
+	__u32 gaps;			// Bit k is set when sensor k of the bus has no value in the row
+	__u16 regs[];
+};
+
+struct bus_sampler
+{
+	struct sampler_config *cfg;
+	int adapter;
+	int cpu;			// CPU the thread is pinned to, -1 for none
+	int num_sensors;
+	struct ina260_dev *devs;
+	struct ina260_profile *profiles;	// Conversion settings each sensor is (re)configured with
+	int *stride;			// Timer mode: deadlines per read of each sensor, its last values are repeated in between
+	__u16 *held;			// Last values read from each sensor
+	__u32 held_gaps;		// Sensors whose last read failed
+	int num_degraded;		// Sensors being recovered
+	__u8 *reachable;
+	struct alert_line *alerts;
+	int *columns;			// Index of each sensor in the rows of the capture
+	struct ina260_batch batch;
+	struct spsc_ring ring;
+	struct bus_row *scratch_row;	// Destination of the rows that do not fit in the ring
+	pthread_t tid;
+	atomic_int done;
+
+	// Statistics, valid once the thread is joined
+	struct deadline_sched sched;
+	__u8 i2c_error;
+	long alert_timeouts;
+	long dropped_rows;
+	long retries[CAPTURE_MAX_SENSORS];	// Recoveries started for each sensor
+	long rereads[CAPTURE_MAX_SENSORS];	// Reads tried a second time at once, after a glitch
+	struct sensor_recovery recovery[CAPTURE_MAX_SENSORS];
+	struct ina260_latency *latency;		// Register transaction latencies of the sensors
+	struct lat_hist jitter;			// Delay between each deadline and the wake-up of the thread
+	struct lat_hist row_time;		// Time taken by each row, from the wake-up until it is handed to the merger
+	struct rt_usage usage;			// Involuntary context switches and page faults of the thread during the measurement
+};
+
+int sampler_init(struct bus_sampler *bs, struct sampler_config *cfg, int adapter, int cpu);
+int sampler_add_sensor(struct bus_sampler *bs, const struct ina260_dev *dev, const struct ina260_profile *profile,
+		       __u8 reachable, struct alert_line alert, int column);
+int sampler_start(struct bus_sampler *bs);
+void sampler_join(struct bus_sampler *bs);
+void sampler_free(struct bus_sampler *bs);
+int sampler_merge_next(struct bus_sampler *samplers, int num_buses, const struct capture_header *hdr, struct sample_record *out);
+
+#endif
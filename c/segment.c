@@ -0,0 +1,304 @@
+#include "segment.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SEGMENT_ENTRIES_STEP 64
+
+static int segment_name(const struct segment_writer *sw, __u64 seq, char *name, size_t len)
+{
+	// Returns 0, or -1 if the name of the segment is longer than len
+	int n = snprintf(name, len, "%s.%06llu%s", sw->prefix, (unsigned long long)seq, sw->ext);
+	return n >= 0 && (size_t)n < len ? 0 : -1;
+}
+
+static __u64 segment_bytes(const struct segment_writer *sw)
+{
+	// Current size of the segment being written
+	if (sw->binary)
+		return CAPTURE_HEADER_SIZE + sw->seg_rows * sw->hdr->record_size;
+	return sw->csv.bytes + sw->csv.len;
+}
+
+static int write_index(struct segment_writer *sw)
+{
+	// Rewrites the index file through a temporary file, so readers always see a complete one
+	char name[SEGMENT_NAME_LEN + 16], tmp[SEGMENT_NAME_LEN + 32];
+	snprintf(name, sizeof(name), "%s.index", sw->prefix);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "segment,start_us,end_us,rows,bytes\n");
+	for (int i = 0; i < sw->num_entries; i++)
+	{
+		const struct segment_entry *e = &sw->entries[i];
+		// Segments are listed by their file name, relative to the directory of the index
+		const char *base = strrchr(e->name, '/');
+		fprintf(f, "%s,%lld,%lld,%llu,%llu\n", base ? base + 1 : e->name, (long long)e->start_us,
+			(long long)e->end_us, (unsigned long long)e->rows, (unsigned long long)e->bytes);
+	}
+	if (fclose(f) != 0 || rename(tmp, name) != 0)
+		return -1;
+	return 0;
+}
+
+static int start_segment(struct segment_writer *sw, __u64 first_us)
+{
+	// Opens the next segment with its clock anchors moved to its first row
+	char name[SEGMENT_NAME_LEN + 8];
+	if (segment_name(sw, ++sw->seq, sw->seg_name, sizeof(sw->seg_name)) != 0)
+		return -1;
+	snprintf(name, sizeof(name), "%s.tmp", sw->seg_name);
+
+	sw->seg_hdr = *sw->hdr;
+	__s64 nsec = sw->hdr->start_realtime_nsec + (first_us % 1000000) * 1000;
+	sw->seg_hdr.start_realtime_sec = sw->hdr->start_realtime_sec + first_us / 1000000 + nsec / 1000000000;
+	sw->seg_hdr.start_realtime_nsec = nsec % 1000000000;
+	sw->seg_hdr.start_monotonic_us = sw->hdr->start_monotonic_us + first_us;
+
+	int res = sw->binary ? capture_create(&sw->capture, name, &sw->seg_hdr, 0) : csv_open(&sw->csv, name, &sw->seg_hdr);
+	if (res != 0)
+		return -1;
+	sw->open = 1;
+	sw->seg_first_us = first_us;
+	sw->seg_last_us = first_us;
+	sw->seg_rows = 0;
+	return 0;
+}
+
+static int finish_segment(struct segment_writer *sw)
+{
+	// Closes the current segment, gives it its final name, applies the retention limits and updates the index
+	int status = 0;
+	__u64 bytes = segment_bytes(sw);
+	if (sw->binary)
+		status = capture_close(&sw->capture, sw->seg_rows);
+	else
+		status = csv_close(&sw->csv);
+	sw->open = 0;
+
+	// The segment gets its final name and the index is rewritten even without memory for its entry
+	char tmp[SEGMENT_NAME_LEN + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", sw->seg_name);
+	if (rename(tmp, sw->seg_name) != 0)
+		status = -1;
+
+	if (sw->num_entries == sw->max_entries)
+	{
+		int max_entries = sw->max_entries + SEGMENT_ENTRIES_STEP;
+		struct segment_entry *entries = realloc(sw->entries, max_entries * sizeof(*entries));
+		if (entries != NULL)
+		{
+			sw->entries = entries;
+			sw->max_entries = max_entries;
+		}
+	}
+	if (sw->num_entries < sw->max_entries)
+	{
+		struct segment_entry *e = &sw->entries[sw->num_entries];
+		memcpy(e->name, sw->seg_name, sizeof(e->name));
+		__s64 start_us = sw->hdr->start_realtime_sec * 1000000LL + sw->hdr->start_realtime_nsec / 1000;
+		e->start_us = start_us + sw->seg_first_us;
+		e->end_us = start_us + sw->seg_last_us;
+		e->rows = sw->seg_rows;
+		e->bytes = bytes;
+		sw->num_entries++;
+		sw->total_bytes += bytes;
+	}
+	else
+		status = -1;	// Not listed in the index and not counted by the retention limits
+
+	// Deleting the oldest segments, always keeping the one just written
+	const struct segment_limits *l = &sw->limits;
+	int drop = 0;
+	__u64 total_bytes = sw->total_bytes;
+	while (drop < sw->num_entries - 1 &&
+	       ((l->max_segments > 0 && sw->num_entries - drop > l->max_segments) ||
+		(l->max_total_bytes > 0 && total_bytes > l->max_total_bytes)))
+	{
+		unlink(sw->entries[drop].name);
+		total_bytes -= sw->entries[drop].bytes;
+		drop++;
+	}
+	if (drop > 0)
+	{
+		memmove(sw->entries, sw->entries + drop, (sw->num_entries - drop) * sizeof(*sw->entries));
+		sw->num_entries -= drop;
+		sw->total_bytes = total_bytes;
+		sw->deleted += drop;
+	}
+
+	if (write_index(sw) != 0)
+		status = -1;
+	return status;
+}
+
+int segment_open(struct segment_writer *sw, const char *filename, const struct capture_header *hdr, int binary,
+		 struct segment_limits limits)
+{
+	/*
+	Prepares the segmented output of a measurement. The first segment is created with the first row
+
+	Parameters:
+		filename: output file name, the segments and the index are named after it
+		hdr: layout and clock anchors of the measurement
+		binary: write captures instead of CSV files
+
+	Returns 0 on success, -1 if memory cannot be allocated
+	*/
+	memset(sw, 0, sizeof(*sw));
+	sw->hdr = hdr;
+	sw->binary = binary;
+	sw->limits = limits;
+
+	// Splitting the extension off the last path component
+	snprintf(sw->prefix, sizeof(sw->prefix), "%s", filename);
+	char *dot = strrchr(sw->prefix, '.');
+	char *slash = strrchr(sw->prefix, '/');
+	if (dot != NULL && (slash == NULL || dot > slash) && strlen(dot) < sizeof(sw->ext))
+	{
+		strcpy(sw->ext, dot);
+		*dot = '\0';
+	}
+
+	sw->scratch = (struct sample_record*) malloc(hdr->record_size);
+	if (sw->scratch == NULL)
+		return -1;
+	return 0;
+}
+
+int segment_write(struct segment_writer *sw, const struct sample_record *rec)
+{
+	/*
+	Appends a row, starting a new segment first when the current one is full
+
+	Returns 0 on success, -1 if a segment could not be created or written
+	*/
+	// Time offsets are 32 bit microseconds and wrap around after about 71 minutes
+	if (sw->rows > 0 && rec->time_offset < sw->prev_offset)
+		sw->time_base += 1ULL << 32;
+	sw->prev_offset = rec->time_offset;
+	__u64 time_us = sw->time_base + rec->time_offset;
+	sw->rows++;
+
+	if (sw->open)
+	{
+		const struct segment_limits *l = &sw->limits;
+		if ((l->max_bytes > 0 && segment_bytes(sw) >= l->max_bytes) ||
+		    (l->max_us > 0 && time_us - sw->seg_first_us >= l->max_us))
+		{
+			if (finish_segment(sw) != 0)
+				sw->error = 1;
+		}
+	}
+	if (!sw->open && start_segment(sw, time_us) != 0)
+	{
+		sw->error = 1;
+		return -1;
+	}
+
+	memcpy(sw->scratch, rec, sw->hdr->record_size);
+	sw->scratch->time_offset = time_us - sw->seg_first_us;
+	if (sw->binary)
+	{
+		if (capture_append(&sw->capture, sw->scratch) != 0)
+		{
+			sw->error = 1;
+			return -1;
+		}
+	}
+	else
+		csv_write_row(&sw->csv, sw->scratch);
+	sw->seg_last_us = time_us;
+	sw->seg_rows++;
+	return 0;
+}
+
+int segment_close(struct segment_writer *sw)
+{
+	/*
+	Completes the last segment and releases the writer
+
+	Returns 0 on success, -1 if any segment or the index could not be written
+	*/
+	if (sw->open && finish_segment(sw) != 0)
+		sw->error = 1;
+	free(sw->scratch);
+	free(sw->entries);
+	sw->scratch = NULL;
+	sw->entries = NULL;
+	return sw->error ? -1 : 0;
+}
+
+static int parse_size(const char *s, __u64 *value)
+{
+	// Reads a number with an optional K, M or G suffix (powers of 1024)
+	char *end;
+	double v = strtod(s, &end);
+	switch (*end)
+	{
+		case 'K': case 'k': v *= 1024; end++; break;
+		case 'M': case 'm': v *= 1024 * 1024; end++; break;
+		case 'G': case 'g': v *= 1024.0 * 1024 * 1024; end++; break;
+	}
+	if (end == s || *end != '\0' || v <= 0)
+		return -1;
+	*value = v;
+	return 0;
+}
+
+int segment_parse_limits(const char *spec, struct segment_limits *limits)
+{
+	/*
+	Parses comma separated key=value limits:
+		size=<bytes>[K|M|G]	size of a segment
+		time=<seconds>		duration of a segment
+		keep=<n>		number of segments kept
+		max=<bytes>[K|M|G]	total size of the kept segments
+
+	Returns 0 on success, -1 on an unknown key or a malformed value
+	*/
+	char buf[256];
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	memset(limits, 0, sizeof(*limits));
+
+	for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		char *eq = strchr(tok, '=');
+		char *end;
+		if (eq == NULL)
+			return -1;
+		*eq = '\0';
+		char *v = eq + 1;
+
+		if (strcmp(tok, "size") == 0)
+		{
+			if (parse_size(v, &limits->max_bytes) != 0)
+				return -1;
+		}
+		else if (strcmp(tok, "max") == 0)
+		{
+			if (parse_size(v, &limits->max_total_bytes) != 0)
+				return -1;
+		}
+		else if (strcmp(tok, "time") == 0)
+		{
+			double seconds = strtod(v, &end);
+			if (*end != '\0' || seconds <= 0)
+				return -1;
+			limits->max_us = seconds * 1000000;
+		}
+		else if (strcmp(tok, "keep") == 0)
+		{
+			limits->max_segments = strtol(v, &end, 10);
+			if (*end != '\0' || limits->max_segments < 1)
+				return -1;
+		}
+		else
+			return -1;
+	}
+	return 0;
+}
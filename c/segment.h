@@ -0,0 +1,89 @@
+/*
+Rotating output of continuous measurements.
+
+Rows are written to a sequence of segment files named after the output file
+with a sequence number before the extension (run.csv gives run.000001.csv,
+run.000002.csv, ...). A segment is written as <name>.tmp and renamed once it
+is complete, so a file with its final name is never partial. A new segment is
+started when the current one reaches the size or the duration limit.
+
+Every segment is a complete CSV file or capture on its own: its header holds
+the clock anchors of its first row and its time offsets start from there.
+
+After each segment the oldest ones are deleted while there are more than
+max_segments or they take more than max_total_bytes, and the index file
+(run.index) is rewritten, also through a rename. It lists the kept segments
+with the wall clock range of their rows:
+
+	segment,start_us,end_us,rows,bytes
+
+where start_us and end_us are microseconds since the epoch, so a tool can
+open only the segments of the window it needs.
+*/
+
+#include "capture.h"
+#include "csv_out.h"
+
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#define SEGMENT_NAME_LEN 512
+
+struct segment_limits
+{
+	__u64 max_bytes;		// Size of a segment, 0 for no limit
+	__u64 max_us;			// Duration of a segment, 0 for no limit
+	int max_segments;		// Segments kept on disk, 0 for no limit
+	__u64 max_total_bytes;		// Total size of the kept segments, 0 for no limit
+};
+
+struct segment_entry
+{
+	char name[SEGMENT_NAME_LEN];
+	__s64 start_us;
+	__s64 end_us;
+	__u64 rows;
+	__u64 bytes;
+};
+
+struct segment_writer
+{
+	const struct capture_header *hdr;	// Layout and clock anchors of the measurement
+	int binary;			// Captures instead of CSV files
+	struct segment_limits limits;
+	char prefix[SEGMENT_NAME_LEN];	// Output file name without its extension
+	char ext[32];
+
+	// Segment being written
+	int open;
+	__u64 seq;
+	char seg_name[SEGMENT_NAME_LEN];	// Final name, the segment is written under seg_name.tmp
+	struct capture_header seg_hdr;
+	struct csv_out csv;
+	struct capture_file capture;
+	__u64 seg_first_us;		// Time of the first and last row since the start of the measurement
+	__u64 seg_last_us;
+	__u64 seg_rows;
+	struct sample_record *scratch;	// Row with its offset moved to the start of the segment
+
+	// Unwrapped time of the rows since the start of the measurement
+	__u64 time_base;
+	__u32 prev_offset;
+	__u64 rows;
+
+	// Completed segments still on disk, oldest first
+	struct segment_entry *entries;
+	int num_entries;
+	int max_entries;
+	__u64 total_bytes;
+	long deleted;
+	int error;
+};
+
+int segment_open(struct segment_writer *sw, const char *filename, const struct capture_header *hdr, int binary,
+		 struct segment_limits limits);
+int segment_write(struct segment_writer *sw, const struct sample_record *rec);
+int segment_close(struct segment_writer *sw);
+int segment_parse_limits(const char *spec, struct segment_limits *limits);
+
+#endif
@@ -0,0 +1,504 @@
+#include "sim_ina260.h"
+#include "INA260.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define SIM_FIRST_ADDR 0x40
+#define SIM_NUM_DEVICES 16
+#define SIM_MAX_BUSES 8
+#define SIM_MAX_HANDLES 64
+#define SIM_ADAPTER 0x100	// Handle entry of an adapter handle (not bound to a device)
+#define SIM_TARGET(adapter, addr) (((adapter) << 9) | (addr))	// Handle entry: adapter and device address (or SIM_ADAPTER)
+
+#define CONFIG_DEFAULT 0x6127
+#define CONFIG_RO_BITS 0x6000
+
+// Bytes on the wire (address + data bytes) of each transaction type
+#define WIRE_READ_WORD 5
+#define WIRE_WRITE_WORD 4
+#define WIRE_READ_RAW(len) (1 + (len))
+
+struct sim_device
+{
+	__u16 config;
+	__u16 mask_enable;
+	__u16 alert_limit;
+	__u8 pointer;
+	long long t0_ns;	// Start of the first conversion after the last configuration write
+	long long last_cnvr;	// Conversion count seen by the last Mask/Enable read
+	int alert_fd;		// timerfd standing in for the ALERT pin, -1 until requested
+};
+
+struct sim_params sim_params = {
+	.latency_ns = 0,
+	.bus_hz = 0,
+	.error_ppm = 0,
+	.seed = 1,
+};
+
+static struct sim_device devices[SIM_MAX_BUSES][SIM_NUM_DEVICES];
+static pthread_mutex_t bus_locks[SIM_MAX_BUSES];	// One transaction at a time on each bus
+static int handles[SIM_MAX_HANDLES];	// SIM_TARGET() of each open handle, 0 if unused
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+static long long sim_epoch_ns;
+static __thread __u32 rng_state;
+
+static const int conversion_us[8] = {140, 204, 332, 588, 1100, 2116, 4156, 8244};
+static const int avg_count[8] = {1, 4, 16, 64, 128, 256, 512, 1024};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long conversion_period_ns(__u16 config);
+
+static void arm_alert(struct sim_device *dev)
+{
+	// The stand-in ALERT line fires at the end of every conversion while the CNVR alert is enabled
+	struct itimerspec its;
+	if (dev->alert_fd < 0)
+		return;
+	memset(&its, 0, sizeof(its));
+	long long period = conversion_period_ns(dev->config);
+	if ((dev->mask_enable & (1 << CNVR)) && period > 0)
+	{
+		long long first = dev->t0_ns + period;
+		its.it_value.tv_sec = first / 1000000000LL;
+		its.it_value.tv_nsec = first % 1000000000LL;
+		if (dev->config & (1 << MODE2))
+		{
+			its.it_interval.tv_sec = period / 1000000000LL;
+			its.it_interval.tv_nsec = period % 1000000000LL;
+		}
+	}
+	timerfd_settime(dev->alert_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void device_reset(struct sim_device *dev)
+{
+	dev->config = CONFIG_DEFAULT;
+	dev->mask_enable = 0;
+	dev->alert_limit = 0;
+	dev->pointer = REG_CONFIG;
+	dev->t0_ns = now_ns();
+	dev->last_cnvr = 0;
+	arm_alert(dev);
+}
+
+static void sim_init(void)
+{
+	sim_epoch_ns = now_ns();
+	for (int b = 0; b < SIM_MAX_BUSES; b++)
+	{
+		pthread_mutex_init(&bus_locks[b], NULL);
+		for (int d = 0; d < SIM_NUM_DEVICES; d++)
+		{
+			devices[b][d].alert_fd = -1;
+			device_reset(&devices[b][d]);
+		}
+	}
+}
+
+static __u32 rng_next(void)
+{
+	// xorshift32, one stream per thread so concurrent samplers do not share state
+	if (rng_state == 0)
+		rng_state = sim_params.seed ? sim_params.seed : 1;
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static __u32 hash32(__u32 x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static int transaction(int wire_bytes)
+{
+	/*
+	Spends the time a transaction would take and decides whether it fails
+
+	Returns 0 or -EIO
+	*/
+	long long cost = sim_params.latency_ns;
+	if (sim_params.bus_hz)
+		cost += (long long)wire_bytes * 9 * 1000000000LL / sim_params.bus_hz;
+	if (cost > 0)
+	{
+		long long deadline = now_ns() + cost;
+		while (now_ns() < deadline)
+			;
+	}
+	if (sim_params.error_ppm && (rng_next() % 1000000) < sim_params.error_ppm)
+		return -EIO;
+	return 0;
+}
+
+static struct sim_device *device_at(int adapter, int addr)
+{
+	int d = addr - SIM_FIRST_ADDR;
+	if (adapter < 0 || adapter >= SIM_MAX_BUSES || d < 0 || d >= SIM_NUM_DEVICES)
+		return NULL;
+	return &devices[adapter][d];
+}
+
+static int handle_adapter(int fd)
+{
+	// Returns the adapter of a handle, -1 for an invalid handle
+	if (fd < 0 || fd >= SIM_MAX_HANDLES || handles[fd] == 0)
+		return -1;
+	return handles[fd] >> 9;
+}
+
+static struct sim_device *lookup(int fd)
+{
+	int adapter = handle_adapter(fd);
+	if (adapter < 0)
+		return NULL;
+	return device_at(adapter, handles[fd] & 0x1FF);
+}
+
+static long long conversion_period_ns(__u16 config)
+{
+	int avg = avg_count[(config >> AVG0) & 0x7];
+	long long us = 0;
+	if (config & (1 << MODE0))
+		us += conversion_us[(config >> ISHCT0) & 0x7];
+	if (config & (1 << MODE1))
+		us += conversion_us[(config >> VBUSCT0) & 0x7];
+	return us * avg * 1000;
+}
+
+static long long conversions_done(struct sim_device *dev)
+{
+	long long period = conversion_period_ns(dev->config);
+	if (period == 0)
+		return 0;
+	long long n = (now_ns() - dev->t0_ns) / period;
+	if (!(dev->config & (1 << MODE2)) && n > 1)
+		n = 1;	// Triggered mode: a single conversion per configuration write
+	return n;
+}
+
+static void measurement(struct sim_device *dev, long long n, __s16 *current, __u16 *voltage)
+{
+	/*
+	Produces the register values of conversion n: a slowly varying load with
+	a few LSBs of noise, each device drawing a different share.
+	*/
+	int d = dev - &devices[0][0];
+	long long t_ns = dev->t0_ns + n * conversion_period_ns(dev->config) - sim_epoch_ns;
+	double load = sin(2 * M_PI * (double)t_ns / 5e8);
+	__u32 noise = hash32((__u32)n * 2654435761u ^ (__u32)d << 24);
+
+	double current_ma = 4000 + 500 * (d & 3) + 2000 * load;
+	double voltage_mv = 12000 - 0.02 * current_ma;
+	*current = (__s16)lround(current_ma / 1.25) + (__s16)(noise % 7) - 3;
+	*voltage = (__u16)lround(voltage_mv / 1.25) + (__u16)((noise >> 8) % 5) - 2;
+}
+
+static __u16 register_value(struct sim_device *dev, __u8 reg)
+{
+	long long n;
+	__s16 current = 0;
+	__u16 voltage = 0;
+
+	switch (reg)
+	{
+		case REG_CONFIG:
+			return dev->config;
+		case REG_CURRENT:
+		case REG_BUS_VOLTAGE:
+		case REG_POWER:
+			n = conversions_done(dev);
+			if (n == 0)
+				return 0;
+			measurement(dev, n, &current, &voltage);
+			if (reg == REG_CURRENT)
+				return (__u16)current;
+			if (reg == REG_BUS_VOLTAGE)
+				return voltage;
+			// Power LSB is 10 mW; current and voltage LSBs are 1.25 mA and 1.25 mV
+			return (__u16)(llabs((long long)current) * voltage * 25 / 160000);
+		case REG_MASK_ENABLE:
+			// Reading Mask/Enable also releases the latched ALERT line
+			if (dev->alert_fd >= 0)
+			{
+				__u64 expirations;
+				if (read(dev->alert_fd, &expirations, sizeof(expirations)) < 0)
+					expirations = 0;
+			}
+			n = conversions_done(dev);
+			if (n > dev->last_cnvr)
+			{
+				// Reading Mask/Enable clears the conversion ready flag
+				dev->last_cnvr = n;
+				return dev->mask_enable | (1 << CVRF);
+			}
+			return dev->mask_enable;
+		case REG_ALERT:
+			return dev->alert_limit;
+		case REG_MANUFACTURER_ID:
+			return MAN_ID;
+		case REG_DIE_ID:
+			return DIE_ID;
+		default:
+			return 0;
+	}
+}
+
+static void register_write(struct sim_device *dev, __u8 reg, __u16 value)
+{
+	switch (reg)
+	{
+		case REG_CONFIG:
+			if (value & (1 << RST))
+			{
+				device_reset(dev);
+				return;
+			}
+			dev->config = (value & 0x0FFF) | CONFIG_RO_BITS;
+			dev->t0_ns = now_ns();
+			dev->last_cnvr = 0;
+			arm_alert(dev);
+			break;
+		case REG_MASK_ENABLE:
+			dev->mask_enable = value & 0xFC03;
+			arm_alert(dev);
+			break;
+		case REG_ALERT:
+			dev->alert_limit = value;
+			break;
+		default:
+			break;
+	}
+}
+
+static __u16 swap16(__u16 v)
+{
+	return ((v << 8) & 0xFF00) | ((v >> 8) & 0xFF);
+}
+
+static int alloc_handle(int target)
+{
+	pthread_once(&sim_once, sim_init);
+	pthread_mutex_lock(&handles_lock);
+	for (int h = 0; h < SIM_MAX_HANDLES; h++)
+	{
+		if (handles[h] == 0)
+		{
+			handles[h] = target;
+			pthread_mutex_unlock(&handles_lock);
+			return h;
+		}
+	}
+	pthread_mutex_unlock(&handles_lock);
+	return -1;
+}
+
+static int sim_open(int adapter, __u8 dev_addr)
+{
+	if (adapter < 0 || adapter >= SIM_MAX_BUSES)
+		return -1;
+	return alloc_handle(SIM_TARGET(adapter, dev_addr));
+}
+
+static int sim_open_adapter(int adapter)
+{
+	if (adapter < 0 || adapter >= SIM_MAX_BUSES)
+		return -1;
+	return alloc_handle(SIM_TARGET(adapter, SIM_ADAPTER));
+}
+
+static void sim_close(int fd)
+{
+	pthread_mutex_lock(&handles_lock);
+	if (fd >= 0 && fd < SIM_MAX_HANDLES)
+		handles[fd] = 0;
+	pthread_mutex_unlock(&handles_lock);
+}
+
+static __s32 sim_read_word(int fd, __u8 command)
+{
+	struct sim_device *dev = lookup(fd);
+	if (dev == NULL)
+		return -ENXIO;
+	pthread_mutex_lock(&bus_locks[handle_adapter(fd)]);
+	__s32 res = transaction(WIRE_READ_WORD);
+	if (res == 0)
+	{
+		dev->pointer = command;
+		res = swap16(register_value(dev, command));
+	}
+	pthread_mutex_unlock(&bus_locks[handle_adapter(fd)]);
+	return res;
+}
+
+static __s32 sim_write_word(int fd, __u8 command, __u16 value)
+{
+	struct sim_device *dev = lookup(fd);
+	if (dev == NULL)
+		return -ENXIO;
+	pthread_mutex_lock(&bus_locks[handle_adapter(fd)]);
+	int err = transaction(WIRE_WRITE_WORD);
+	if (err == 0)
+	{
+		dev->pointer = command;
+		register_write(dev, command, swap16(value));
+	}
+	pthread_mutex_unlock(&bus_locks[handle_adapter(fd)]);
+	return err;
+}
+
+static int sim_read_raw(int fd, __u8 *buf, int len)
+{
+	// Plain read: the device answers from its register pointer, MSB first
+	struct sim_device *dev = lookup(fd);
+	if (dev == NULL)
+		return -ENXIO;
+	pthread_mutex_lock(&bus_locks[handle_adapter(fd)]);
+	int err = transaction(WIRE_READ_RAW(len));
+	for (int k = 0; k < len && err == 0; k += 2)
+	{
+		__u16 value = register_value(dev, dev->pointer);
+		buf[k] = value >> 8;
+		if (k + 1 < len)
+			buf[k + 1] = value & 0xFF;
+	}
+	pthread_mutex_unlock(&bus_locks[handle_adapter(fd)]);
+	return err ? err : len;
+}
+
+static int sim_transfer(int fd, struct i2c_msg *msgs, int nmsgs)
+{
+	/*
+	Combined transfer: one transaction cost for all messages. A write message
+	sets the register pointer (and writes the register if it carries data),
+	a read message returns the registers at the pointer, MSB first.
+	*/
+	int adapter = handle_adapter(fd);
+	if (adapter < 0)
+		return -EBADF;
+
+	int wire_bytes = 0;
+	for (int m = 0; m < nmsgs; m++)
+		wire_bytes += 1 + msgs[m].len;
+	pthread_mutex_lock(&bus_locks[adapter]);
+	int res = transaction(wire_bytes);
+	for (int m = 0; m < nmsgs && res == 0; m++)
+	{
+		struct sim_device *dev = device_at(adapter, msgs[m].addr);
+		if (dev == NULL)
+		{
+			res = -ENXIO;
+			break;
+		}
+		if (msgs[m].flags & I2C_M_RD)
+		{
+			for (int k = 0; k < msgs[m].len; k += 2)
+			{
+				__u16 value = register_value(dev, dev->pointer);
+				msgs[m].buf[k] = value >> 8;
+				if (k + 1 < msgs[m].len)
+					msgs[m].buf[k + 1] = value & 0xFF;
+			}
+		}
+		else if (msgs[m].len >= 1)
+		{
+			dev->pointer = msgs[m].buf[0];
+			if (msgs[m].len >= 3)
+				register_write(dev, dev->pointer, (msgs[m].buf[1] << 8) | msgs[m].buf[2]);
+		}
+	}
+	pthread_mutex_unlock(&bus_locks[adapter]);
+	return res ? res : nmsgs;
+}
+
+const struct bus_ops sim_bus = {
+	.name = "sim",
+	.open = sim_open,
+	.close = sim_close,
+	.read_word = sim_read_word,
+	.write_word = sim_write_word,
+	.read_raw = sim_read_raw,
+	.open_adapter = sim_open_adapter,
+	.transfer = sim_transfer,
+};
+
+int sim_ina260_parse(const char *opts)
+{
+	/*
+	Parses comma separated key=value simulator options
+
+	Returns 0 on success, -1 on an unknown key or a malformed value
+	*/
+	char buf[256];
+	strncpy(buf, opts, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ","))
+	{
+		char *eq = strchr(tok, '=');
+		char *end;
+		if (eq == NULL)
+			return -1;
+		*eq = '\0';
+		unsigned long v = strtoul(eq + 1, &end, 0);
+		if (*end != '\0')
+			return -1;
+
+		if (strcmp(tok, "latency_us") == 0)
+			sim_params.latency_ns = v * 1000;
+		else if (strcmp(tok, "latency_ns") == 0)
+			sim_params.latency_ns = v;
+		else if (strcmp(tok, "bus_hz") == 0)
+			sim_params.bus_hz = v;
+		else if (strcmp(tok, "error_ppm") == 0)
+			sim_params.error_ppm = v;
+		else if (strcmp(tok, "seed") == 0)
+			sim_params.seed = v;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+int sim_ina260_alert_fd(int adapter, __u8 dev_addr)
+{
+	/*
+	Returns an fd standing in for the ALERT pin of a simulated device: a
+	timerfd expiring at the end of every conversion while the Conversion
+	Ready alert is enabled. The caller owns the returned descriptor.
+
+	Returns -1 on failure
+	*/
+	pthread_once(&sim_once, sim_init);
+	struct sim_device *dev = device_at(adapter, dev_addr);
+	if (dev == NULL)
+		return -1;
+	if (dev->alert_fd < 0)
+	{
+		dev->alert_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (dev->alert_fd < 0)
+			return -1;
+		arm_alert(dev);
+	}
+	return dup(dev->alert_fd);
+}
@@ -0,0 +1,44 @@
+/*
+In-process simulated INA260 bank.
+
+Every address in the 0x40-0x4F range of adapters 0 to 7 answers like an
+INA260: the configuration, current, bus voltage, power, mask/enable, alert
+limit and ID registers are modelled, a software reset restores the datasheet defaults and
+new values only appear once per conversion period (conversion times and
+averaging count taken from the configuration register). The ALERT pin of a
+device is stood in for by a timerfd (sim_ina260_alert_fd) that expires at the
+end of every conversion while the Conversion Ready alert is enabled.
+
+Transactions can be slowed down and made to fail, so the acquisition loop can
+be benchmarked and regression-tested without a Raspberry Pi:
+
+	latency_us	Fixed cost of each transaction (syscall + driver)
+	bus_hz		SCL frequency used to add the time on the wire (0 = none)
+	error_ppm	Probability of a transaction failing, in parts per million
+	seed		Seed of the error injection generator
+
+Each adapter carries one transaction at a time, transactions on different
+adapters run in parallel like on separate hardware controllers.
+*/
+
+#include "bus.h"
+#include <linux/types.h>
+
+#ifndef _SIM_INA260_H_
+#define _SIM_INA260_H_
+
+struct sim_params
+{
+	__u32 latency_ns;
+	__u32 bus_hz;
+	__u32 error_ppm;
+	__u32 seed;
+};
+
+extern const struct bus_ops sim_bus;
+extern struct sim_params sim_params;
+
+int sim_ina260_parse(const char *opts);
+int sim_ina260_alert_fd(int adapter, __u8 dev_addr);
+
+#endif
@@ -0,0 +1,78 @@
+#include "spsc_ring.h"
+#include <stdlib.h>
+#include <string.h>
+
+int spsc_ring_init(struct spsc_ring *ring, size_t slot_size, size_t num_slots)
+{
+	/*
+	Allocates the ring
+
+	Parameters:
+		slot_size: size of each slot in bytes (rounded up to 8 bytes)
+		num_slots: capacity of the ring (rounded up to a power of two)
+
+	Returns 0 on success, -1 if the memory cannot be allocated
+	*/
+	size_t n = 1;
+	while (n < num_slots)
+		n <<= 1;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->slot_size = (slot_size + 7) & ~(size_t)7;
+	ring->mask = n - 1;
+	ring->slots = aligned_alloc(SPSC_CACHELINE, ((n * ring->slot_size) + SPSC_CACHELINE - 1) & ~(size_t)(SPSC_CACHELINE - 1));
+	if (ring->slots == NULL)
+		return -1;
+
+	// Touch every page now so the producer never takes a page fault on a fresh slot
+	memset(ring->slots, 0, n * ring->slot_size);
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 0;
+}
+
+void spsc_ring_free(struct spsc_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+void *spsc_ring_reserve(struct spsc_ring *ring)
+{
+	// Producer side. Returns the next free slot or NULL if the ring is full
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - ring->cached_tail > ring->mask)
+	{
+		ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (head - ring->cached_tail > ring->mask)
+			return NULL;
+	}
+	return ring->slots + (head & ring->mask) * ring->slot_size;
+}
+
+void spsc_ring_commit(struct spsc_ring *ring)
+{
+	// Producer side. Publishes the slot returned by spsc_ring_reserve()
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+const void *spsc_ring_peek(struct spsc_ring *ring)
+{
+	// Consumer side. Returns the oldest committed slot or NULL if the ring is empty
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail == ring->cached_head)
+	{
+		ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (tail == ring->cached_head)
+			return NULL;
+	}
+	return ring->slots + (tail & ring->mask) * ring->slot_size;
+}
+
+void spsc_ring_release(struct spsc_ring *ring)
+{
+	// Consumer side. Gives the slot returned by spsc_ring_peek() back to the producer
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
@@ -0,0 +1,37 @@
+/*
+Bounded single-producer/single-consumer lock-free ring of fixed-size slots.
+
+The producer reserves a slot, fills it and commits it; the consumer peeks the
+oldest committed slot and releases it once done. Neither side ever blocks or
+takes a lock: a full ring makes spsc_ring_reserve() return NULL and an empty
+ring makes spsc_ring_peek() return NULL.
+*/
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#define SPSC_CACHELINE 64
+
+struct spsc_ring
+{
+	unsigned char *slots;
+	size_t slot_size;
+	size_t mask;		// Number of slots - 1 (number of slots is a power of two)
+
+	_Alignas(SPSC_CACHELINE) atomic_size_t head;	// Next slot to be written (producer)
+	size_t cached_tail;
+	_Alignas(SPSC_CACHELINE) atomic_size_t tail;	// Next slot to be read (consumer)
+	size_t cached_head;
+};
+
+int spsc_ring_init(struct spsc_ring *ring, size_t slot_size, size_t num_slots);
+void spsc_ring_free(struct spsc_ring *ring);
+void *spsc_ring_reserve(struct spsc_ring *ring);
+void spsc_ring_commit(struct spsc_ring *ring);
+const void *spsc_ring_peek(struct spsc_ring *ring);
+void spsc_ring_release(struct spsc_ring *ring);
+
+#endif
@@ -0,0 +1,265 @@
+#include "store.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Worst case of an encoded block: the row count, then a width byte and 32 bit values of time and 16 bit values of every register
+#define BLOCK_MAX_BYTES(cells) (1 + (1 + STORE_BLOCK_ROWS * 4) + (size_t)(cells) * (1 + STORE_BLOCK_ROWS * 2))
+
+static inline __u32 zigzag(__s32 v)
+{
+	return ((__u32)v << 1) ^ (__u32)(v >> 31);
+}
+
+static inline __s32 unzigzag(__u32 v)
+{
+	return (__s32)(v >> 1) ^ -(__s32)(v & 1);
+}
+
+static int bit_width(__u32 v)
+{
+	return v == 0 ? 0 : 32 - __builtin_clz(v);
+}
+
+static unsigned char *pack(unsigned char *p, const __u32 *values, int n)
+{
+	// Writes the width of the largest value and the n values with that width, least significant bits first
+	__u32 max = 0;
+	for (int i = 0; i < n; i++)
+		max |= values[i];
+	int width = bit_width(max);
+	*p++ = width;
+	__u64 acc = 0;
+	int bits = 0;
+	for (int i = 0; i < n && width > 0; i++)
+	{
+		acc |= (__u64)values[i] << bits;
+		bits += width;
+		while (bits >= 8)
+		{
+			*p++ = acc;
+			acc >>= 8;
+			bits -= 8;
+		}
+	}
+	if (bits > 0)
+		*p++ = acc;
+	return p;
+}
+
+static const unsigned char *unpack(const unsigned char *p, __u32 *values, int n)
+{
+	int width = *p++;
+	__u64 acc = 0;
+	int bits = 0;
+	__u32 mask = width == 32 ? 0xFFFFFFFFu : (1u << width) - 1;
+	for (int i = 0; i < n; i++)
+	{
+		while (bits < width)
+		{
+			acc |= (__u64)*p++ << bits;
+			bits += 8;
+		}
+		values[i] = acc & mask;
+		acc >>= width;
+		bits -= width;
+	}
+	return p;
+}
+
+int store_init(struct sample_store *st, const struct capture_header *hdr)
+{
+	/*
+	Prepares an empty store for the rows of hdr
+
+	Returns 0 on success, -1 if memory cannot be allocated
+	*/
+	memset(st, 0, sizeof(*st));
+	st->hdr = hdr;
+	// The gap mask of the row is encoded as one more register column
+	st->num_cells = hdr->num_sensors * hdr->num_fields + (hdr->version >= 2);
+	st->enc.prev_regs = (__u16*) calloc(st->num_cells + 1, sizeof(__u16));
+	st->block_time = (__u32*) malloc(STORE_BLOCK_ROWS * sizeof(__u32));
+	st->block_regs = (__u16*) malloc((st->num_cells + 1) * STORE_BLOCK_ROWS * sizeof(__u16));
+	if (st->enc.prev_regs == NULL || st->block_time == NULL || st->block_regs == NULL)
+	{
+		store_free(st);
+		return -1;
+	}
+	return 0;
+}
+
+int store_flush(struct sample_store *st)
+{
+	/*
+	Encodes the rows of the current block. Called by store_append() when a block
+	is full and once the measurement is over
+
+	Returns 0 on success, -1 if memory cannot be allocated (the rows of the block are kept)
+	*/
+	int n = st->block_rows;
+	if (n == 0)
+		return 0;
+	size_t need = BLOCK_MAX_BYTES(st->num_cells);
+	if (st->last == NULL || st->last->len + need > STORE_CHUNK_SIZE)
+	{
+		struct store_chunk *chunk = (struct store_chunk*) malloc(sizeof(struct store_chunk) + STORE_CHUNK_SIZE);
+		if (chunk == NULL)
+			return -1;
+		chunk->next = NULL;
+		chunk->len = 0;
+		if (st->last != NULL)
+			st->last->next = chunk;
+		else
+			st->first = chunk;
+		st->last = chunk;
+		st->allocated += sizeof(struct store_chunk) + STORE_CHUNK_SIZE;
+	}
+
+	unsigned char *start = st->last->data + st->last->len;
+	unsigned char *p = start;
+	__u32 values[STORE_BLOCK_ROWS];
+	*p++ = n;
+	for (int i = 0; i < n; i++)
+	{
+		__s32 delta = (__s32)(st->block_time[i] - st->enc.prev_time);
+		values[i] = zigzag((__s32)((__u32)delta - (__u32)st->enc.prev_delta));
+		st->enc.prev_time = st->block_time[i];
+		st->enc.prev_delta = delta;
+	}
+	p = pack(p, values, n);
+	for (int c = 0; c < st->num_cells; c++)
+	{
+		const __u16 *col = st->block_regs + c * STORE_BLOCK_ROWS;
+		for (int i = 0; i < n; i++)
+		{
+			values[i] = zigzag((__s16)(col[i] - st->enc.prev_regs[c])) & 0xFFFF;
+			st->enc.prev_regs[c] = col[i];
+		}
+		p = pack(p, values, n);
+	}
+	st->last->len += p - start;
+	st->bytes += p - start;
+	st->encoded_rows += n;
+	st->block_rows = 0;
+	return 0;
+}
+
+int store_append(struct sample_store *st, const struct sample_record *rec)
+{
+	/*
+	Adds a row to the store
+
+	Returns 0 on success, -1 if memory cannot be allocated (the row is not stored)
+	*/
+	if (st->block_rows == STORE_BLOCK_ROWS && store_flush(st) != 0)
+		return -1;
+	int i = st->block_rows++;
+	st->block_time[i] = rec->time_offset;
+	for (int c = 0; c < st->num_cells; c++)
+		st->block_regs[c * STORE_BLOCK_ROWS + i] = rec->regs[c];
+	st->rows++;
+	return 0;
+}
+
+void store_free(struct sample_store *st)
+{
+	struct store_chunk *chunk = st->first;
+	while (chunk != NULL)
+	{
+		struct store_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	st->first = st->last = NULL;
+	free(st->enc.prev_regs);
+	free(st->block_time);
+	free(st->block_regs);
+	st->enc.prev_regs = NULL;
+	st->block_time = NULL;
+	st->block_regs = NULL;
+}
+
+int store_reader_init(struct store_reader *rd, const struct sample_store *st)
+{
+	/*
+	Prepares the decoding of the rows of a store, from the first one. The store
+	must be flushed and must not change while it is read
+
+	Returns 0 on success, -1 if memory cannot be allocated
+	*/
+	memset(rd, 0, sizeof(*rd));
+	rd->store = st;
+	rd->chunk = st->first;
+	rd->dec.prev_regs = (__u16*) calloc(st->num_cells + 1, sizeof(__u16));
+	rd->block_time = (__u32*) malloc(STORE_BLOCK_ROWS * sizeof(__u32));
+	rd->block_regs = (__u16*) malloc((st->num_cells + 1) * STORE_BLOCK_ROWS * sizeof(__u16));
+	if (rd->dec.prev_regs == NULL || rd->block_time == NULL || rd->block_regs == NULL)
+	{
+		store_reader_free(rd);
+		return -1;
+	}
+	return 0;
+}
+
+static void decode_block(struct store_reader *rd)
+{
+	const struct sample_store *st = rd->store;
+	while (rd->pos == rd->chunk->len)
+	{
+		rd->chunk = rd->chunk->next;
+		rd->pos = 0;
+	}
+	const unsigned char *start = rd->chunk->data + rd->pos;
+	const unsigned char *p = start;
+	__u32 values[STORE_BLOCK_ROWS];
+	int n = *p++;
+	p = unpack(p, values, n);
+	for (int i = 0; i < n; i++)
+	{
+		rd->dec.prev_delta = (__s32)((__u32)rd->dec.prev_delta + (__u32)unzigzag(values[i]));
+		rd->dec.prev_time += rd->dec.prev_delta;
+		rd->block_time[i] = rd->dec.prev_time;
+	}
+	for (int c = 0; c < st->num_cells; c++)
+	{
+		__u16 *col = rd->block_regs + c * STORE_BLOCK_ROWS;
+		p = unpack(p, values, n);
+		for (int i = 0; i < n; i++)
+		{
+			rd->dec.prev_regs[c] += unzigzag(values[i]);
+			col[i] = rd->dec.prev_regs[c];
+		}
+	}
+	rd->pos += p - start;
+	rd->block_len = n;
+	rd->block_row = 0;
+}
+
+int store_read(struct store_reader *rd, struct sample_record *rec)
+{
+	/*
+	Decodes the next row into rec
+
+	Returns 1 if a row was decoded, 0 once every encoded row was read
+	*/
+	if (rd->row == rd->store->encoded_rows)
+		return 0;
+	if (rd->block_row == rd->block_len)
+		decode_block(rd);
+	int i = rd->block_row++;
+	rec->time_offset = rd->block_time[i];
+	for (int c = 0; c < rd->store->num_cells; c++)
+		rec->regs[c] = rd->block_regs[c * STORE_BLOCK_ROWS + i];
+	rd->row++;
+	return 1;
+}
+
+void store_reader_free(struct store_reader *rd)
+{
+	free(rd->dec.prev_regs);
+	free(rd->block_time);
+	free(rd->block_regs);
+	rd->dec.prev_regs = NULL;
+	rd->block_time = NULL;
+	rd->block_regs = NULL;
+}
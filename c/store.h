@@ -0,0 +1,89 @@
+/*
+Compressed in-memory sample store.
+
+Consecutive rows differ by a few LSBs, so buffered measurements keep them
+compressed instead of as full records. Rows are collected in blocks of
+STORE_BLOCK_ROWS and every block is encoded column by column:
+
+	time		delta of the delta of the time offsets
+	registers	delta from the previous value of the same register
+			(the gap mask of the row is one more register)
+
+Deltas are zigzag coded (small negative values become small positive ones)
+and every column of a block is bit-packed with the width of its largest
+value: one width byte followed by STORE_BLOCK_ROWS values of that width.
+A column that does not change (a held value, a missing sensor, a steady
+period) takes the width byte only. The encoding is lossless.
+
+Encoded blocks are appended to chunks of STORE_CHUNK_SIZE bytes allocated as
+the measurement grows, so memory follows the number of samples actually
+taken. A reader decodes the rows back in order, one block at a time, for the
+writers. When no chunk can be allocated for the last block, its rows are lost
+and the reader stops after the encoded ones (rows - encoded_rows are dropped).
+*/
+
+#include "capture.h"
+#include <stddef.h>
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#define STORE_BLOCK_ROWS 128
+#define STORE_CHUNK_SIZE (1 << 20)
+
+struct store_chunk
+{
+	struct store_chunk *next;
+	size_t len;
+	unsigned char data[];
+};
+
+// Delta state of the columns, shared by the encoder and the decoder
+struct store_state
+{
+	__u32 prev_time;
+	__s32 prev_delta;
+	__u16 *prev_regs;
+};
+
+struct sample_store
+{
+	const struct capture_header *hdr;
+	int num_cells;
+	struct store_chunk *first;
+	struct store_chunk *last;
+	struct store_state enc;
+
+	// Rows of the block being filled, column by column
+	int block_rows;
+	__u32 *block_time;
+	__u16 *block_regs;		// num_cells x STORE_BLOCK_ROWS
+
+	__u64 rows;			// Rows appended, the block being filled included
+	__u64 encoded_rows;		// Rows of the encoded blocks, the ones a reader decodes
+	__u64 bytes;			// Encoded bytes, chunk headers excluded
+	size_t allocated;		// Bytes of all the chunks
+};
+
+struct store_reader
+{
+	const struct sample_store *store;
+	const struct store_chunk *chunk;
+	size_t pos;
+	struct store_state dec;
+	__u64 row;
+	int block_row;
+	int block_len;
+	__u32 *block_time;
+	__u16 *block_regs;
+};
+
+int store_init(struct sample_store *st, const struct capture_header *hdr);
+int store_append(struct sample_store *st, const struct sample_record *rec);
+int store_flush(struct sample_store *st);
+void store_free(struct sample_store *st);
+int store_reader_init(struct store_reader *rd, const struct sample_store *st);
+int store_read(struct store_reader *rd, struct sample_record *rec);
+void store_reader_free(struct store_reader *rd);
+
+#endif
@@ -0,0 +1,103 @@
+#include "summary.h"
+#include <stdio.h>
+
+void summary_init(struct run_summary *sum)
+{
+	sum->rows = 0;
+	sum->prev_offset = 0;
+	sum->min_meas_time = 1000000000;
+	sum->max_meas_time = 0;
+	sum->sum_meas_time = 0;
+	sum->max_current = 0;
+	sum->min_current = 0x7FFF;
+	sum->max_voltage = 0;
+	sum->min_voltage = 0x7FFF;
+	sum->max_power = 0;
+	sum->min_power = 0x7FFFFFFF;
+}
+
+void summary_add(struct run_summary *sum, const struct capture_header *hdr, const struct sample_record *rec)
+{
+	int current_enable = (hdr->fields & CAPTURE_FIELD_CURRENT) != 0;
+	int voltage_enable = (hdr->fields & CAPTURE_FIELD_VOLTAGE) != 0;
+	int power_enable = (hdr->fields & CAPTURE_FIELD_POWER) != 0;
+
+	if (sum->rows > 0)
+	{
+		// Unsigned difference so the wraparound of the 32 bit offsets is harmless
+		long long time_diff = (__u32)(rec->time_offset - sum->prev_offset);
+		sum->sum_meas_time = sum->sum_meas_time + time_diff;
+		if (time_diff>sum->max_meas_time)
+			sum->max_meas_time = time_diff;
+		if (time_diff<sum->min_meas_time)
+			sum->min_meas_time = time_diff;
+	}
+	else
+		sum->num_cells = units_layout(hdr, sum->kinds);
+	sum->prev_offset = rec->time_offset;
+
+	__s32 row[UNITS_MAX_CELLS];
+	units_row(rec->regs, sum->kinds, row, sum->num_cells);
+	__u16 gaps = capture_gaps(hdr, rec);
+	const __s32 *values = row;
+	for (__u32 s=0; s<hdr->num_sensors; s++, values += hdr->num_fields)
+	{
+		if (hdr->reachable[s]==1 && (gaps & (1 << s)) == 0)
+		{
+			if (current_enable)
+			{
+				signed short current_ma = values[0];
+				if (current_ma > sum->max_current)
+					sum->max_current = current_ma;
+				if (current_ma < sum->min_current)
+					sum->min_current = current_ma;
+			}
+			if (voltage_enable)
+			{
+				signed short voltage_mv = values[current_enable];
+				if (voltage_mv > sum->max_voltage)
+					sum->max_voltage = voltage_mv;
+				if (voltage_mv < sum->min_voltage)
+					sum->min_voltage = voltage_mv;
+			}
+			if (power_enable)
+			{
+				long power_mw = values[current_enable + voltage_enable];
+				if (power_mw > sum->max_power)
+					sum->max_power = power_mw;
+				if (power_mw < sum->min_power)
+					sum->min_power = power_mw;
+			}
+		}
+	}
+	sum->rows++;
+}
+
+void summary_print_times(const struct run_summary *sum)
+{
+	long long avg_meas_time = sum->rows > 1 ? sum->sum_meas_time/(sum->rows-1) : 0;
+	printf("Maximum measurement time: %lld us\n", sum->max_meas_time);
+	printf("Minimum measurement time: %lld us\n", sum->min_meas_time);
+	printf("Average measurement time: %lld us\n", avg_meas_time);
+}
+
+void summary_print(const struct run_summary *sum, const struct capture_header *hdr)
+{
+	summary_print_times(sum);
+
+	if (hdr->fields & CAPTURE_FIELD_CURRENT)
+	{
+		printf("Maximum Current recorded: %d mA\n",sum->max_current);
+		printf("Minimum Current recorded: %d mA\n",sum->min_current);
+	}
+	if (hdr->fields & CAPTURE_FIELD_VOLTAGE)
+	{
+		printf("Maximum Voltage recorded: %d mV\n",sum->max_voltage);
+		printf("Minimum Voltage recorded: %d mV\n",sum->min_voltage);
+	}
+	if (hdr->fields & CAPTURE_FIELD_POWER)
+	{
+		printf("Maximum Power recorded: %ld mW\n",sum->max_power);
+		printf("Minimum Power recorded: %ld mW\n",sum->min_power);
+	}
+}
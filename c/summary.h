@@ -0,0 +1,34 @@
+/*
+Whole-run summary printed at the end of a measurement: time between rows and
+minimum/maximum of every enabled quantity over the reachable sensors.
+*/
+
+#include "capture.h"
+#include "units.h"
+
+#ifndef _SUMMARY_H_
+#define _SUMMARY_H_
+
+struct run_summary
+{
+	long rows;
+	__u32 prev_offset;
+	long long min_meas_time;
+	long long max_meas_time;
+	long long sum_meas_time;
+	signed short max_current;
+	signed short min_current;
+	signed short max_voltage;
+	signed short min_voltage;
+	long max_power;
+	long min_power;
+	__u8 kinds[UNITS_MAX_CELLS];	// Unit of every register of a row, set by the first row
+	int num_cells;
+};
+
+void summary_init(struct run_summary *sum);
+void summary_add(struct run_summary *sum, const struct capture_header *hdr, const struct sample_record *rec);
+void summary_print_times(const struct run_summary *sum);
+void summary_print(const struct run_summary *sum, const struct capture_header *hdr);
+
+#endif
@@ -0,0 +1,95 @@
+#include "units.h"
+
+static inline __s32 scale_5_4(__s32 v)
+{
+	// round(v * 1.25) truncated to 16 bits, the way reg_to_amp() and reg_to_volt() return it
+	__s32 x = v * 5;
+	__s32 sign = x >> 31;
+	__s32 mag = (x ^ sign) - sign;
+	return (__s16)((((mag + 2) >> 2) ^ sign) - sign);
+}
+
+void units_amps(const __u16 *raw, __s16 *ma, size_t n)
+{
+	/*
+	Converts current registers to milliamperes
+
+	Parameters:
+		raw: n current registers
+		ma: receives the n currents, as reg_to_amp() returns them
+	*/
+	for (size_t i = 0; i < n; i++)
+	{
+		// reg_to_amp() takes 65535 (not 65536) off the negative values, one bit above their two's complement
+		__s32 v = (__s16)raw[i] + (raw[i] >> 15);
+		ma[i] = scale_5_4(v);
+	}
+}
+
+void units_volts(const __u16 *raw, __s16 *mv, size_t n)
+{
+	/*
+	Converts voltage registers to millivolts
+
+	Parameters:
+		raw: n voltage registers
+		mv: receives the n voltages, as reg_to_volt() returns them
+	*/
+	for (size_t i = 0; i < n; i++)
+		mv[i] = scale_5_4((__s16)raw[i]);
+}
+
+void units_watts(const __u16 *raw, __u32 *mw, size_t n)
+{
+	/*
+	Converts power registers to milliwatts
+
+	Parameters:
+		raw: n power registers
+		mw: receives the n powers, as reg_to_watt() returns them
+	*/
+	for (size_t i = 0; i < n; i++)
+		mw[i] = (__u32)raw[i] * 10;
+}
+
+int units_layout(const struct capture_header *hdr, __u8 *kinds)
+{
+	/*
+	Kind of every cell of the records of hdr
+
+	Parameters:
+		kinds: receives UNIT_* for each of the num_sensors * num_fields cells (UNITS_MAX_CELLS at most)
+
+	Returns the number of cells
+	*/
+	int n = 0;
+	for (__u32 s = 0; s < hdr->num_sensors; s++)
+	{
+		if (hdr->fields & CAPTURE_FIELD_CURRENT)
+			kinds[n++] = UNIT_CURRENT;
+		if (hdr->fields & CAPTURE_FIELD_VOLTAGE)
+			kinds[n++] = UNIT_VOLTAGE;
+		if (hdr->fields & CAPTURE_FIELD_POWER)
+			kinds[n++] = UNIT_POWER;
+	}
+	return n;
+}
+
+void units_row(const __u16 *raw, const __u8 *kinds, __s32 *out, size_t n)
+{
+	/*
+	Converts cells of mixed kinds, e.g. the registers of a record
+
+	Parameters:
+		kinds: UNIT_* of each cell, from units_layout()
+		out: receives the n values in mA, mV or mW
+	*/
+	for (size_t i = 0; i < n; i++)
+	{
+		// Every conversion is computed and the one of the cell is selected, so the loop has no branches
+		__s32 current = kinds[i] == UNIT_CURRENT;
+		__s32 scaled = scale_5_4((__s16)raw[i] + (current & (raw[i] >> 15)));
+		__s32 power = (__s32)raw[i] * 10;
+		out[i] = kinds[i] == UNIT_POWER ? power : scaled;
+	}
+}
@@ -0,0 +1,37 @@
+/*
+Batch conversion of register values to mA, mV and mW.
+
+The routines give exactly the results of reg_to_amp(), reg_to_volt() and
+reg_to_watt(), in integer fixed point instead of double math and round():
+1.25 per bit is (5 x raw) / 4 rounded half away from zero, 10 mW per bit is
+an integer multiply. The loops have no branches or calls, so the compiler
+vectorizes them (units.o is built with -O3): SSE2 on x86-64, NEON on ARM.
+
+units_row() converts the cells of a record, whose fields are interleaved
+(for each sensor: current, voltage, power, the enabled ones only), with the
+kind of every cell given by units_layout(). Cells of missing sensors are
+converted like any other value, callers test the gap mask of the row.
+
+ina260_bench (bench/bench.c) checks every register value against the scalar
+routines.
+*/
+
+#include "capture.h"
+#include <stddef.h>
+
+#ifndef _UNITS_H_
+#define _UNITS_H_
+
+#define UNIT_CURRENT 0		// mA
+#define UNIT_VOLTAGE 1		// mV
+#define UNIT_POWER 2		// mW
+
+#define UNITS_MAX_CELLS (CAPTURE_MAX_SENSORS * 3)
+
+void units_amps(const __u16 *raw, __s16 *ma, size_t n);
+void units_volts(const __u16 *raw, __s16 *mv, size_t n);
+void units_watts(const __u16 *raw, __u32 *mw, size_t n);
+int units_layout(const struct capture_header *hdr, __u8 *kinds);
+void units_row(const __u16 *raw, const __u8 *kinds, __s32 *out, size_t n);
+
+#endif
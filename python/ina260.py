@@ -1,4 +1,3 @@
-from smbus2 import SMBus
 import time
 
 PCA_AUTOINCREMENT_OFF = 0x00
@@ -51,6 +50,8 @@ LEN = 0
 class INA260:
        
     def __init__(self, address=0x40, channel=1):
+        # Only the register access needs smbus2, capture() runs in the native module
+        from smbus2 import SMBus
         self.i2c_channel = channel
         self.bus = SMBus(self.i2c_channel)
         self.address = address
@@ -243,3 +244,65 @@ class INA260:
 
     def __del__(self):
         self.bus.close()
+
+
+class Capture:
+    """
+    Rows captured by the native module: time_us (one per row) and, for each sensor, current (A),
+    voltage (V) and power (W) arrays of the enabled measurements. gaps holds one bit per sensor
+    and row, set when the sensor has no value (read error, sensor being recovered, missed
+    deadline); those values are NaN. Arrays are numpy arrays when numpy is installed, memoryviews of the raw
+    registers otherwise (regs only).
+    """
+
+    def __init__(self, result):
+        self.rows = result["rows"]
+        self.num_sensors = result["num_sensors"]
+        self.reachable = result["reachable"]
+        self.missed = result["missed"]
+        self.i2c_error = result["i2c_error"]
+        self.start_unix = result["start_unix"]
+        self.fields = [name for name, on in zip(("current", "voltage", "power"), result["fields"]) if on]
+        num_cols = self.num_sensors * len(self.fields)
+        try:
+            import numpy as np
+        except ImportError:
+            np = None
+        if np is None:
+            self.time_us = memoryview(result["time_us"]).cast("I")
+            self.regs = memoryview(result["regs"]).cast("H", (self.rows, num_cols))
+            self.gaps = memoryview(result["gaps"]).cast("H")
+            return
+        # No copy: the arrays view the bytes returned by the module
+        self.time_us = np.frombuffer(result["time_us"], dtype=np.uint32)
+        self.regs = np.frombuffer(result["regs"], dtype=np.uint16).reshape(self.rows, num_cols)
+        self.gaps = np.frombuffer(result["gaps"], dtype=np.uint16)
+        # One column per sensor and field, like regs
+        missing = ((self.gaps[:, None] >> np.arange(self.num_sensors)) & 1).astype(bool)
+        scale = {"current": 0.00125, "voltage": 0.00125, "power": 0.01}
+        for i, name in enumerate(self.fields):
+            raw = self.regs[:, i::len(self.fields)]
+            # The current register is signed (two's complement)
+            value = (raw.view(np.int16) if name == "current" else raw).astype(np.float64) * scale[name]
+            value[missing] = np.nan
+            setattr(self, name, value)
+
+
+def capture(sensors, duration, sampling_time_us=140, channel=1, current=True, voltage=False, power=False,
+            batch=False, fast_read=False, backend=None):
+    """
+    Captures several sensors at the sample rates of the C code: the sampling runs in the native
+    module (python3 setup.py build_ext --inplace), without the GIL
+
+    Parameters
+        sensors: addresses on "channel", or (channel, address) pairs
+        duration: measurement time in seconds
+        sampling_time_us: INA260 conversion time and sampling period (140, 204, 332, 588, 1100, 2116, 4156, 8244)
+        batch, fast_read: combined transfer per bus and row, reads without the register select byte
+        backend: "i2c-dev" (default) or "sim[:options]"
+
+    Returns a Capture
+    """
+    import ina260_native
+    return Capture(ina260_native.capture(sensors, duration, sampling_time_us, channel, current, voltage, power,
+                                         batch, fast_read, backend))
@@ -0,0 +1,414 @@
+/*
+Native captures for the Python package.
+
+capture() runs the acquisition threads of the C code (sampler.h): one thread
+per I2C adapter on the shared sampling deadlines, merged into rows. The whole
+capture, from the configuration of the sensors to the last row, runs with the
+GIL released, so other Python threads keep running and no Python object is
+created per sample. The rows come back as two bytes objects that numpy (or
+memoryview.cast) reads without a copy:
+
+	time_us		uint32 per row, microseconds since the start
+	regs		uint16 per row and column, raw registers in the column
+			order of the C captures (for each sensor: current,
+			voltage, power, the enabled ones only)
+	gaps		uint16 per row, bit s set when sensor s has no value
+			(read error, sensor being recovered, missed deadline or
+			unreachable sensor)
+
+The registers of a gap hold CAPTURE_MISSING (0x7FFF), which is also a valid
+reading: only the gap mask tells them apart. ina260.py wraps the bytes into
+numpy arrays and converts the units.
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "INA260.h"
+#include "bus.h"
+#include "capture.h"
+#include "sampler.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NATIVE_INIT_RETRY_NUM 5		// Attempts to configure each sensor
+#define NATIVE_MERGE_IDLE_US 100	// Sleep of the merger when no bus has a new row
+
+// Failures of run_capture
+#define NATIVE_NO_MEMORY -1		// The records or a sampler could not be allocated
+#define NATIVE_NO_SAMPLER -2		// A sampler thread or its combined transfer could not be set up
+
+struct native_capture
+{
+	// Request
+	int num_sensors;
+	__u8 addrs[CAPTURE_MAX_SENSORS];
+	__u8 buses[CAPTURE_MAX_SENSORS];
+	__u8 current_enable;
+	__u8 voltage_enable;
+	__u8 power_enable;
+	__u8 batch_enable;
+	__u8 fast_read;
+	int conversion_time;
+	long num_samples;
+
+	// Result
+	__u8 reachable[CAPTURE_MAX_SENSORS];
+	struct capture_header hdr;
+	unsigned char *records;
+	long rows;
+	long missed;			// Deadlines a bus missed (gaps of its sensors)
+	int i2c_error;
+	int error_adapter;		// Adapter and errno of the sampler that could not be started
+	int error_errno;
+};
+
+static int run_capture(struct native_capture *nc)
+{
+	/*
+	Configures the sensors and captures nc->num_samples rows. Runs without the GIL
+
+	Returns 0 on success (unreachable sensors included), NATIVE_NO_MEMORY if memory cannot be allocated,
+	NATIVE_NO_SAMPLER if a sampler cannot be started (nc->error_adapter and nc->error_errno tell which and why)
+	*/
+	struct ina260_dev devs[CAPTURE_MAX_SENSORS];
+	struct ina260_profile profiles[CAPTURE_MAX_SENSORS];
+	memset(devs, 0, sizeof(devs));
+	__u8 current_convert = nc->current_enable | nc->power_enable;
+	__u8 voltage_convert = nc->voltage_enable | nc->power_enable;
+	for (int s = 0; s < nc->num_sensors; s++)
+	{
+		ina260_profile_default(&profiles[s], current_convert, voltage_convert, nc->conversion_time);
+		nc->reachable[s] = 0;
+		for (int r = 0; r < NATIVE_INIT_RETRY_NUM && nc->reachable[s] == 0; r++)
+		{
+			int status = ina260_dev_open(&devs[s], nc->buses[s], nc->addrs[s]);
+			if (status == INA260_OK)
+				status = ina260_dev_configure_profile(&devs[s], &profiles[s]);
+			if (status == INA260_OK)
+				nc->reachable[s] = 1;
+			else
+			{
+				ina260_dev_close(&devs[s]);
+				usleep(30000);
+			}
+		}
+		devs[s].fast_read = nc->fast_read;
+	}
+
+	__u32 fields = (nc->current_enable ? CAPTURE_FIELD_CURRENT : 0) | (nc->voltage_enable ? CAPTURE_FIELD_VOLTAGE : 0) |
+		       (nc->power_enable ? CAPTURE_FIELD_POWER : 0);
+	capture_header_init(&nc->hdr, nc->num_sensors, nc->addrs, nc->buses, nc->reachable, fields, nc->conversion_time);
+	nc->records = (unsigned char*) malloc(nc->num_samples * (long)nc->hdr.record_size);
+	if (nc->records == NULL)
+	{
+		for (int s = 0; s < nc->num_sensors; s++)
+			ina260_dev_close(&devs[s]);
+		return NATIVE_NO_MEMORY;
+	}
+
+	// Same sampling machinery as example.c, one thread per adapter pinned to its own CPU
+	struct sampler_config cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.current_enable = nc->current_enable;
+	cfg.voltage_enable = nc->voltage_enable;
+	cfg.power_enable = nc->power_enable;
+	cfg.current_convert = current_convert;
+	cfg.voltage_convert = voltage_convert;
+	cfg.batch_enable = nc->batch_enable;
+	cfg.num_fields = nc->hdr.num_fields;
+	cfg.num_samples = nc->num_samples;
+	cfg.period_ns = nc->conversion_time * 1000LL;
+	atomic_init(&cfg.stop, 0);
+
+	struct bus_sampler samplers[CAPTURE_MAX_SENSORS];
+	int num_buses = 0;
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct alert_line no_alert = { .fd = -1 };
+	int status = 0;
+	int unowned = nc->num_sensors;	// First sensor not handed over to a sampler
+	for (int s = 0; s < nc->num_sensors && status == 0; s++)
+	{
+		if (nc->reachable[s] == 0)
+			continue;
+		int b = 0;
+		while (b < num_buses && samplers[b].adapter != nc->buses[s])
+			b++;
+		if (b == num_buses)
+		{
+			if (sampler_init(&samplers[b], &cfg, nc->buses[s], num_cpus > 1 ? (b + 1) % num_cpus : -1) != 0)
+			{
+				status = NATIVE_NO_MEMORY;
+				unowned = s;
+				break;
+			}
+			num_buses++;
+		}
+		sampler_add_sensor(&samplers[b], &devs[s], &profiles[s], 1, no_alert, s);
+	}
+
+	pthread_barrier_init(&cfg.start, NULL, num_buses + 1);
+	int started = 0;
+	while (status == 0 && started < num_buses)
+	{
+		if (sampler_start(&samplers[started]) != 0)
+		{
+			status = errno == ENOMEM ? NATIVE_NO_MEMORY : NATIVE_NO_SAMPLER;
+			nc->error_adapter = samplers[started].adapter;
+			nc->error_errno = errno;
+		}
+		else
+			started++;
+	}
+	if (status != 0)
+	{
+		// The samplers started so far are released to stop at once
+		atomic_store_explicit(&cfg.stop, 1, memory_order_relaxed);
+		if (started > 0)
+			pthread_barrier_wait(&cfg.start);
+		for (int b = 0; b < started; b++)
+			sampler_join(&samplers[b]);
+		for (int b = 0; b < num_buses; b++)
+			sampler_free(&samplers[b]);
+		for (int s = unowned; s < nc->num_sensors; s++)
+			ina260_dev_close(&devs[s]);
+		pthread_barrier_destroy(&cfg.start);
+		free(nc->records);
+		nc->records = NULL;
+		return status;
+	}
+
+	struct timespec start_realtime;
+	clock_gettime(CLOCK_REALTIME, &start_realtime);
+	cfg.start_us = sched_now_ns() / 1000;
+	capture_header_start(&nc->hdr, start_realtime, cfg.start_us);
+	pthread_barrier_wait(&cfg.start);
+
+	nc->rows = 0;
+	while (nc->rows < nc->num_samples)
+	{
+		struct sample_record *rec = (struct sample_record*) (nc->records + nc->rows * (long)nc->hdr.record_size);
+		for (int b = 0; b < num_buses; b++)
+		{
+			if (samplers[b].i2c_error)
+				atomic_store_explicit(&cfg.stop, 1, memory_order_relaxed);
+		}
+		int merged = sampler_merge_next(samplers, num_buses, &nc->hdr, rec);
+		if (merged < 0)
+			break;
+		if (merged == 0)
+		{
+			usleep(NATIVE_MERGE_IDLE_US);
+			continue;
+		}
+		// Columns of unreachable sensors are not written by the samplers
+		__u16 gaps = capture_gaps(&nc->hdr, rec);
+		for (int s = 0; s < nc->num_sensors; s++)
+		{
+			if (nc->reachable[s] == 0)
+			{
+				for (__u32 f = 0; f < nc->hdr.num_fields; f++)
+					rec->regs[s * nc->hdr.num_fields + f] = CAPTURE_MISSING;
+				gaps |= 1 << s;
+			}
+		}
+		capture_set_gaps(&nc->hdr, rec, gaps);
+		nc->rows++;
+	}
+
+	nc->missed = 0;
+	nc->i2c_error = 0;
+	for (int b = 0; b < num_buses; b++)
+	{
+		sampler_join(&samplers[b]);
+		nc->missed += samplers[b].dropped_rows + samplers[b].sched.overruns;
+		nc->i2c_error |= samplers[b].i2c_error;
+		sampler_free(&samplers[b]);
+	}
+	pthread_barrier_destroy(&cfg.start);
+	return 0;
+}
+
+static int parse_sensors(PyObject *sensors, int adapter, struct native_capture *nc)
+{
+	// Sensors are addresses on the default adapter or (adapter, address) pairs. Returns -1 with an exception set
+	PyObject *seq = PySequence_Fast(sensors, "sensors must be a sequence of addresses or (adapter, address) pairs");
+	if (seq == NULL)
+		return -1;
+	Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+	if (n < 1 || n > CAPTURE_MAX_SENSORS)
+	{
+		Py_DECREF(seq);
+		PyErr_Format(PyExc_ValueError, "between 1 and %d sensors are supported", CAPTURE_MAX_SENSORS);
+		return -1;
+	}
+	for (Py_ssize_t s = 0; s < n; s++)
+	{
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, s);
+		int bus = adapter, addr;
+		if (PyTuple_Check(item))
+		{
+			if (!PyArg_ParseTuple(item, "ii", &bus, &addr))
+			{
+				Py_DECREF(seq);
+				return -1;
+			}
+		}
+		else
+		{
+			addr = PyLong_AsLong(item);
+			if (addr == -1 && PyErr_Occurred())
+			{
+				Py_DECREF(seq);
+				return -1;
+			}
+		}
+		if (bus < 0 || bus > 255 || addr < 0x03 || addr > 0x77)
+		{
+			Py_DECREF(seq);
+			PyErr_Format(PyExc_ValueError, "invalid sensor %d:%#x", bus, addr);
+			return -1;
+		}
+		nc->buses[s] = bus;
+		nc->addrs[s] = addr;
+	}
+	nc->num_sensors = n;
+	Py_DECREF(seq);
+	return 0;
+}
+
+static PyObject *native_capture(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static char *keywords[] = {"sensors", "duration", "sampling_time_us", "adapter", "current", "voltage", "power",
+				   "batch", "fast_read", "backend", NULL};
+	PyObject *sensors;
+	double duration;
+	int sampling_time_us = 140, adapter = 1;
+	int current = 1, voltage = 0, power = 0, batch = 0, fast_read = 0;
+	const char *backend = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Od|iipppppz", keywords, &sensors, &duration, &sampling_time_us,
+					 &adapter, &current, &voltage, &power, &batch, &fast_read, &backend))
+		return NULL;
+
+	struct native_capture *nc = (struct native_capture*) PyMem_Calloc(1, sizeof(struct native_capture));
+	if (nc == NULL)
+		return PyErr_NoMemory();
+	if (parse_sensors(sensors, adapter, nc) != 0)
+	{
+		PyMem_Free(nc);
+		return NULL;
+	}
+	struct ina260_profile check;
+	__u16 config;
+	ina260_profile_default(&check, 1, 1, sampling_time_us);
+	if (ina260_profile_config(&check, &config) != INA260_OK || duration <= 0)
+	{
+		PyMem_Free(nc);
+		PyErr_SetString(PyExc_ValueError, "invalid sampling time or duration");
+		return NULL;
+	}
+	if (backend != NULL && bus_select(backend) != 0)
+	{
+		PyMem_Free(nc);
+		PyErr_Format(PyExc_ValueError, "unknown bus backend %s", backend);
+		return NULL;
+	}
+	nc->current_enable = current || !(voltage || power);
+	nc->voltage_enable = voltage;
+	nc->power_enable = power;
+	nc->batch_enable = batch;
+	nc->fast_read = fast_read;
+	nc->conversion_time = sampling_time_us;
+	nc->num_samples = (long)(duration * 1e6 / sampling_time_us + 0.5);
+	if (nc->num_samples < 1)
+		nc->num_samples = 1;
+
+	int status;
+	Py_BEGIN_ALLOW_THREADS
+	status = run_capture(nc);
+	Py_END_ALLOW_THREADS
+	if (status == NATIVE_NO_SAMPLER)
+	{
+		// OSError(errno, message), raised as the subclass of the errno (e.g. PermissionError)
+		char message[128];
+		snprintf(message, sizeof(message), "cannot start the sampler of adapter %d: %s", nc->error_adapter,
+			 strerror(nc->error_errno));
+		PyObject *args = Py_BuildValue("(is)", nc->error_errno, message);
+		if (args != NULL)
+		{
+			PyErr_SetObject(PyExc_OSError, args);
+			Py_DECREF(args);
+		}
+		PyMem_Free(nc);
+		return NULL;
+	}
+	if (status != 0)
+	{
+		PyMem_Free(nc);
+		return PyErr_NoMemory();
+	}
+
+	// Splitting the records into the time column and the register matrix
+	__u32 num_fields = nc->hdr.num_fields;
+	long num_cols = nc->num_sensors * (long)num_fields;
+	PyObject *time_us = PyBytes_FromStringAndSize(NULL, nc->rows * sizeof(__u32));
+	PyObject *regs = PyBytes_FromStringAndSize(NULL, nc->rows * num_cols * sizeof(__u16));
+	PyObject *gaps = PyBytes_FromStringAndSize(NULL, nc->rows * sizeof(__u16));
+	PyObject *result = NULL;
+	if (time_us != NULL && regs != NULL && gaps != NULL)
+	{
+		__u32 *t = (__u32*) PyBytes_AS_STRING(time_us);
+		__u16 *r = (__u16*) PyBytes_AS_STRING(regs);
+		__u16 *g = (__u16*) PyBytes_AS_STRING(gaps);
+		for (long i = 0; i < nc->rows; i++)
+		{
+			const struct sample_record *rec = capture_record(&nc->hdr, nc->records, i);
+			t[i] = rec->time_offset;
+			memcpy(r + i * num_cols, rec->regs, num_cols * sizeof(__u16));
+			g[i] = capture_gaps(&nc->hdr, rec);
+		}
+		PyObject *reachable = PyList_New(nc->num_sensors);
+		for (int s = 0; reachable != NULL && s < nc->num_sensors; s++)
+			PyList_SET_ITEM(reachable, s, PyBool_FromLong(nc->reachable[s]));
+		if (reachable != NULL)
+			result = Py_BuildValue("{s:O,s:O,s:O,s:l,s:i,s:N,s:(NNN),s:l,s:i,s:d}", "time_us", time_us, "regs", regs,
+					       "gaps", gaps,
+					       "rows", nc->rows, "num_sensors", nc->num_sensors, "reachable", reachable,
+					       "fields", PyBool_FromLong(nc->current_enable), PyBool_FromLong(nc->voltage_enable),
+					       PyBool_FromLong(nc->power_enable),
+					       "missed", nc->missed, "i2c_error", nc->i2c_error, "start_unix",
+					       nc->hdr.start_realtime_sec + nc->hdr.start_realtime_nsec / 1e9);
+	}
+	Py_XDECREF(time_us);
+	Py_XDECREF(regs);
+	Py_XDECREF(gaps);
+	free(nc->records);
+	PyMem_Free(nc);
+	return result;
+}
+
+static PyMethodDef native_methods[] =
+{
+	{"capture", (PyCFunction)(void(*)(void))native_capture, METH_VARARGS | METH_KEYWORDS,
+	 "capture(sensors, duration, sampling_time_us=140, adapter=1, current=True, voltage=False, power=False,\n"
+	 "        batch=False, fast_read=False, backend=None)\n\n"
+	 "Captures the sensors (addresses or (adapter, address) pairs) for duration seconds with the C samplers,\n"
+	 "without the GIL. Returns a dict with time_us (uint32 bytes), regs (uint16 bytes, rows x columns) and\n"
+	 "gaps (uint16 bytes, a bitmask of the sensors without a value in each row)."},
+	{NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef native_module =
+{
+	PyModuleDef_HEAD_INIT, "ina260_native", "Native INA260 captures", -1, native_methods
+};
+
+PyMODINIT_FUNC PyInit_ina260_native(void)
+{
+	PyObject *m = PyModule_Create(&native_module);
+	if (m != NULL)
+		PyModule_AddIntConstant(m, "CAPTURE_MISSING", CAPTURE_MISSING);
+	return m;
+}
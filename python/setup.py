@@ -0,0 +1,16 @@
+# Builds the native capture module: python3 setup.py build_ext --inplace
+from setuptools import setup, Extension
+
+C_DIR = "../c"
+C_SOURCES = ["INA260.c", "bus.c", "smbus.c", "sim_ina260.c", "sampler.c", "deadline.c", "spsc_ring.c", "latency.c", "rt.c",
+             "alert.c", "capture.c"]
+
+native = Extension(
+    "ina260_native",
+    sources=["ina260_native.c"] + [C_DIR + "/" + f for f in C_SOURCES],
+    include_dirs=[C_DIR],
+    extra_compile_args=["-O2"],
+    libraries=["m", "pthread", "rt"],
+)
+
+setup(name="ina260", version="0.1", py_modules=["ina260"], ext_modules=[native])